@@ -0,0 +1,183 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+/*
+ * Time the notify registry with many entries.
+ *
+ * usage: notifybench [-n count] directory
+ *
+ * Creates count directories below the directory, a thousand to a parent,
+ * unless they are there from an earlier run, and registers all of them,
+ * registers them all again, which only looks up the entries, and
+ * unregisters them by path. Last they are registered once more to time
+ * mfs_notify_stop() with a full registry. Every directory takes an
+ * inotify watch on Linux, so fs.inotify.max_user_watches must allow count
+ * of them.
+ */
+
+/* asprintf() */
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mfs_notify.h>
+
+/* What mfs_notify.o expects from the rest of musicfs. */
+pthread_mutex_t __debug_lock__ = PTHREAD_MUTEX_INITIALIZER;
+
+#define PERPARENT	1000
+
+static char **paths;
+static int npaths;
+
+static double
+now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void
+ignore(struct mfs_notify_event *ev)
+{
+}
+
+/* Create the directories, and remember their paths. */
+static int
+populate(const char *dirpath, int count)
+{
+	char *path;
+	int i;
+
+	if (mkdir(dirpath, 0755) < 0 && errno != EEXIST) {
+		perror(dirpath);
+		return (-1);
+	}
+	if ((paths = calloc(count, sizeof(*paths))) == NULL)
+		return (-1);
+	for (i = 0; i < count; i++) {
+		if (i % PERPARENT == 0) {
+			if (asprintf(&path, "%s/%04d", dirpath,
+			    i / PERPARENT) < 0)
+				return (-1);
+			if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+				perror(path);
+				free(path);
+				return (-1);
+			}
+			free(path);
+		}
+		if (asprintf(&paths[i], "%s/%04d/%04d", dirpath,
+		    i / PERPARENT, i % PERPARENT) < 0)
+			return (-1);
+		if (mkdir(paths[i], 0755) < 0 && errno != EEXIST) {
+			perror(paths[i]);
+			return (-1);
+		}
+		npaths++;
+	}
+	return (0);
+}
+
+/* Call op on every path, and return the time it took. */
+static double
+run(int (*op)(const char *), int *nfailed)
+{
+	double start;
+	int i;
+
+	*nfailed = 0;
+	start = now();
+	for (i = 0; i < npaths; i++) {
+		if (op(paths[i]) != 0)
+			(*nfailed)++;
+	}
+	return (now() - start);
+}
+
+static void
+report(const char *what, int nfailed, double secs)
+{
+
+	printf("%-28s %8d paths %7d failed %9.1f ms %6.2f us/path\n", what,
+	    npaths, nfailed, secs * 1000, npaths > 0 ? secs * 1e6 / npaths : 0);
+}
+
+int
+main(int argc, char **argv)
+{
+	double secs;
+	int ch, count, nfailed;
+
+	count = 1000000;
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1 || count < 1)
+		goto usage;
+
+	secs = now();
+	if (populate(argv[optind], count) != 0)
+		return (1);
+	report("mkdir", 0, now() - secs);
+
+	if (mfs_notify_init(ignore) != 0) {
+		fprintf(stderr, "Unable to start notification\n");
+		return (1);
+	}
+	secs = run(mfs_notify_register, &nfailed);
+	report("mfs_notify_register", nfailed, secs);
+	if (nfailed > 0)
+		fprintf(stderr, "Raise fs.inotify.max_user_watches above %d\n",
+		    count);
+	secs = run(mfs_notify_register, &nfailed);
+	report("mfs_notify_register, again", nfailed, secs);
+	secs = run(mfs_notify_unregister_file, &nfailed);
+	report("mfs_notify_unregister_file", nfailed, secs);
+
+	run(mfs_notify_register, &nfailed);
+	secs = now();
+	mfs_notify_stop();
+	report("mfs_notify_stop", nfailed, now() - secs);
+	return (0);
+
+usage:
+	fprintf(stderr, "usage: notifybench [-n count] directory\n");
+	return (1);
+}
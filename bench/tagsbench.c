@@ -0,0 +1,233 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+/*
+ * Time the native tag reader against taglib.
+ *
+ * usage: tagsbench [-p passes] directory
+ *
+ * The tags of every regular file below the directory are read with
+ * mfs_tags_read(), as the scanner does without the buffers its I/O stage
+ * fills, and with mfs_tags_taglib(). The files are read once first, so
+ * that both readers find them in the page cache, and the best of the
+ * passes is reported. taglib is timed both on the files the native reader
+ * knows, which is the comparison that matters, and on all of them.
+ */
+
+/* asprintf() */
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tag_c.h>
+#include <musicfs.h>
+#include <mfs_tags.h>
+
+/* What mfs_tags.o expects from the rest of musicfs. */
+struct mfs_options mfs_opts;
+pthread_mutex_t __debug_lock__ = PTHREAD_MUTEX_INITIALIZER;
+
+struct benchfile {
+	char *bf_path;
+	off_t bf_size;
+	int bf_native;		/* The native reader knows it. */
+};
+
+static struct benchfile *files;
+static int nfiles, maxfiles;
+
+static double
+now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void
+collect(const char *dirpath)
+{
+	DIR *dirp;
+	struct dirent *dp;
+	struct stat st;
+	struct benchfile *tmp;
+	char *path;
+
+	if ((dirp = opendir(dirpath)) == NULL)
+		return;
+	while ((dp = readdir(dirp)) != NULL) {
+		if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, ".."))
+			continue;
+		if (asprintf(&path, "%s/%s", dirpath, dp->d_name) < 0)
+			continue;
+		if (stat(path, &st) < 0) {
+			free(path);
+			continue;
+		}
+		if (S_ISDIR(st.st_mode)) {
+			collect(path);
+			free(path);
+			continue;
+		}
+		if (!S_ISREG(st.st_mode)) {
+			free(path);
+			continue;
+		}
+		if (nfiles == maxfiles) {
+			maxfiles = maxfiles > 0 ? maxfiles * 2 : 256;
+			tmp = realloc(files, maxfiles * sizeof(*files));
+			if (tmp == NULL) {
+				free(path);
+				break;
+			}
+			files = tmp;
+		}
+		files[nfiles].bf_path = path;
+		files[nfiles].bf_size = st.st_size;
+		files[nfiles].bf_native = 0;
+		nfiles++;
+	}
+	closedir(dirp);
+}
+
+/* Read a file with the native reader. Returns as mfs_tags_read(). */
+static int
+readnative(struct benchfile *bf)
+{
+	struct mfs_tagfile tf;
+	struct mfs_tags tags;
+	int ret;
+
+	memset(&tf, 0, sizeof(tf));
+	tf.tf_fd = open(bf->bf_path, O_RDONLY);
+	if (tf.tf_fd < 0)
+		return (MFS_TAGS_ERROR);
+	tf.tf_size = bf->bf_size;
+	ret = mfs_tags_read(&tf, bf->bf_path, &tags);
+	close(tf.tf_fd);
+	mfs_tags_free(&tags);
+	return (ret);
+}
+
+static int
+readtaglib(struct benchfile *bf)
+{
+	struct mfs_tags tags;
+	int ret;
+
+	ret = mfs_tags_taglib(bf->bf_path, &tags);
+	mfs_tags_free(&tags);
+	return (ret);
+}
+
+/*
+ * Read the files with a reader, only those the native reader knows if
+ * asked to, and return the best time of the passes.
+ */
+static double
+run(int (*reader)(struct benchfile *), int nativeonly, int passes, int *nread)
+{
+	double best, start, secs;
+	int i, pass;
+
+	best = 0;
+	for (pass = 0; pass < passes; pass++) {
+		*nread = 0;
+		start = now();
+		for (i = 0; i < nfiles; i++) {
+			if (nativeonly && !files[i].bf_native)
+				continue;
+			if (reader(&files[i]) == MFS_TAGS_OK)
+				(*nread)++;
+		}
+		secs = now() - start;
+		if (pass == 0 || secs < best)
+			best = secs;
+	}
+	return (best);
+}
+
+static void
+report(const char *what, int n, int nread, double secs)
+{
+
+	printf("%-28s %7d files %7d read %9.1f ms %8.1f us/file\n", what, n,
+	    nread, secs * 1000, n > 0 ? secs * 1e6 / n : 0);
+}
+
+int
+main(int argc, char **argv)
+{
+	double secs;
+	int ch, i, nnative, nread, passes;
+
+	passes = 3;
+	while ((ch = getopt(argc, argv, "p:")) != -1) {
+		switch (ch) {
+		case 'p':
+			passes = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1 || passes < 1)
+		goto usage;
+
+	taglib_set_string_management_enabled(0);
+	collect(argv[optind]);
+	if (nfiles == 0) {
+		fprintf(stderr, "No files in %s\n", argv[optind]);
+		return (1);
+	}
+
+	/* Warm the cache, and find out which files are ours. */
+	nnative = 0;
+	for (i = 0; i < nfiles; i++) {
+		files[i].bf_native = (readnative(&files[i]) == MFS_TAGS_OK);
+		nnative += files[i].bf_native;
+		readtaglib(&files[i]);
+	}
+
+	secs = run(readnative, 1, passes, &nread);
+	report("mfs_tags_read", nnative, nread, secs);
+	secs = run(readtaglib, 1, passes, &nread);
+	report("mfs_tags_taglib, same files", nnative, nread, secs);
+	secs = run(readtaglib, 0, passes, &nread);
+	report("mfs_tags_taglib, all files", nfiles, nread, secs);
+	return (0);
+
+usage:
+	fprintf(stderr, "usage: tagsbench [-p passes] directory\n");
+	return (1);
+}
@@ -1,31 +1,94 @@
--- Could have saved two table here. But having them avoids redundancy as well as
--- make it possible for future enhancements.
-
+-- Artists, genres and albums have integer ids, which songs refer to. A
+-- name is looked up by its key, which is case folded and normalized (see
+-- mfs_key()).
 CREATE TABLE artist (
-	name varchar(200) NOT NULL,
-	PRIMARY KEY(name)
+	id integer PRIMARY KEY,
+	name varchar(200) NOT NULL UNIQUE,
+	namekey varchar(200) NOT NULL
+);
+
+CREATE INDEX artist_key ON artist(namekey);
+
+CREATE TABLE genre (
+	id integer PRIMARY KEY,
+	name varchar(200) NOT NULL UNIQUE,
+	namekey varchar(200) NOT NULL
+);
+
+CREATE INDEX genre_key ON genre(namekey);
+
+-- An album belongs to an artist, so albums with the same title by
+-- different artists are kept apart. dirname is the name of the album
+-- under /Albums: its title, with the artist added when another album
+-- already has that title.
+CREATE TABLE album (
+	id integer PRIMARY KEY,
+	artistid integer NOT NULL REFERENCES artist(id),
+	title varchar(200) NOT NULL,
+	titlekey varchar(200) NOT NULL,
+	dirname varchar(255) NOT NULL,
+	dirkey varchar(255) NOT NULL,
+	UNIQUE(artistid, title)
 );
 
+CREATE INDEX album_title ON album(artistid, titlekey);
+CREATE INDEX album_dir ON album(dirkey);
+
+-- entryname is the name of the file in an album directory ("01
+-- Title.mp3"), and trackname its name under /Tracks ("Artist -
+-- Title.mp3").
 CREATE TABLE song (
+	id integer PRIMARY KEY,
 	title varchar(200) NOT NULL,
-	album varchar(200),
-	artistname varchar(200),
-	genrename varchar(200),
+	albumid integer NOT NULL REFERENCES album(id),
+	genreid integer REFERENCES genre(id),
 	filepath varchar(255),
 	year int,
 	track varchar(8),
 	extension varchar(50),
 	mtime int,
-	PRIMARY KEY(title, artistname, album, year)
+	size int,
+	generation int NOT NULL DEFAULT 0,
+	dev int,
+	ino int,
+	entryname varchar(255),
+	trackname varchar(255),
+	entrykey varchar(255),
+	trackkey varchar(255),
+	UNIQUE(albumid, title, year)
 );
 
-CREATE TABLE genre (
-	name varchar(200) NOT NULL,
-	PRIMARY KEY(name)
-);
+CREATE INDEX song_filepath ON song(filepath);
+-- Files that are moved or renamed are found again by their inode.
+CREATE INDEX song_inode ON song(ino, dev);
+-- A file is looked up by an index that also holds its path.
+CREATE INDEX song_album_entry ON song(albumid, entrykey, filepath);
+CREATE INDEX song_trackname ON song(trackkey, filepath);
+CREATE INDEX song_genre ON song(genreid, albumid);
 
 CREATE TABLE path (
 	path varchar(255),
 	active integer NOT NULL,
 	PRIMARY KEY(path)
 );
+
+-- Scan journal. Every scan of a music path has a generation, which is
+-- stamped on the songs it sees, and the directories it has finished are
+-- recorded, so that an interrupted scan can be resumed. When the scan
+-- completes, songs from older generations are removed.
+CREATE TABLE scan (
+	path varchar(255) NOT NULL,
+	generation int NOT NULL,
+	complete int NOT NULL,
+	PRIMARY KEY(path)
+);
+
+CREATE TABLE scan_dir (
+	path varchar(255) NOT NULL,
+	dirpath varchar(4096) NOT NULL,
+	generation int NOT NULL,
+	PRIMARY KEY(path, dirpath)
+);
+
+-- Must match MFS_DB_VERSION in include/mfs_db.h
+PRAGMA user_version = 6;
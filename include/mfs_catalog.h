@@ -0,0 +1,74 @@
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+#ifndef _MFS_CATALOG_H_
+#define _MFS_CATALOG_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/*
+ * The catalog is the tree musicfs shows, kept in memory so that FUSE
+ * requests are answered without the database. Nodes are numbered from
+ * the root, which is node 0, and the children of a directory are
+ * numbered consecutively in the order of their keys (see mfs_key()).
+ * A catalog does not change once it is built; a new one replaces it
+ * when the database has changed, and readers hold a reference to the
+ * one they use.
+ */
+#define MFS_CATALOG_ROOT	0
+#define MFS_CATALOG_NONE	UINT32_MAX
+
+struct mfs_catalog;
+
+/*
+ * Build a catalog from the database, and use it from now on. It is also
+ * saved as a snapshot, which mfs_catalog_map() uses at the next mount.
+ */
+int	mfs_catalog_load(void);
+int	mfs_catalog_map(void);
+/* Load again if it has been a while, for scans showing their progress. */
+void	mfs_catalog_refresh(void);
+/* Forget the snapshot before the database changes. */
+void	mfs_catalog_invalidate(void);
+void	mfs_catalog_unload(void);
+
+struct mfs_catalog	*mfs_catalog_get(void);
+void			 mfs_catalog_put(struct mfs_catalog *);
+
+uint32_t	 mfs_catalog_lookup(struct mfs_catalog *, uint32_t,
+		     const char *);
+uint32_t	 mfs_catalog_resolve(struct mfs_catalog *, const char *);
+const char	*mfs_catalog_name(struct mfs_catalog *, uint32_t);
+int		 mfs_catalog_isdir(struct mfs_catalog *, uint32_t);
+/* The children of a directory, as the first node and how many. */
+uint32_t	 mfs_catalog_children(struct mfs_catalog *, uint32_t,
+		     uint32_t *);
+/* The file a node stands for. */
+const char	*mfs_catalog_file(struct mfs_catalog *, uint32_t, off_t *,
+		     time_t *);
+struct stat;
+void		 mfs_catalog_stat(struct mfs_catalog *, uint32_t,
+		     struct stat *);
+unsigned long	 mfs_catalog_generation(struct mfs_catalog *);
+
+int	mfs_catalog_stats(char *, size_t);
+
+#endif /* !_MFS_CATALOG_H_ */
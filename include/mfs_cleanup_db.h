@@ -25,5 +25,8 @@ struct fuse_args;
 #include <sqlite3.h>
 
 void mfs_cleanup_db(sqlite3 *handle);
+void cleanup_albums(sqlite3 *handle);
+void cleanup_artists(sqlite3 *handle);
+void cleanup_genres(sqlite3 *handle);
 
 #endif /* !_MFS_CLEANUP_DB_ */
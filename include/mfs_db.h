@@ -0,0 +1,50 @@
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+
+#ifndef _MFS_DB_H_
+#define _MFS_DB_H_
+
+#include <sqlite3.h>
+
+/*
+ * Version of the schema in dbschema.sql. Older databases are upgraded when
+ * musicfs starts.
+ */
+#define MFS_DB_VERSION	6
+
+/* Milliseconds to wait for a locked database. */
+#define MFS_DB_BUSY_TIMEOUT	5000
+
+int	mfs_db_open(const char *, sqlite3 **);
+int	mfs_db_upgrade(sqlite3 *);
+
+/* The connection of the calling thread, kept open until it exits. */
+int	mfs_db_get(const char *, sqlite3 **);
+int	mfs_db_pool_size(void);
+
+/* Prepared statement cache. */
+int	mfs_db_prepare(sqlite3 *, const char *, sqlite3_stmt **);
+void	mfs_db_release(sqlite3_stmt *);
+int	mfs_db_exec(sqlite3 *, const char *);
+void	mfs_db_close(sqlite3 *);
+void	mfs_db_stmtcache_stats(unsigned long *, unsigned long *);
+
+#endif /* !_MFS_DB_H_ */
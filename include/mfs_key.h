@@ -0,0 +1,32 @@
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+#ifndef _MFS_KEY_H_
+#define _MFS_KEY_H_
+
+/*
+ * The key a name is looked up by: the name with full Unicode case folding,
+ * in normalization form C. Names that differ only in case, or in how their
+ * accented letters are encoded, have the same key. The key is allocated
+ * with malloc, and is NULL if memory runs out.
+ */
+char	*mfs_key(const char *);
+
+#endif /* !_MFS_KEY_H_ */
@@ -22,6 +22,7 @@
 #define _MFS_NOTIFY_H_
 
 #include <sys/types.h>
+#include <stdint.h>
 
 #define EVENT_DELETE	0x01
 #define EVENT_WRITE	0x02
@@ -30,29 +31,44 @@
 #define EVENT_LINK	0x10
 #define EVENT_RENAME	0x20
 #define EVENT_REVOKE	0x40
+#define EVENT_CREATE	0x80
 
 /*
- * An notification event that signals something happened.
+ * An notification event that signals something happened. When the entry
+ * is a directory, ev_name may tell which file in it was affected. An
+ * event without an entry means that events were lost.
  */
 struct mfs_notify_event {
 	uint8_t ev_type;			/* Event type.     */
 	struct mfs_notify_entry *ev_data;	/* Affected entry. */
+	const char *ev_name;			/* File in entry.  */
 };
 
-/* Callback function for handling events. */
+/*
+ * Callback function for handling events. It is called from the event
+ * thread with the entries locked, and must not call back into mfs_notify.
+ */
 typedef void mfs_callback_fn_t(struct mfs_notify_event *);
 
 /* Get affected path. */
 const char *mfs_notify_path(struct mfs_notify_entry *);
 
-/* Initialize notification system. */
+/* Initialize notification system, and stop it. */
 int mfs_notify_init(mfs_callback_fn_t *);
+void mfs_notify_stop(void);
 
 /* Register a file for events. */
 int mfs_notify_register(const char *);
 
+/* Register a directory with everything below it, if the system can. */
+int mfs_notify_register_root(const char *);
+int mfs_notify_covered(const char *);
+
 /* Unregister notifiaction via file or entry. */
 int mfs_notify_unregister_file(const char *);
 int mfs_notify_unregister_entry(struct mfs_notify_entry *);
 
+/* Unregister a directory and everything below it. */
+int mfs_notify_unregister_tree(const char *);
+
 #endif /* !_MFS_NOTIFY_H_ */
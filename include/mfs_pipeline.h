@@ -0,0 +1,33 @@
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+#ifndef _MFS_PIPELINE_H_
+#define _MFS_PIPELINE_H_
+
+#include <sys/types.h>
+
+/*
+ * Scan a music path into the database, with discovery, file reading, tag
+ * parsing and database writes running in separate stages.
+ */
+int	mfs_pipeline_run(const char *, int);
+int	mfs_pipeline_status(char *, size_t);
+
+#endif /* !_MFS_PIPELINE_H_ */
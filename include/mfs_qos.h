@@ -0,0 +1,37 @@
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+#ifndef _MFS_QOS_H_
+#define _MFS_QOS_H_
+
+#include <sys/types.h>
+
+/*
+ * Keeping the scanner from getting in the way of playback: the scanner
+ * can run with a lower I/O priority, be limited to a number of files and
+ * megabytes per second, and back off while reads through the filesystem
+ * are slow.
+ */
+void	mfs_qos_thread(void);
+void	mfs_qos_throttle(unsigned int, size_t);
+void	mfs_qos_fgread(double);
+int	mfs_qos_stats(char *, size_t);
+
+#endif /* !_MFS_QOS_H_ */
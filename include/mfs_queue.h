@@ -0,0 +1,41 @@
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+#ifndef _MFS_QUEUE_H_
+#define _MFS_QUEUE_H_
+
+#include <sys/types.h>
+
+/*
+ * A bounded multi-producer, multi-consumer queue of pointers. Putting to
+ * a full queue and getting from an empty one waits, which gives
+ * backpressure between the stages of the scanner.
+ */
+struct mfs_queue;
+
+struct mfs_queue	*mfs_queue_new(size_t);
+void			 mfs_queue_free(struct mfs_queue *);
+void			 mfs_queue_put(struct mfs_queue *, void *);
+void			*mfs_queue_get(struct mfs_queue *);
+int			 mfs_queue_poll(struct mfs_queue *, void **);
+void			 mfs_queue_close(struct mfs_queue *);
+size_t			 mfs_queue_depth(struct mfs_queue *);
+
+#endif /* !_MFS_QUEUE_H_ */
@@ -0,0 +1,39 @@
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+#ifndef _MFS_SCANCTL_H_
+#define _MFS_SCANCTL_H_
+
+#include <sys/types.h>
+
+/*
+ * Background scanning. Scans run on their own thread while the filesystem
+ * keeps serving the catalog it has; requests made while a scan is running
+ * are folded into one more scan after it. Single paths that changed are
+ * brought up to date by the same thread, between scans.
+ */
+void	mfs_scanctl_start(void);
+void	mfs_scanctl_stop(void);
+void	mfs_scanctl_request(void);
+void	mfs_scanctl_update(const char *);
+int	mfs_scanctl_cancelled(void);
+int	mfs_scanctl_status(char *, size_t);
+
+#endif /* !_MFS_SCANCTL_H_ */
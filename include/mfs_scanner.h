@@ -0,0 +1,53 @@
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+#ifndef _MFS_SCANNER_H_
+#define _MFS_SCANNER_H_
+
+#include <musicfs.h>
+
+/*
+ * Traverse a hierarchy using a pool of threads, calling fileop on every
+ * regular file. A thread count of 0 means one thread per CPU.
+ */
+int	mfs_scanner_run(const char *, traverse_fn_t *, int);
+
+/*
+ * Hooks for mfs_scanner_walk(). so_enter is called before a directory is
+ * read, and returns a cookie that is given to so_file for each of its files
+ * and to so_leave when all of them have been handed out. If so_enter
+ * returns NULL, the files in the directory are skipped, but its
+ * sub-directories are still walked. Once so_cancelled returns non-zero,
+ * no more directories are read. so_error is told, with an errno, about a
+ * directory that could not be read, with a NULL cookie, and about one
+ * that some of its entries were lost from, with its cookie. Nothing below
+ * a lost path is walked.
+ */
+struct mfs_scanops {
+	void	*(*so_enter)(const char *);
+	void	 (*so_file)(void *, const char *);
+	void	 (*so_leave)(void *);
+	int	 (*so_cancelled)(void);
+	void	 (*so_error)(void *, const char *, int);
+};
+
+int	mfs_scanner_walk(const char *, const struct mfs_scanops *, int);
+
+#endif /* !_MFS_SCANNER_H_ */
@@ -0,0 +1,66 @@
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+#ifndef _MFS_TAGS_H_
+#define _MFS_TAGS_H_
+
+#include <sys/types.h>
+
+/*
+ * The tags we care about. Strings are UTF-8, allocated with malloc, and
+ * NULL when the tag is missing.
+ */
+struct mfs_tags {
+	char *artist;
+	char *album;
+	char *title;
+	char *genre;
+	unsigned int track;
+	unsigned int year;
+};
+
+/*
+ * A file to read tags from. Reads are served from the head and tail
+ * buffers when they cover the requested range, and with pread() on the
+ * descriptor otherwise. The buffers are optional.
+ */
+struct mfs_tagfile {
+	int tf_fd;
+	off_t tf_size;
+	const unsigned char *tf_head;	/* The first tf_headlen bytes. */
+	size_t tf_headlen;
+	const unsigned char *tf_tail;	/* The last tf_taillen bytes. */
+	size_t tf_taillen;
+};
+
+/* Native reader for ID3v1/ID3v2, FLAC, Ogg Vorbis and Opus. */
+#define MFS_TAGS_OK		0
+#define MFS_TAGS_UNSUPPORTED	1	/* Try another reader. */
+#define MFS_TAGS_ERROR		-1
+
+int	mfs_tags_read(struct mfs_tagfile *, const char *, struct mfs_tags *);
+
+int	mfs_tags_taglib(const char *, struct mfs_tags *);
+
+/* Read tags using the native reader, falling back to taglib. */
+int	mfs_tags_get(const char *, off_t, struct mfs_tags *);
+void	mfs_tags_free(struct mfs_tags *);
+
+#endif /* !_MFS_TAGS_H_ */
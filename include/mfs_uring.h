@@ -0,0 +1,45 @@
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+#ifndef _MFS_URING_H_
+#define _MFS_URING_H_
+
+#include <sys/types.h>
+
+/*
+ * A minimal io_uring wrapper for batching the scanner's file reads. Requests
+ * are queued, then submitted together with mfs_uring_run(), which waits for
+ * all of them and hands each result to a callback. On systems without
+ * io_uring, mfs_uring_new() returns NULL and the caller reads the files
+ * itself.
+ */
+struct mfs_uring;
+
+typedef void mfs_uring_fn_t(void *, int);
+
+struct mfs_uring	*mfs_uring_new(unsigned int);
+void			 mfs_uring_free(struct mfs_uring *);
+int			 mfs_uring_openat(struct mfs_uring *, const char *, int,
+			     void *);
+int			 mfs_uring_read(struct mfs_uring *, int, void *, size_t,
+			     off_t, void *);
+int			 mfs_uring_run(struct mfs_uring *, mfs_uring_fn_t *);
+
+#endif /* !_MFS_URING_H_ */
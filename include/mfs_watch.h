@@ -0,0 +1,36 @@
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+#ifndef _MFS_WATCH_H_
+#define _MFS_WATCH_H_
+
+/*
+ * Keeping the catalog up to date from filesystem events. Music paths are
+ * watched whole where the system allows it, and otherwise directories are
+ * watched as the scanner finds them. Changed files are handed to the
+ * background scanner one by one, instead of scanning everything again.
+ */
+int	mfs_watch_start(void);
+void	mfs_watch_stop(void);
+void	mfs_watch_root(const char *);
+void	mfs_watch_dir(const char *);
+void	mfs_watch_forget(const char *);
+
+#endif /* !_MFS_WATCH_H_ */
@@ -22,6 +22,7 @@
 #define _MUSICFS_H_
 
 #include <fuse.h>
+#include <sqlite3.h>
 
 struct fuse_args;
 
@@ -33,6 +34,28 @@ int	mfs_init();
  */
 char *db_path;
 
+/*
+ * Options given to musicfs with -o on the command line.
+ */
+struct mfs_options {
+	int scan_threads;	/* Scanner threads, 0 means one per CPU. */
+	int scan_io_threads;	/* Threads reading files when scanning. */
+	int scan_parse_threads;	/* Tag parsers, 0 means one per CPU. */
+	int full_rescan;	/* Parse every file, even unchanged ones. */
+	int scan_batch;		/* Files per transaction when scanning. */
+	int taglib_only;	/* Read all tags with taglib. */
+	int io_uring;		/* Read files with io_uring when scanning. */
+	int noscan;		/* Don't scan when mounting. */
+	int nowatch;		/* Don't watch the music paths for changes. */
+	int watch_delay;	/* Quiet ms before changes are applied. */
+	char *scan_ioprio;	/* "idle" or "be", I/O class for scanning. */
+	int scan_files_per_sec;	/* Limit on files scanned, 0 is none. */
+	int scan_mb_per_sec;	/* Limit on megabytes read, 0 is none. */
+	int scan_read_latency;	/* Back off above this many ms. */
+	int lowlevel;		/* Serve with the low-level FUSE API. */
+};
+extern struct mfs_options mfs_opts;
+
 /* 
  * Functions traversing the underlying filesystem and do operations on the
  * files, for instance scanning the collection.
@@ -41,26 +64,37 @@ typedef void traverse_fn_t(const char *);
 void traverse_hierarchy(const char *, traverse_fn_t);
 traverse_fn_t mfs_scan;
 
-/*
- * Data passed to mfs_lookup_list
- */
-struct filler_data {
-	void *buf;
-	fuse_fill_dir_t filler;
-};
+/* What the database knows about a file being scanned. */
+#define MFS_SCAN_NEW		0
+#define MFS_SCAN_UNCHANGED	1
+#define MFS_SCAN_CHANGED	2
+#define MFS_SCAN_MOVED		3	/* Known under another path. */
+#define MFS_SCAN_NOID		4	/* Unchanged, but stored without inode. */
 
-enum lookup_datatype { LIST_DATATYPE_STRING = 1, LIST_DATATYPE_INT };
+struct stat;
+struct mfs_tags;
 
-enum mfs_filetype { MFS_FILE, MFS_DIRECTORY };
+int  mfs_scan_check(const char *, const struct stat *, char **);
+void mfs_scan_store(const char *, const struct stat *, struct mfs_tags *, int);
+void mfs_scan_move(const char *, const char *, const struct stat *);
+void mfs_scan_flush();
+int  mfs_scan_begin(const char *, int *);
+void mfs_scan_finish(const char *);
+int  mfs_scan_dir_check(const char *);
+void mfs_scan_dir_store(const char *, char **, int);
+void mfs_scan_keep(const char *);
+int  mfs_scan_remove(const char *);
+int  mfs_scan_prune(const char *);
+void mfs_update_paths(char **, int);
+
+enum lookup_datatype { LIST_DATATYPE_STRING = 1, LIST_DATATYPE_INT };
 
 /* A lookup functions returns 0 if it's finished. */
 typedef int lookup_fn_t(void *, const char *);
-/* Lookup function listing each row. */
-lookup_fn_t mfs_lookup_list;
-/* Lookup real pathname for a file. */
-lookup_fn_t mfs_lookup_path;
 /* Lookup function loading a path into DB */
 lookup_fn_t mfs_lookup_load_path;
+/* Lookup function to stop watching a path. */
+lookup_fn_t mfs_lookup_unwatch_path;
 
 struct lookuphandle;
 
@@ -69,14 +103,8 @@ void			 mfs_lookup_insert(struct lookuphandle *, void *,
 			     enum lookup_datatype);
 void			 mfs_lookup_finish(struct lookuphandle *);
 
-void	 mfs_lookup_artist(const char *, struct filler_data *);
-void	 mfs_lookup_genre(const char *, struct filler_data *);
-void	 mfs_lookup_album(const char *, struct filler_data *);
-char	*mfs_gettoken(const char *, int);
-int	 mfs_numtoken(const char *);
 int	 mfs_realpath(const char *, char **);
 int      mfs_reload_config();
 char    *mfs_get_home_path(const char *);
 
-enum mfs_filetype mfs_get_filetype(const char *);
 #endif /* !_MUSICFS_H_ */
@@ -0,0 +1,1232 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+
+/*
+ * In-memory catalog.
+ *
+ * getattr, readdir and open are answered from a catalog of the tree that
+ * is built from the database, which stays the store that scans write to.
+ * Names, keys and file paths are kept in a string pool, and nodes refer
+ * to them by their offsets in it. A hash of the nodes by
+ * parent and key finds a path component in one probe or a few, and a
+ * directory lists its children from the consecutive nodes that hold
+ * them, already sorted. The attributes of a file come from the file
+ * itself, found by its path in the catalog.
+ *
+ * The catalog is loaded after each scan or batch of changes. While a
+ * scan runs, it is loaded again every MFS_CATALOG_REFRESH seconds, or
+ * less often if loading takes long, so that new music shows up as it
+ * is found.
+ *
+ * Every table refers to the others by offset or number only, so a
+ * catalog can be written to a file as it is and used from there with
+ * mmap(). After each scan the catalog is saved as a snapshot, and at
+ * mount the snapshot is mapped instead of loading the database, which
+ * takes the same time however large the collection is. Mapped pages
+ * are shared by every musicfs that mounts the same collection, and
+ * stay in the page cache between mounts. The snapshot is removed when
+ * a scan starts, and written again when it is done, so a snapshot that
+ * is there is up to date with the database.
+ */
+
+/* asprintf() */
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+
+#include <debug.h>
+#include <musicfs.h>
+#include <mfs_db.h>
+#include <mfs_key.h>
+#include <mfs_catalog.h>
+
+/* Seconds between loads while scanning, at least. */
+#define MFS_CATALOG_REFRESH	5
+/* Spend at most one part in this many of a scan loading the catalog. */
+#define MFS_CATALOG_REFRESH_RATIO 10
+
+#define MFS_CATNODE_DIR		0x01
+
+/*
+ * The snapshot is a header followed by the nodes, songs, hash and
+ * string pool, each starting at a multiple of 8 bytes. A snapshot
+ * written by another version of musicfs, for another database schema
+ * or with another byte order is not used.
+ */
+#define MFS_CATALOG_MAGIC	"MFSCATLG"
+#define MFS_CATALOG_VERSION	1
+#define MFS_CATALOG_BYTEORDER	0x01020304
+#define MFS_CATALOG_ALIGN(x)	(((x) + 7) & ~(uint64_t)7)
+
+struct mfs_cathdr {
+	char ch_magic[8];
+	uint32_t ch_version;
+	uint32_t ch_byteorder;
+	uint32_t ch_dbversion;	/* MFS_DB_VERSION of the database. */
+	uint32_t ch_nnodes;
+	uint32_t ch_nsongs;
+	uint32_t ch_hashmask;
+	uint64_t ch_nodes;	/* Offsets from the start of the file. */
+	uint64_t ch_songs;
+	uint64_t ch_hash;
+	uint64_t ch_pool;
+	uint64_t ch_poolsize;
+	uint64_t ch_size;	/* Of the whole file. */
+};
+
+struct mfs_catnode {
+	uint32_t cn_name;	/* Name, as an offset in the string pool. */
+	uint32_t cn_key;	/* Key of the name. */
+	uint32_t cn_parent;
+	uint32_t cn_flags;
+	uint32_t cn_first;	/* First child, or the song of a file. */
+	uint32_t cn_count;	/* Number of children. */
+};
+
+struct mfs_catsong {
+	uint32_t cs_path;	/* File path, in the string pool. */
+	uint32_t cs_pad;
+	int64_t cs_size;
+	int64_t cs_mtime;
+};
+
+struct mfs_catalog {
+	int c_refs;
+	unsigned long c_gen;	/* Which load this is. */
+	struct mfs_catnode *c_nodes;
+	uint32_t c_nnodes;
+	struct mfs_catsong *c_songs;
+	uint32_t c_nsongs;
+	uint32_t *c_hash;	/* Nodes by parent and key, plus one. */
+	uint32_t c_hashmask;
+	char *c_pool;
+	size_t c_poolsize;
+	void *c_map;		/* The snapshot the tables are in, if any. */
+	size_t c_mapsize;
+};
+
+/* A node while the catalog is being built. */
+struct mfs_catbnode {
+	struct mfs_catnode bn_node;
+	uint32_t bn_keyhash;
+	uint32_t bn_kids;	/* Children, in the order they were added. */
+	uint32_t bn_next;	/* Next sibling. */
+	uint32_t bn_id;		/* Number in the catalog. */
+};
+
+/* An entry in the hashes used while building, 0 if free. */
+struct mfs_catslot {
+	uint32_t sl_hash;
+	uint32_t sl_value;	/* Offset or node, plus one. */
+};
+
+/* A string from the database, hashed when first needed. */
+struct mfs_catstr {
+	const char *st_str;
+	uint32_t st_hash;
+	int st_hashed;
+};
+
+struct mfs_catbuild {
+	struct mfs_catbnode *b_nodes;
+	uint32_t b_nnodes;
+	uint32_t b_nodecap;
+	struct mfs_catsong *b_songs;
+	uint32_t b_nsongs;
+	uint32_t b_songcap;
+	char *b_pool;
+	size_t b_poolsize;
+	size_t b_poolcap;
+	struct mfs_catslot *b_strings;	/* Strings in the pool. */
+	uint32_t b_nstrings;
+	uint32_t b_stringmask;
+	struct mfs_catslot *b_hash;	/* Directories by parent and key. */
+	uint32_t b_ndirs;
+	uint32_t b_hashmask;
+	int b_error;
+};
+
+static pthread_mutex_t catalog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t catalog_buildlock = PTHREAD_MUTEX_INITIALIZER;
+static char *catalog_path;		/* Protected by catalog_buildlock. */
+static struct mfs_catalog *catalog;	/* Protected by catalog_lock. */
+static double catalog_loaded;		/* When, on the monotonic clock. */
+static double catalog_buildsecs;	/* How long it took. */
+static unsigned long catalog_loads;
+
+static double
+mfs_catalog_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static uint32_t
+mfs_catalog_strhash(const char *s)
+{
+	uint32_t h;
+
+	h = 2166136261u;
+	while (*s != '\0')
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return (h);
+}
+
+/*
+ * The hash of a node, from its parent and the hash of its key, so that
+ * a key is hashed once for all the directories it is in.
+ */
+static uint32_t
+mfs_catalog_hash(uint32_t parent, uint32_t keyhash)
+{
+
+	return (keyhash ^ (parent * 2654435761u));
+}
+
+static uint32_t
+mfs_catstr_hash(struct mfs_catstr *st)
+{
+
+	if (!st->st_hashed) {
+		st->st_hash = mfs_catalog_strhash(st->st_str);
+		st->st_hashed = 1;
+	}
+	return (st->st_hash);
+}
+
+/*
+ * Make room for one more element in an array that doubles as it grows.
+ */
+static int
+mfs_catbuild_grow(void *arrayp, uint32_t *cap, uint32_t n, size_t size)
+{
+	void **array, *p;
+	uint32_t newcap;
+
+	array = arrayp;
+	if (n < *cap)
+		return (0);
+	newcap = (*cap == 0) ? 1024 : *cap * 2;
+	p = realloc(*array, newcap * size);
+	if (p == NULL)
+		return (-1);
+	*array = p;
+	*cap = newcap;
+	return (0);
+}
+
+/*
+ * Grow an open addressed hash to twice its size, or to its first size.
+ */
+static int
+mfs_catbuild_rehash(struct mfs_catslot **tablep, uint32_t *maskp)
+{
+	struct mfs_catslot *table, *old;
+	uint32_t mask, i, j;
+
+	old = *tablep;
+	mask = (old == NULL) ? 4095 : *maskp * 2 + 1;
+	table = calloc((size_t)mask + 1, sizeof(*table));
+	if (table == NULL)
+		return (-1);
+	for (i = 0; old != NULL && i <= *maskp; i++) {
+		if (old[i].sl_value == 0)
+			continue;
+		for (j = old[i].sl_hash & mask; table[j].sl_value != 0;
+		    j = (j + 1) & mask)
+			;
+		table[j] = old[i];
+	}
+	free(old);
+	*tablep = table;
+	*maskp = mask;
+	return (0);
+}
+
+/*
+ * Add a string to the end of the pool and return its offset.
+ */
+static uint32_t
+mfs_catbuild_append(struct mfs_catbuild *b, const char *s)
+{
+	uint32_t off;
+	size_t len;
+	char *p;
+
+	len = strlen(s) + 1;
+	if (b->b_poolsize + len > UINT32_MAX) {
+		b->b_error = 1;
+		return (0);
+	}
+	if (b->b_poolsize + len > b->b_poolcap) {
+		b->b_poolcap = (b->b_poolcap == 0) ? 65536 : b->b_poolcap * 2;
+		if (b->b_poolcap < b->b_poolsize + len)
+			b->b_poolcap = b->b_poolsize + len;
+		p = realloc(b->b_pool, b->b_poolcap);
+		if (p == NULL) {
+			b->b_error = 1;
+			return (0);
+		}
+		b->b_pool = p;
+	}
+	off = (uint32_t)b->b_poolsize;
+	memcpy(b->b_pool + off, s, len);
+	b->b_poolsize += len;
+	return (off);
+}
+
+/*
+ * Put a string in the pool, unless it is there already, and return its
+ * offset. Used for the names of directories, which come up again and
+ * again.
+ */
+static uint32_t
+mfs_catbuild_string(struct mfs_catbuild *b, struct mfs_catstr *st)
+{
+	struct mfs_catslot *sl;
+	uint32_t h, i, off;
+
+	if (b->b_nstrings * 2 >= b->b_stringmask &&
+	    mfs_catbuild_rehash(&b->b_strings, &b->b_stringmask) != 0) {
+		b->b_error = 1;
+		return (0);
+	}
+	h = mfs_catstr_hash(st);
+	for (i = h & b->b_stringmask; (sl = &b->b_strings[i])->sl_value != 0;
+	    i = (i + 1) & b->b_stringmask)
+		if (sl->sl_hash == h &&
+		    strcmp(b->b_pool + sl->sl_value - 1, st->st_str) == 0)
+			return (sl->sl_value - 1);
+
+	off = mfs_catbuild_append(b, st->st_str);
+	sl->sl_hash = h;
+	sl->sl_value = off + 1;
+	b->b_nstrings++;
+	return (off);
+}
+
+/*
+ * Add a node below another. A file is given as the song it stands for,
+ * and a directory as MFS_CATALOG_NONE.
+ */
+static uint32_t
+mfs_catbuild_node(struct mfs_catbuild *b, uint32_t parent, uint32_t name,
+    uint32_t key, uint32_t keyhash, uint32_t song)
+{
+	struct mfs_catbnode *bn;
+	uint32_t n;
+
+	if (b->b_error || parent == MFS_CATALOG_NONE ||
+	    mfs_catbuild_grow(&b->b_nodes, &b->b_nodecap, b->b_nnodes,
+	    sizeof(*b->b_nodes)) != 0) {
+		b->b_error = 1;
+		return (MFS_CATALOG_NONE);
+	}
+	n = b->b_nnodes++;
+	bn = &b->b_nodes[n];
+	bn->bn_node.cn_name = name;
+	bn->bn_node.cn_key = key;
+	bn->bn_node.cn_parent = parent;
+	bn->bn_node.cn_count = 0;
+	if (song == MFS_CATALOG_NONE) {
+		bn->bn_node.cn_flags = MFS_CATNODE_DIR;
+		bn->bn_node.cn_first = 0;
+	} else {
+		bn->bn_node.cn_flags = 0;
+		bn->bn_node.cn_first = song;
+	}
+	bn->bn_keyhash = keyhash;
+	bn->bn_kids = MFS_CATALOG_NONE;
+	bn->bn_id = MFS_CATALOG_NONE;
+	bn->bn_next = MFS_CATALOG_NONE;
+	if (n == MFS_CATALOG_ROOT)
+		return (n);
+	bn->bn_next = b->b_nodes[parent].bn_kids;
+	b->b_nodes[parent].bn_kids = n;
+	b->b_nodes[parent].bn_node.cn_count++;
+	return (n);
+}
+
+/*
+ * Find the directory below another with the given key, adding it if
+ * there is none. When two names have the same key, the first one is
+ * kept. The songs of an album tend to come one after the other, so
+ * the directory found for the last one is tried first.
+ */
+static uint32_t
+mfs_catbuild_dir(struct mfs_catbuild *b, uint32_t parent,
+    struct mfs_catstr *name, struct mfs_catstr *key, uint32_t *last)
+{
+	struct mfs_catbnode *bn;
+	struct mfs_catslot *sl;
+	uint32_t h, i, n, nameoff, keyoff;
+
+	if (b->b_error || parent == MFS_CATALOG_NONE)
+		return (MFS_CATALOG_NONE);
+	if (last != NULL && *last != MFS_CATALOG_NONE) {
+		bn = &b->b_nodes[*last];
+		if (bn->bn_node.cn_parent == parent &&
+		    strcmp(b->b_pool + bn->bn_node.cn_key, key->st_str) == 0)
+			return (*last);
+	}
+	if (b->b_ndirs * 2 >= b->b_hashmask &&
+	    mfs_catbuild_rehash(&b->b_hash, &b->b_hashmask) != 0) {
+		b->b_error = 1;
+		return (MFS_CATALOG_NONE);
+	}
+	h = mfs_catalog_hash(parent, mfs_catstr_hash(key));
+	for (i = h & b->b_hashmask; (sl = &b->b_hash[i])->sl_value != 0;
+	    i = (i + 1) & b->b_hashmask) {
+		bn = &b->b_nodes[sl->sl_value - 1];
+		if (sl->sl_hash == h && bn->bn_node.cn_parent == parent &&
+		    strcmp(b->b_pool + bn->bn_node.cn_key, key->st_str) == 0)
+			break;
+	}
+	if (sl->sl_value != 0) {
+		if (last != NULL)
+			*last = sl->sl_value - 1;
+		return (sl->sl_value - 1);
+	}
+
+	nameoff = mfs_catbuild_string(b, name);
+	keyoff = mfs_catbuild_string(b, key);
+	n = mfs_catbuild_node(b, parent, nameoff, keyoff, key->st_hash,
+	    MFS_CATALOG_NONE);
+	if (n != MFS_CATALOG_NONE) {
+		sl->sl_hash = h;
+		sl->sl_value = n + 1;
+		b->b_ndirs++;
+	}
+	if (last != NULL)
+		*last = n;
+	return (n);
+}
+
+static uint32_t
+mfs_catbuild_topdir(struct mfs_catbuild *b, const char *name,
+    const char *key)
+{
+	struct mfs_catstr namest = { name, 0, 0 }, keyst = { key, 0, 0 };
+
+	return (mfs_catbuild_dir(b, MFS_CATALOG_ROOT, &namest, &keyst, NULL));
+}
+
+/*
+ * Add the name of a file to the pool, once for all the directories it
+ * is in, and return the hash of its key.
+ */
+static uint32_t
+mfs_catbuild_filename(struct mfs_catbuild *b, const char *name,
+    const char *key, uint32_t *nameoff, uint32_t *keyoff)
+{
+
+	*nameoff = mfs_catbuild_append(b, name);
+	if (strcmp(name, key) == 0)
+		*keyoff = *nameoff;
+	else
+		*keyoff = mfs_catbuild_append(b, key);
+	return (mfs_catalog_strhash(key));
+}
+
+/*
+ * Add every song to the tree, once under each of the top directories.
+ * Directories are looked up as they are added, while files are added as
+ * they come; mfs_catbuild_finish() drops files that have the same key
+ * as one before them.
+ */
+static int
+mfs_catbuild_fill(struct mfs_catbuild *b)
+{
+	sqlite3 *handle;
+	sqlite3_stmt *st;
+	struct mfs_catsong *cs;
+	struct mfs_catstr col[15];
+	uint32_t artists, albums, genres, tracks, n, song;
+	uint32_t entry, entrykey, entryhash, track, trackkey, trackhash;
+	uint32_t last[5];
+	int i, res;
+
+	n = mfs_catbuild_node(b, 0, mfs_catbuild_append(b, ""), 0, 0,
+	    MFS_CATALOG_NONE);
+	if (n != MFS_CATALOG_ROOT)
+		return (-1);
+	b->b_nodes[n].bn_node.cn_parent = MFS_CATALOG_NONE;
+	artists = mfs_catbuild_topdir(b, "Artists", "artists");
+	albums = mfs_catbuild_topdir(b, "Albums", "albums");
+	genres = mfs_catbuild_topdir(b, "Genres", "genres");
+	tracks = mfs_catbuild_topdir(b, "Tracks", "tracks");
+
+	for (i = 0; i < 5; i++)
+		last[i] = MFS_CATALOG_NONE;
+
+	if (mfs_db_get(db_path, &handle) != SQLITE_OK)
+		return (-1);
+	res = mfs_db_prepare(handle, "SELECT s.filepath, s.size, s.mtime, "
+	    "s.entryname, s.entrykey, s.trackname, s.trackkey, ar.name, "
+	    "ar.namekey, al.title, al.titlekey, al.dirname, al.dirkey, "
+	    "g.name, g.namekey FROM song AS s "
+	    "JOIN album AS al ON al.id = s.albumid "
+	    "JOIN artist AS ar ON ar.id = al.artistid "
+	    "LEFT JOIN genre AS g ON g.id = s.genreid", &st);
+	if (res != SQLITE_OK) {
+		DEBUG("Error preparing statement: %s\n",
+		    sqlite3_errmsg(handle));
+		return (-1);
+	}
+	while (!b->b_error && (res = sqlite3_step(st)) == SQLITE_ROW) {
+		for (i = 0; i < 15; i++) {
+			col[i].st_str = (const char *)sqlite3_column_text(st,
+			    i);
+			col[i].st_hashed = 0;
+		}
+		if (col[0].st_str == NULL || col[3].st_str == NULL ||
+		    col[4].st_str == NULL || col[5].st_str == NULL ||
+		    col[6].st_str == NULL || col[7].st_str == NULL ||
+		    col[8].st_str == NULL || col[9].st_str == NULL ||
+		    col[10].st_str == NULL || col[11].st_str == NULL ||
+		    col[12].st_str == NULL)
+			continue;
+
+		if (mfs_catbuild_grow(&b->b_songs, &b->b_songcap,
+		    b->b_nsongs, sizeof(*b->b_songs)) != 0) {
+			b->b_error = 1;
+			break;
+		}
+		song = b->b_nsongs++;
+		cs = &b->b_songs[song];
+		cs->cs_path = mfs_catbuild_append(b, col[0].st_str);
+		cs->cs_pad = 0;
+		cs->cs_size = sqlite3_column_int64(st, 1);
+		cs->cs_mtime = sqlite3_column_int64(st, 2);
+		entryhash = mfs_catbuild_filename(b, col[3].st_str,
+		    col[4].st_str, &entry, &entrykey);
+		trackhash = mfs_catbuild_filename(b, col[5].st_str,
+		    col[6].st_str, &track, &trackkey);
+
+		n = mfs_catbuild_dir(b, artists, &col[7], &col[8], &last[0]);
+		n = mfs_catbuild_dir(b, n, &col[9], &col[10], &last[1]);
+		mfs_catbuild_node(b, n, entry, entrykey, entryhash, song);
+
+		n = mfs_catbuild_dir(b, albums, &col[11], &col[12], &last[2]);
+		mfs_catbuild_node(b, n, entry, entrykey, entryhash, song);
+
+		if (col[13].st_str != NULL && col[14].st_str != NULL) {
+			n = mfs_catbuild_dir(b, genres, &col[13], &col[14],
+			    &last[3]);
+			n = mfs_catbuild_dir(b, n, &col[11], &col[12],
+			    &last[4]);
+			mfs_catbuild_node(b, n, entry, entrykey, entryhash,
+			    song);
+		}
+
+		mfs_catbuild_node(b, tracks, track, trackkey, trackhash, song);
+	}
+	mfs_db_release(st);
+	if (res != SQLITE_DONE && !b->b_error) {
+		DEBUG("Error reading the catalog: %s\n",
+		    sqlite3_errmsg(handle));
+		return (-1);
+	}
+	return (b->b_error ? -1 : 0);
+}
+
+/*
+ * A child to sort. The first bytes of the key are kept next to it, so
+ * that most comparisons need not follow the pointer.
+ */
+struct mfs_catsort {
+	uint64_t cs_prefix;
+	const char *cs_key;
+	uint32_t cs_node;
+};
+
+/* By key, and then in the order the nodes were added. */
+static int
+mfs_catsort_cmp(const void *a, const void *b)
+{
+	const struct mfs_catsort *ka, *kb;
+	int res;
+
+	ka = a;
+	kb = b;
+	if (ka->cs_prefix != kb->cs_prefix)
+		return (ka->cs_prefix < kb->cs_prefix ? -1 : 1);
+	if ((res = strcmp(ka->cs_key, kb->cs_key)) != 0)
+		return (res);
+	return ((ka->cs_node > kb->cs_node) - (ka->cs_node < kb->cs_node));
+}
+
+/*
+ * Number the nodes breadth first, so that the children of a directory
+ * are consecutive, and sort each directory by key. Of the files in a
+ * directory with the same key, the first one is kept.
+ */
+static struct mfs_catalog *
+mfs_catbuild_finish(struct mfs_catbuild *b)
+{
+	struct mfs_catalog *c;
+	struct mfs_catsort *kids;
+	struct mfs_catbnode *bn;
+	struct mfs_catnode *cn;
+	uint32_t *order, id, next, i, j, k, mask, most;
+
+	/* Only the nodes are needed from here on. */
+	free(b->b_strings);
+	free(b->b_hash);
+	b->b_strings = NULL;
+	b->b_hash = NULL;
+	for (most = 1, i = 0; i < b->b_nnodes; i++)
+		if (b->b_nodes[i].bn_node.cn_count > most)
+			most = b->b_nodes[i].bn_node.cn_count;
+	c = calloc(1, sizeof(*c));
+	order = malloc(b->b_nnodes * sizeof(*order));
+	kids = malloc(most * sizeof(*kids));
+	for (mask = 1; mask < b->b_nnodes * 2; mask <<= 1)
+		;
+	if (c != NULL) {
+		c->c_nodes = malloc(b->b_nnodes * sizeof(*c->c_nodes));
+		c->c_hash = calloc(mask, sizeof(*c->c_hash));
+	}
+	if (c == NULL || order == NULL || kids == NULL ||
+	    c->c_nodes == NULL || c->c_hash == NULL) {
+		if (c != NULL) {
+			free(c->c_nodes);
+			free(c->c_hash);
+		}
+		free(c);
+		free(order);
+		free(kids);
+		return (NULL);
+	}
+	c->c_refs = 1;
+	c->c_hashmask = mask - 1;
+
+	order[0] = 0;
+	b->b_nodes[0].bn_id = 0;
+	next = 1;
+	for (id = 0; id < next; id++) {
+		bn = &b->b_nodes[order[id]];
+		cn = &c->c_nodes[id];
+		*cn = bn->bn_node;
+		if (id != MFS_CATALOG_ROOT)
+			cn->cn_parent = b->b_nodes[cn->cn_parent].bn_id;
+		if (!(cn->cn_flags & MFS_CATNODE_DIR))
+			continue;
+		for (k = 0, j = bn->bn_kids; j != MFS_CATALOG_NONE;
+		    j = b->b_nodes[j].bn_next, k++) {
+			kids[k].cs_key = b->b_pool +
+			    b->b_nodes[j].bn_node.cn_key;
+			kids[k].cs_prefix = 0;
+			for (i = 0; i < 8 && kids[k].cs_key[i] != '\0'; i++)
+				kids[k].cs_prefix |= (uint64_t)(unsigned char)
+				    kids[k].cs_key[i] << (56 - 8 * i);
+			kids[k].cs_node = j;
+		}
+		qsort(kids, k, sizeof(*kids), mfs_catsort_cmp);
+		cn->cn_first = next;
+		for (i = 0; i < k; i++) {
+			if (i > 0 && strcmp(kids[i].cs_key,
+			    kids[i - 1].cs_key) == 0)
+				continue;
+			b->b_nodes[kids[i].cs_node].bn_id = next;
+			order[next++] = kids[i].cs_node;
+		}
+		cn->cn_count = next - cn->cn_first;
+	}
+	free(kids);
+	c->c_nnodes = next;
+
+	for (id = 1; id < c->c_nnodes; id++) {
+		cn = &c->c_nodes[id];
+		for (i = mfs_catalog_hash(cn->cn_parent,
+		    b->b_nodes[order[id]].bn_keyhash) & c->c_hashmask;
+		    c->c_hash[i] != 0; i = (i + 1) & c->c_hashmask)
+			;
+		c->c_hash[i] = id + 1;
+	}
+	free(order);
+
+	/* The songs and strings are taken over as they are. */
+	c->c_songs = b->b_songs;
+	c->c_nsongs = b->b_nsongs;
+	c->c_pool = b->b_pool;
+	c->c_poolsize = b->b_poolsize;
+	b->b_songs = NULL;
+	b->b_pool = NULL;
+	return (c);
+}
+
+static void
+mfs_catbuild_free(struct mfs_catbuild *b)
+{
+
+	free(b->b_nodes);
+	free(b->b_songs);
+	free(b->b_pool);
+	free(b->b_strings);
+	free(b->b_hash);
+}
+
+static void
+mfs_catalog_free(struct mfs_catalog *c)
+{
+
+	if (c->c_map != NULL)
+		munmap(c->c_map, c->c_mapsize);
+	else {
+		free(c->c_nodes);
+		free(c->c_songs);
+		free(c->c_hash);
+		free(c->c_pool);
+	}
+	free(c);
+}
+
+/* Where the snapshot is kept. Called with catalog_buildlock held. */
+static const char *
+mfs_catalog_path()
+{
+
+	if (catalog_path == NULL)
+		catalog_path = mfs_get_home_path(".mfs.catalog");
+	return (catalog_path);
+}
+
+/* Write a table of the snapshot, padded to a multiple of 8 bytes. */
+static int
+mfs_catalog_write(FILE *f, const void *data, uint64_t len)
+{
+	static const char pad[8];
+
+	if (len > 0 && fwrite(data, len, 1, f) != 1)
+		return (-1);
+	if (MFS_CATALOG_ALIGN(len) != len &&
+	    fwrite(pad, MFS_CATALOG_ALIGN(len) - len, 1, f) != 1)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Save a catalog as the snapshot. It is written to a file of its own
+ * that then replaces the snapshot, so that catalogs mapped from the old
+ * one are left as they are. Called with catalog_buildlock held.
+ */
+static int
+mfs_catalog_save(struct mfs_catalog *c)
+{
+	struct mfs_cathdr h;
+	const char *path;
+	char *tmp;
+	FILE *f;
+	int error;
+
+	if ((path = mfs_catalog_path()) == NULL)
+		return (-1);
+	memset(&h, 0, sizeof(h));
+	memcpy(h.ch_magic, MFS_CATALOG_MAGIC, sizeof(h.ch_magic));
+	h.ch_version = MFS_CATALOG_VERSION;
+	h.ch_byteorder = MFS_CATALOG_BYTEORDER;
+	h.ch_dbversion = MFS_DB_VERSION;
+	h.ch_nnodes = c->c_nnodes;
+	h.ch_nsongs = c->c_nsongs;
+	h.ch_hashmask = c->c_hashmask;
+	h.ch_nodes = MFS_CATALOG_ALIGN(sizeof(h));
+	h.ch_songs = h.ch_nodes +
+	    MFS_CATALOG_ALIGN((uint64_t)c->c_nnodes * sizeof(*c->c_nodes));
+	h.ch_hash = h.ch_songs +
+	    MFS_CATALOG_ALIGN((uint64_t)c->c_nsongs * sizeof(*c->c_songs));
+	h.ch_pool = h.ch_hash + MFS_CATALOG_ALIGN(((uint64_t)c->c_hashmask +
+	    1) * sizeof(*c->c_hash));
+	h.ch_poolsize = c->c_poolsize;
+	h.ch_size = h.ch_pool + MFS_CATALOG_ALIGN(c->c_poolsize);
+
+	if (asprintf(&tmp, "%s.%d", path, (int)getpid()) < 0)
+		return (-1);
+	if ((f = fopen(tmp, "w")) == NULL) {
+		DEBUG("Unable to write %s\n", tmp);
+		free(tmp);
+		return (-1);
+	}
+	error = mfs_catalog_write(f, &h, sizeof(h));
+	if (error == 0)
+		error = mfs_catalog_write(f, c->c_nodes,
+		    (uint64_t)c->c_nnodes * sizeof(*c->c_nodes));
+	if (error == 0)
+		error = mfs_catalog_write(f, c->c_songs,
+		    (uint64_t)c->c_nsongs * sizeof(*c->c_songs));
+	if (error == 0)
+		error = mfs_catalog_write(f, c->c_hash,
+		    ((uint64_t)c->c_hashmask + 1) * sizeof(*c->c_hash));
+	if (error == 0)
+		error = mfs_catalog_write(f, c->c_pool, c->c_poolsize);
+	if (error == 0 && (fflush(f) != 0 || fsync(fileno(f)) != 0))
+		error = -1;
+	if (fclose(f) != 0)
+		error = -1;
+	if (error == 0 && rename(tmp, path) != 0)
+		error = -1;
+	if (error != 0) {
+		DEBUG("Unable to write %s\n", tmp);
+		unlink(tmp);
+	}
+	free(tmp);
+	return (error);
+}
+
+/*
+ * Use a catalog from now on. Called with catalog_buildlock held.
+ */
+static void
+mfs_catalog_install(struct mfs_catalog *c, double secs)
+{
+	struct mfs_catalog *old;
+
+	pthread_mutex_lock(&catalog_lock);
+	old = catalog;
+	catalog = c;
+	catalog_loaded = mfs_catalog_now();
+	catalog_buildsecs = secs;
+	c->c_gen = ++catalog_loads;
+	pthread_mutex_unlock(&catalog_lock);
+	mfs_catalog_put(old);
+}
+
+/*
+ * Check that every offset in a mapped catalog stays within it: names,
+ * children, parents and songs of the nodes, the paths of the songs and
+ * the hash slots. Children come after their directory and parents
+ * before, as the catalog is built, so the tree has no loops. The string
+ * pool ends in a NUL, which ends every string in it. Returns -1 if the
+ * catalog can't be used.
+ */
+static int
+mfs_catalog_check(const struct mfs_catalog *c)
+{
+	const struct mfs_catnode *cn;
+	uint32_t i, empty;
+
+	if (!(c->c_nodes[MFS_CATALOG_ROOT].cn_flags & MFS_CATNODE_DIR))
+		return (-1);
+	for (i = 0; i < c->c_nnodes; i++) {
+		cn = &c->c_nodes[i];
+		if (cn->cn_name >= c->c_poolsize || cn->cn_key >= c->c_poolsize)
+			return (-1);
+		if (i != MFS_CATALOG_ROOT && cn->cn_parent >= i)
+			return (-1);
+		if (!(cn->cn_flags & MFS_CATNODE_DIR)) {
+			if (cn->cn_first >= c->c_nsongs)
+				return (-1);
+		} else if (cn->cn_count > 0 && (cn->cn_first <= i ||
+		    (uint64_t)cn->cn_first + cn->cn_count > c->c_nnodes))
+			return (-1);
+	}
+	for (i = 0; i < c->c_nsongs; i++)
+		if (c->c_songs[i].cs_path >= c->c_poolsize)
+			return (-1);
+	/* Lookups probe until they find an empty slot. */
+	for (empty = 0, i = 0; i <= c->c_hashmask; i++) {
+		if (c->c_hash[i] == 0)
+			empty++;
+		else if (c->c_hash[i] > c->c_nnodes)
+			return (-1);
+	}
+	return (empty > 0 ? 0 : -1);
+}
+
+/*
+ * Map the snapshot, and use it from now on. It is read through once to
+ * be checked, and is then paged in and out as the tree is looked at. A
+ * snapshot that does not check out is not used, and the caller loads
+ * the catalog from the database instead.
+ */
+int
+mfs_catalog_map()
+{
+	const struct mfs_cathdr *h;
+	struct mfs_catalog *c;
+	const char *path;
+	struct stat st;
+	void *map;
+	int fd;
+
+	pthread_mutex_lock(&catalog_buildlock);
+	path = mfs_catalog_path();
+	if (path == NULL || (fd = open(path, O_RDONLY)) < 0) {
+		pthread_mutex_unlock(&catalog_buildlock);
+		return (-1);
+	}
+	map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(*h))
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		pthread_mutex_unlock(&catalog_buildlock);
+		return (-1);
+	}
+
+	h = map;
+	if (memcmp(h->ch_magic, MFS_CATALOG_MAGIC, sizeof(h->ch_magic)) != 0 ||
+	    h->ch_version != MFS_CATALOG_VERSION ||
+	    h->ch_byteorder != MFS_CATALOG_BYTEORDER ||
+	    h->ch_dbversion != MFS_DB_VERSION ||
+	    h->ch_size != (uint64_t)st.st_size || h->ch_nnodes == 0 ||
+	    (h->ch_hashmask & (h->ch_hashmask + 1)) != 0 ||
+	    h->ch_nodes % 8 != 0 || h->ch_songs % 8 != 0 ||
+	    h->ch_hash % 8 != 0 ||
+	    h->ch_nodes < sizeof(*h) || h->ch_songs < h->ch_nodes +
+	    (uint64_t)h->ch_nnodes * sizeof(struct mfs_catnode) ||
+	    h->ch_hash < h->ch_songs +
+	    (uint64_t)h->ch_nsongs * sizeof(struct mfs_catsong) ||
+	    h->ch_pool < h->ch_hash +
+	    ((uint64_t)h->ch_hashmask + 1) * sizeof(uint32_t) ||
+	    h->ch_poolsize == 0 || h->ch_pool + h->ch_poolsize > h->ch_size ||
+	    ((const char *)map)[h->ch_pool + h->ch_poolsize - 1] != '\0' ||
+	    (c = calloc(1, sizeof(*c))) == NULL) {
+		DEBUG("Not using the catalog in %s\n", path);
+		munmap(map, st.st_size);
+		pthread_mutex_unlock(&catalog_buildlock);
+		return (-1);
+	}
+	c->c_refs = 1;
+	c->c_map = map;
+	c->c_mapsize = st.st_size;
+	c->c_nodes = (struct mfs_catnode *)((char *)map + h->ch_nodes);
+	c->c_nnodes = h->ch_nnodes;
+	c->c_songs = (struct mfs_catsong *)((char *)map + h->ch_songs);
+	c->c_nsongs = h->ch_nsongs;
+	c->c_hash = (uint32_t *)((char *)map + h->ch_hash);
+	c->c_hashmask = h->ch_hashmask;
+	c->c_pool = (char *)map + h->ch_pool;
+	c->c_poolsize = h->ch_poolsize;
+	if (mfs_catalog_check(c) != 0) {
+		DEBUG("Not using the damaged catalog in %s\n", path);
+		free(c);
+		munmap(map, st.st_size);
+		pthread_mutex_unlock(&catalog_buildlock);
+		return (-1);
+	}
+	DEBUG("catalog mapped: %u nodes, %u songs\n", c->c_nnodes,
+	    c->c_nsongs);
+	mfs_catalog_install(c, 0);
+	pthread_mutex_unlock(&catalog_buildlock);
+	return (0);
+}
+
+/*
+ * The database is about to change: remove the snapshot, so that it is
+ * not used should musicfs stop before a new one is saved.
+ */
+void
+mfs_catalog_invalidate()
+{
+	const char *path;
+
+	pthread_mutex_lock(&catalog_buildlock);
+	if ((path = mfs_catalog_path()) != NULL)
+		unlink(path);
+	pthread_mutex_unlock(&catalog_buildlock);
+}
+
+/*
+ * Build a catalog from the database and use it, saving it as the
+ * snapshot if asked to.
+ */
+static int
+mfs_catalog_build(int save)
+{
+	struct mfs_catalog *c;
+	struct mfs_catbuild b;
+	double start, secs;
+
+	pthread_mutex_lock(&catalog_buildlock);
+	start = mfs_catalog_now();
+	memset(&b, 0, sizeof(b));
+	c = NULL;
+	if (mfs_catbuild_fill(&b) == 0)
+		c = mfs_catbuild_finish(&b);
+	mfs_catbuild_free(&b);
+	if (c == NULL) {
+		DEBUG("Unable to load the catalog\n");
+		pthread_mutex_unlock(&catalog_buildlock);
+		return (-1);
+	}
+	secs = mfs_catalog_now() - start;
+	DEBUG("catalog loaded: %u nodes, %u songs in %.1f ms\n", c->c_nnodes,
+	    c->c_nsongs, secs * 1000);
+	if (save)
+		mfs_catalog_save(c);
+	mfs_catalog_install(c, secs);
+	pthread_mutex_unlock(&catalog_buildlock);
+	return (0);
+}
+
+int
+mfs_catalog_load()
+{
+
+	return (mfs_catalog_build(1));
+}
+
+void
+mfs_catalog_refresh()
+{
+	double wait;
+	int due;
+
+	pthread_mutex_lock(&catalog_lock);
+	wait = catalog_buildsecs * MFS_CATALOG_REFRESH_RATIO;
+	if (wait < MFS_CATALOG_REFRESH)
+		wait = MFS_CATALOG_REFRESH;
+	due = (mfs_catalog_now() - catalog_loaded >= wait);
+	pthread_mutex_unlock(&catalog_lock);
+	/* The scan is not done, so there is nothing to save yet. */
+	if (due)
+		mfs_catalog_build(0);
+}
+
+void
+mfs_catalog_unload()
+{
+	struct mfs_catalog *old;
+
+	pthread_mutex_lock(&catalog_lock);
+	old = catalog;
+	catalog = NULL;
+	pthread_mutex_unlock(&catalog_lock);
+	mfs_catalog_put(old);
+}
+
+/*
+ * Get a reference to the current catalog, which may be NULL before it
+ * is loaded.
+ */
+struct mfs_catalog *
+mfs_catalog_get()
+{
+	struct mfs_catalog *c;
+
+	pthread_mutex_lock(&catalog_lock);
+	c = catalog;
+	if (c != NULL)
+		__atomic_add_fetch(&c->c_refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&catalog_lock);
+	return (c);
+}
+
+void
+mfs_catalog_put(struct mfs_catalog *c)
+{
+
+	if (c != NULL && __atomic_sub_fetch(&c->c_refs, 1,
+	    __ATOMIC_ACQ_REL) == 0)
+		mfs_catalog_free(c);
+}
+
+/*
+ * Find the child of a directory by its name.
+ */
+uint32_t
+mfs_catalog_lookup(struct mfs_catalog *c, uint32_t parent, const char *name)
+{
+	struct mfs_catnode *cn;
+	uint32_t i, n, found;
+	char *key;
+
+	if (c == NULL || parent >= c->c_nnodes ||
+	    !(c->c_nodes[parent].cn_flags & MFS_CATNODE_DIR))
+		return (MFS_CATALOG_NONE);
+	key = mfs_key(name);
+	if (key == NULL)
+		return (MFS_CATALOG_NONE);
+	found = MFS_CATALOG_NONE;
+	for (i = mfs_catalog_hash(parent, mfs_catalog_strhash(key)) &
+	    c->c_hashmask;
+	    (n = c->c_hash[i]) != 0; i = (i + 1) & c->c_hashmask) {
+		cn = &c->c_nodes[n - 1];
+		if (cn->cn_parent == parent &&
+		    strcmp(c->c_pool + cn->cn_key, key) == 0) {
+			found = n - 1;
+			break;
+		}
+	}
+	free(key);
+	return (found);
+}
+
+/*
+ * Find the node of a path in the tree.
+ */
+uint32_t
+mfs_catalog_resolve(struct mfs_catalog *c, const char *path)
+{
+	char name[1024];
+	const char *end;
+	uint32_t node;
+	size_t len;
+
+	node = MFS_CATALOG_ROOT;
+	for (;;) {
+		while (*path == '/')
+			path++;
+		if (*path == '\0')
+			break;
+		end = strchr(path, '/');
+		len = (end == NULL) ? strlen(path) : (size_t)(end - path);
+		if (len >= sizeof(name))
+			return (MFS_CATALOG_NONE);
+		memcpy(name, path, len);
+		name[len] = '\0';
+		node = mfs_catalog_lookup(c, node, name);
+		if (node == MFS_CATALOG_NONE)
+			break;
+		path += len;
+	}
+	if (c == NULL && node == MFS_CATALOG_ROOT)
+		return (MFS_CATALOG_NONE);
+	return (node);
+}
+
+const char *
+mfs_catalog_name(struct mfs_catalog *c, uint32_t node)
+{
+
+	return (c->c_pool + c->c_nodes[node].cn_name);
+}
+
+int
+mfs_catalog_isdir(struct mfs_catalog *c, uint32_t node)
+{
+
+	return ((c->c_nodes[node].cn_flags & MFS_CATNODE_DIR) != 0);
+}
+
+uint32_t
+mfs_catalog_children(struct mfs_catalog *c, uint32_t node, uint32_t *count)
+{
+
+	*count = c->c_nodes[node].cn_count;
+	return (c->c_nodes[node].cn_first);
+}
+
+const char *
+mfs_catalog_file(struct mfs_catalog *c, uint32_t node, off_t *size,
+    time_t *mtime)
+{
+	struct mfs_catsong *cs;
+
+	cs = &c->c_songs[c->c_nodes[node].cn_first];
+	if (size != NULL)
+		*size = (off_t)cs->cs_size;
+	if (mtime != NULL)
+		*mtime = (time_t)cs->cs_mtime;
+	return (c->c_pool + cs->cs_path);
+}
+
+/*
+ * Attributes of a node, as getattr returns them. Files have the size and
+ * times of the file as it is now, since it may have grown since the scan
+ * and reads are cut off at the size we give; if it can't be stat'ed, they
+ * have what the scan saw.
+ */
+void
+mfs_catalog_stat(struct mfs_catalog *c, uint32_t node, struct stat *st)
+{
+	struct stat fst;
+	const char *path;
+
+	memset(st, 0, sizeof(*st));
+	st->st_nlink = 1;
+	if (mfs_catalog_isdir(c, node)) {
+		st->st_mode = S_IFDIR | 0555;
+		st->st_size = 12;
+		return;
+	}
+	st->st_mode = S_IFREG | 0444;
+	path = mfs_catalog_file(c, node, &st->st_size, &st->st_mtime);
+	st->st_atime = st->st_ctime = st->st_mtime;
+	if (stat(path, &fst) == 0 && S_ISREG(fst.st_mode)) {
+		st->st_size = fst.st_size;
+		st->st_blocks = fst.st_blocks;
+		st->st_blksize = fst.st_blksize;
+		st->st_atime = fst.st_atime;
+		st->st_mtime = fst.st_mtime;
+		st->st_ctime = fst.st_ctime;
+	}
+}
+
+/*
+ * A number that differs between any two catalogs, for telling whether
+ * a node number is from the current one.
+ */
+unsigned long
+mfs_catalog_generation(struct mfs_catalog *c)
+{
+
+	return (c->c_gen);
+}
+
+/*
+ * Counters for /.stats.
+ */
+int
+mfs_catalog_stats(char *buf, size_t size)
+{
+	struct mfs_catalog *c;
+	int len;
+
+	c = mfs_catalog_get();
+	pthread_mutex_lock(&catalog_lock);
+	len = snprintf(buf, size,
+	    "catalog_nodes: %u\n"
+	    "catalog_songs: %u\n"
+	    "catalog_bytes: %zu\n"
+	    "catalog_mapped: %d\n"
+	    "catalog_loads: %lu\n"
+	    "catalog_load_ms: %.1f\n",
+	    c ? c->c_nnodes : 0, c ? c->c_nsongs : 0,
+	    c ? c->c_nnodes * sizeof(*c->c_nodes) + (c->c_hashmask + 1) *
+	    sizeof(*c->c_hash) + c->c_nsongs * sizeof(*c->c_songs) +
+	    c->c_poolsize : 0, c != NULL && c->c_map != NULL,
+	    catalog_loads, catalog_buildsecs * 1000);
+	pthread_mutex_unlock(&catalog_lock);
+	mfs_catalog_put(c);
+	if (len < 0)
+		return (0);
+	if ((size_t)len >= size)
+		return ((int)size - 1);
+	return (len);
+}
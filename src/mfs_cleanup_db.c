@@ -29,6 +29,7 @@
 
 #include <debug.h>
 #include <musicfs.h>
+#include <mfs_db.h>
 
 int
 execute_statement(sqlite3 *handle, const char *query,
@@ -37,7 +38,7 @@ execute_statement(sqlite3 *handle, const char *query,
 	sqlite3_stmt *st;
 	int res;
 	
-	res = sqlite3_prepare_v2(handle, query, -1, &st, NULL);
+	res = mfs_db_prepare(handle, query, &st);
 	if (res != SQLITE_OK) {
 		DEBUG("Error preparing statement: %s\n",
 		    sqlite3_errmsg(handle));
@@ -51,160 +52,88 @@ execute_statement(sqlite3 *handle, const char *query,
 	if (res != SQLITE_DONE) {
 		DEBUG("Error executing query %s\n\t %s\n",
 		    query, sqlite3_errmsg(handle));
+		mfs_db_release(st);
 		return (-1);
 	}
-	sqlite3_finalize(st);
+	mfs_db_release(st);
 	return (0);
 }
 
+/*
+ * Remove albums without songs.
+ */
 void
-delete_from_path(sqlite3 *handle, const char *path)
+cleanup_albums(sqlite3 *handle)
 {
-	const char *fields[] = {path, NULL};
+	const char *fields[] = {NULL};
 
-	execute_statement(handle,
-	    "DELETE FROM song WHERE filepath LIKE (?||'%')",
-	    fields);
-}
-
-void
-delete_artist(sqlite3 *handle, const char *artist)
-{
-	const char *fields[] = {artist, NULL};
-	execute_statement(handle,
-	    "DELETE FROM artist WHERE name == ?",
-	    fields);
-}
-
-void
-delete_genre(sqlite3 *handle, const char *genre)
-{
-	const char *fields[] = {genre, NULL};
-	execute_statement(handle,
-	    "DELETE FROM genre WHERE name == ?",
-	    fields);
+	execute_statement(handle, "DELETE FROM album WHERE NOT EXISTS "
+	    "(SELECT 1 FROM song WHERE song.albumid = album.id)", fields);
 }
 
+/*
+ * Remove artists without albums. Run cleanup_albums() first.
+ */
 void
 cleanup_artists(sqlite3 *handle)
 {
-	sqlite3_stmt *st;
-	int res;
-	const char *artist, *song_title;
+	const char *fields[] = {NULL};
 
-	/* This is a slow, but probably faster than doing a lot of
-	   queries */
-	res = sqlite3_prepare_v2(handle, "SELECT a.name, s.title "
-	    "FROM artist AS a LEFT JOIN song AS s ON "
-	    "(a.name==s.artistname) GROUP BY a.name",
-	    -1, &st, NULL);
-	
-	if (res != SQLITE_OK) {
-		DEBUG("Error preparing statement: %s\n",
-		    sqlite3_errmsg(handle));
-		return;
-	}
-	
-	res = sqlite3_step(st);
-	while (res == SQLITE_ROW) {
-		artist = (const char*)sqlite3_column_text(st, 0);
-		song_title = (const char*)sqlite3_column_text(st, 1);
-		
-		if (song_title == NULL || strcmp(song_title, "") == 0) {
-			/* No song by this artist */
-			delete_artist(handle, artist);
-		}
-		
-		res = sqlite3_step(st);
-	}
+	execute_statement(handle, "DELETE FROM artist WHERE NOT EXISTS "
+	    "(SELECT 1 FROM album WHERE album.artistid = artist.id)", fields);
 }
 
+/*
+ * Remove genres without songs.
+ */
 void
 cleanup_genres(sqlite3 *handle)
 {
-	/* pretty much the same as cleanup_artist, only for genres */
-	sqlite3_stmt *st;
-	int res;
-	const char *genre, *song_title;
+	const char *fields[] = {NULL};
 
-	res = sqlite3_prepare_v2(handle, "SELECT g.name, s.title "
-	    "FROM genre AS g LEFT JOIN song AS s ON "
-	    "(g.name==s.genrename) GROUP BY g.name",
-	    -1, &st, NULL);
-	
-	if (res != SQLITE_OK) {
-		DEBUG("Error preparing statement: %s\n",
-		    sqlite3_errmsg(handle));
-		return;
-	}
-	
-	res = sqlite3_step(st);
-	while (res == SQLITE_ROW) {
-		genre = (const char*)sqlite3_column_text(st, 0);
-		song_title = (const char*)sqlite3_column_text(st, 1);
-		
-		if (song_title == NULL || strcmp(song_title, "") == 0) {
-			/* No song with this genre */
-			delete_genre(handle, genre);
-		}
-		
-		res = sqlite3_step(st);
-	}
+	execute_statement(handle, "DELETE FROM genre WHERE NOT EXISTS "
+	    "(SELECT 1 FROM song WHERE song.genreid = genre.id)", fields);
 }
 
 /*
  * Clean up the database:
  *
- * - Remove disabled paths
  * - Remove songs in disabled paths
- * - Remove unused artists and genres
+ * - Forget the scan journal of disabled paths, so that a path which is
+ *   added back is scanned afresh instead of resuming an old scan that
+ *   skips the directories it had done
+ * - Remove disabled paths
+ * - Remove unused albums, artists and genres
+ *
+ * Each step is one statement, and they are done in one transaction.
+ * Songs are found by a range on the filepath index for each disabled
+ * path, and unused rows by looking up the index on the column that
+ * refers to them.
  */
 void
 mfs_cleanup_db(sqlite3 *handle)
 {
-	DEBUG("cleaning up db\n");
-	/* sqlite doesn't support deleting from multiple tables at the
-	   same time :-( */
-	sqlite3_stmt *st;
-	int res;
-	const char *path;
+	const char *fields[] = {NULL};
+	int txn;
 
-	
-	/* Removed songs from inactive paths */
-	res = sqlite3_prepare_v2(handle, "SELECT path FROM path WHERE "
-	    "active = 0", -1, &st, NULL);
-	if (res != SQLITE_OK) {
-		DEBUG("Error preparing statement: %s\n",
-		    sqlite3_errmsg(handle));
-		return;
-	}
-	res = sqlite3_step(st);
-	
-	while (res == SQLITE_ROW) {
-		path = (const char*)sqlite3_column_text(st, 0);
-		delete_from_path(handle, path);
-		res = sqlite3_step(st);
-	}
-	sqlite3_finalize(st);
-	
-	/* Remove the actual paths */
-	res = sqlite3_prepare_v2(handle, "DELETE FROM path WHERE "
-	    "active = 0", -1, &st, NULL);
-	if (res != SQLITE_OK) {
-		DEBUG("Error preparing statement: %s\n",
-		    sqlite3_errmsg(handle));
-		return;
-	}
-	res = sqlite3_step(st);
-	if (res != SQLITE_DONE) {
-		DEBUG("Error deleting inactive paths from db: %s\n",
-		    sqlite3_errmsg(handle));
-		return;
-	}
-	sqlite3_finalize(st);
+	DEBUG("cleaning up db\n");
+	txn = (mfs_db_exec(handle, "BEGIN") == 0);
 
-	/* These are a bit heavy :-( */
+	execute_statement(handle, "DELETE FROM song WHERE id IN "
+	    "(SELECT s.id FROM path AS p JOIN song AS s ON "
+	    "s.filepath >= RTRIM(p.path, '/')||'/' AND "
+	    "s.filepath < RTRIM(p.path, '/')||'0' WHERE p.active = 0)",
+	    fields);
+	execute_statement(handle, "DELETE FROM scan_dir WHERE path IN "
+	    "(SELECT path FROM path WHERE active = 0)", fields);
+	execute_statement(handle, "DELETE FROM scan WHERE path IN "
+	    "(SELECT path FROM path WHERE active = 0)", fields);
+	execute_statement(handle, "DELETE FROM path WHERE active = 0",
+	    fields);
+	cleanup_albums(handle);
 	cleanup_artists(handle);
 	cleanup_genres(handle);
-}
 
+	if (txn && mfs_db_exec(handle, "COMMIT") != 0)
+		mfs_db_exec(handle, "ROLLBACK");
+}
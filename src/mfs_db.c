@@ -0,0 +1,515 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+/* asprintf() */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sqlite3.h>
+#include <pthread.h>
+
+#include <debug.h>
+#include <mfs_db.h>
+#include <mfs_key.h>
+
+/*
+ * Prepared statement cache.
+ *
+ * Statements are cached per connection and keyed by their query text.
+ * mfs_db_prepare() hands out an idle cached statement when there is one,
+ * and mfs_db_release() resets it and puts it back, so that the query is
+ * only parsed and planned once for each connection. A statement that is
+ * already in use (for instance by a nested lookup) is never handed out
+ * twice; another one is prepared instead. The cache is kept with the
+ * connection in the pool, which only its own thread uses, so it needs no
+ * lock. Statements on connections outside the pool are not cached.
+ */
+#define MFS_STMTCACHE_BUCKETS 256
+
+struct mfs_stmtcache_entry {
+	sqlite3_stmt *sc_st;
+	int sc_busy;
+	struct mfs_stmtcache_entry *sc_next;
+};
+
+/* A connection in the pool. */
+struct mfs_dbconn {
+	sqlite3 *dc_handle;
+	struct mfs_stmtcache_entry *dc_cache[MFS_STMTCACHE_BUCKETS];
+};
+
+static unsigned long stmtcache_hits;
+static unsigned long stmtcache_misses;
+
+/*
+ * Statements bringing the schema from version N to N+1. Databases created
+ * before we started versioning the schema have user_version 0.
+ */
+static const char *mfs_db_upgrades[MFS_DB_VERSION] = {
+	/* 0 -> 1: Track file size and find songs by path quickly. */
+	"ALTER TABLE song ADD COLUMN size int;"
+	"CREATE INDEX IF NOT EXISTS song_filepath ON song(filepath);",
+	/* 1 -> 2: Scan journal. */
+	"ALTER TABLE song ADD COLUMN generation int NOT NULL DEFAULT 0;"
+	"CREATE TABLE scan (path varchar(255) NOT NULL, "
+	"generation int NOT NULL, complete int NOT NULL, PRIMARY KEY(path));"
+	"CREATE TABLE scan_dir (path varchar(255) NOT NULL, "
+	"dirpath varchar(4096) NOT NULL, generation int NOT NULL, "
+	"PRIMARY KEY(path, dirpath));",
+	/* 2 -> 3: File identity, to notice moved files. */
+	"ALTER TABLE song ADD COLUMN dev int;"
+	"ALTER TABLE song ADD COLUMN ino int;"
+	"CREATE INDEX IF NOT EXISTS song_inode ON song(ino, dev);",
+	/* 3 -> 4: File names as shown in the tree, to look files up by. */
+	"ALTER TABLE song ADD COLUMN entryname varchar(255);"
+	"ALTER TABLE song ADD COLUMN trackname varchar(255);"
+	"UPDATE song SET "
+	"entryname = LTRIM(track||' ')||title||'.'||extension, "
+	"trackname = artistname||' - '||title||'.'||extension;"
+	/*
+	 * Every level of the tree is looked up by an index that also holds
+	 * the file path, so resolving a file never reads the song table.
+	 */
+	"CREATE INDEX song_artist_entry ON song(artistname COLLATE NOCASE, "
+	"album COLLATE NOCASE, entryname COLLATE NOCASE, filepath);"
+	"CREATE INDEX song_genre_entry ON song(genrename COLLATE NOCASE, "
+	"album COLLATE NOCASE, entryname COLLATE NOCASE, filepath);"
+	"CREATE INDEX song_album_entry ON song(album COLLATE NOCASE, "
+	"entryname COLLATE NOCASE, filepath);"
+	"CREATE INDEX song_trackname ON song(trackname COLLATE NOCASE, "
+	"filepath);",
+	/* 4 -> 5: Look names up by their key (see mfs_key()). */
+	"ALTER TABLE song ADD COLUMN artistkey varchar(200);"
+	"ALTER TABLE song ADD COLUMN albumkey varchar(200);"
+	"ALTER TABLE song ADD COLUMN genrekey varchar(200);"
+	"ALTER TABLE song ADD COLUMN entrykey varchar(255);"
+	"ALTER TABLE song ADD COLUMN trackkey varchar(255);"
+	"UPDATE song SET artistkey = mfs_key(artistname), "
+	"albumkey = mfs_key(album), genrekey = mfs_key(genrename), "
+	"entrykey = mfs_key(entryname), trackkey = mfs_key(trackname);"
+	"DROP INDEX song_artist_entry;"
+	"DROP INDEX song_genre_entry;"
+	"DROP INDEX song_album_entry;"
+	"DROP INDEX song_trackname;"
+	"CREATE INDEX song_artist_entry ON song(artistkey, albumkey, "
+	"entrykey, filepath);"
+	"CREATE INDEX song_genre_entry ON song(genrekey, albumkey, "
+	"entrykey, filepath);"
+	"CREATE INDEX song_album_entry ON song(albumkey, entrykey, filepath);"
+	"CREATE INDEX song_trackname ON song(trackkey, filepath);",
+	/*
+	 * 5 -> 6: Integer ids for artists, genres and albums, which are
+	 * tables of their own. Albums with the same title by different
+	 * artists get their own directories under /Albums.
+	 */
+	"ALTER TABLE song RENAME TO song_old;"
+	"ALTER TABLE artist RENAME TO artist_old;"
+	"ALTER TABLE genre RENAME TO genre_old;"
+	"CREATE TABLE artist (id integer PRIMARY KEY, "
+	"name varchar(200) NOT NULL UNIQUE, namekey varchar(200) NOT NULL);"
+	"CREATE TABLE genre (id integer PRIMARY KEY, "
+	"name varchar(200) NOT NULL UNIQUE, namekey varchar(200) NOT NULL);"
+	"CREATE TABLE album (id integer PRIMARY KEY, "
+	"artistid integer NOT NULL REFERENCES artist(id), "
+	"title varchar(200) NOT NULL, titlekey varchar(200) NOT NULL, "
+	"dirname varchar(255) NOT NULL, dirkey varchar(255) NOT NULL, "
+	"UNIQUE(artistid, title));"
+	"CREATE TABLE song (id integer PRIMARY KEY, "
+	"title varchar(200) NOT NULL, "
+	"albumid integer NOT NULL REFERENCES album(id), "
+	"genreid integer REFERENCES genre(id), filepath varchar(255), "
+	"year int, track varchar(8), extension varchar(50), mtime int, "
+	"size int, generation int NOT NULL DEFAULT 0, dev int, ino int, "
+	"entryname varchar(255), trackname varchar(255), "
+	"entrykey varchar(255), trackkey varchar(255), "
+	"UNIQUE(albumid, title, year));"
+	/*
+	 * Artists and albums can no longer be NULL, so songs without one
+	 * get the artist or album "Unknown". Songs that only differed by a
+	 * NULL are then the same song, and only one of them is kept.
+	 */
+	"INSERT INTO artist(name, namekey) SELECT DISTINCT "
+	"COALESCE(artistname, 'Unknown'), "
+	"mfs_key(COALESCE(artistname, 'Unknown')) FROM song_old;"
+	"INSERT INTO genre(name, namekey) SELECT DISTINCT genrename, "
+	"mfs_key(genrename) FROM song_old WHERE genrename != '';"
+	"INSERT INTO album(artistid, title, titlekey, dirname, dirkey) "
+	"SELECT DISTINCT ar.id, COALESCE(s.album, 'Unknown'), "
+	"mfs_key(COALESCE(s.album, 'Unknown')), COALESCE(s.album, 'Unknown'), "
+	"mfs_key(COALESCE(s.album, 'Unknown')) FROM song_old AS s "
+	"JOIN artist AS ar ON ar.name = COALESCE(s.artistname, 'Unknown');"
+	"UPDATE album SET dirname = title||' ('||"
+	"(SELECT name FROM artist WHERE id = artistid)||')' "
+	"WHERE EXISTS (SELECT 1 FROM album AS a2 "
+	"WHERE a2.dirkey = album.dirkey AND a2.id < album.id);"
+	"UPDATE album SET dirkey = mfs_key(dirname);"
+	"INSERT OR IGNORE INTO song(title, albumid, genreid, filepath, year, "
+	"track, extension, mtime, size, generation, dev, ino, entryname, "
+	"trackname, entrykey, trackkey) "
+	"SELECT s.title, al.id, g.id, s.filepath, s.year, s.track, "
+	"s.extension, s.mtime, s.size, s.generation, s.dev, s.ino, "
+	"s.entryname, ar.name||' - '||s.title||'.'||s.extension, s.entrykey, "
+	"mfs_key(ar.name||' - '||s.title||'.'||s.extension) "
+	"FROM song_old AS s "
+	"JOIN artist AS ar ON ar.name = COALESCE(s.artistname, 'Unknown') "
+	"JOIN album AS al ON al.artistid = ar.id "
+	"AND al.title = COALESCE(s.album, 'Unknown') "
+	"LEFT JOIN genre AS g ON g.name = s.genrename;"
+	"DROP TABLE song_old;"
+	"DROP TABLE artist_old;"
+	"DROP TABLE genre_old;"
+	"CREATE INDEX artist_key ON artist(namekey);"
+	"CREATE INDEX genre_key ON genre(namekey);"
+	"CREATE INDEX album_title ON album(artistid, titlekey);"
+	"CREATE INDEX album_dir ON album(dirkey);"
+	"CREATE INDEX song_filepath ON song(filepath);"
+	"CREATE INDEX song_inode ON song(ino, dev);"
+	"CREATE INDEX song_album_entry ON song(albumid, entrykey, filepath);"
+	"CREATE INDEX song_trackname ON song(trackkey, filepath);"
+	"CREATE INDEX song_genre ON song(genreid, albumid);",
+};
+
+/*
+ * SQL function mfs_key(name), giving the lookup key of a name.
+ */
+static void
+mfs_db_key(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	const char *name;
+	char *key;
+
+	name = (const char *)sqlite3_value_text(argv[0]);
+	if (name == NULL) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+	key = mfs_key(name);
+	if (key == NULL) {
+		sqlite3_result_error_nomem(ctx);
+		return;
+	}
+	sqlite3_result_text(ctx, key, -1, free);
+}
+
+/*
+ * Open a connection to the database. The scanner writes while lookups are
+ * served, so wait a while for locks instead of failing at once. The
+ * database is in WAL mode, where a commit only needs to reach the disk
+ * at checkpoints to keep the database intact. References between tables
+ * are checked.
+ */
+int
+mfs_db_open(const char *path, sqlite3 **handle)
+{
+	int res;
+
+	res = sqlite3_open(path, handle);
+	if (res != SQLITE_OK)
+		return (res);
+	sqlite3_busy_timeout(*handle, MFS_DB_BUSY_TIMEOUT);
+	sqlite3_exec(*handle, "PRAGMA synchronous = NORMAL", NULL, NULL, NULL);
+	sqlite3_exec(*handle, "PRAGMA foreign_keys = ON", NULL, NULL, NULL);
+	return (sqlite3_create_function(*handle, "mfs_key", 1,
+	    SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, mfs_db_key, NULL, NULL));
+}
+
+/*
+ * Connection pool.
+ *
+ * Every thread gets its own connection the first time it needs one, and
+ * keeps it until the thread exits. A lookup then costs no more than its
+ * queries: the database file is not opened again for each of them, and
+ * the statements they prepare stay in the cache between lookups.
+ * Connections are not shared between threads.
+ */
+static pthread_key_t dbpool_key;
+static pthread_once_t dbpool_once = PTHREAD_ONCE_INIT;
+static int dbpool_size;		/* Connections open in the pool. */
+
+/* Finalize the statements cached for a connection and close it. */
+static void
+mfs_db_pool_destroy(void *arg)
+{
+	struct mfs_dbconn *conn = arg;
+	struct mfs_stmtcache_entry *ent;
+	int i;
+
+	for (i = 0; i < MFS_STMTCACHE_BUCKETS; i++) {
+		while ((ent = conn->dc_cache[i]) != NULL) {
+			conn->dc_cache[i] = ent->sc_next;
+			sqlite3_finalize(ent->sc_st);
+			free(ent);
+		}
+	}
+	sqlite3_close(conn->dc_handle);
+	free(conn);
+	__atomic_sub_fetch(&dbpool_size, 1, __ATOMIC_RELAXED);
+}
+
+static void
+mfs_db_pool_init()
+{
+
+	pthread_key_create(&dbpool_key, mfs_db_pool_destroy);
+}
+
+/*
+ * Get the connection of the calling thread, opening it if needed. The
+ * connection must not be closed.
+ */
+int
+mfs_db_get(const char *path, sqlite3 **handle)
+{
+	struct mfs_dbconn *conn;
+	int res;
+
+	pthread_once(&dbpool_once, mfs_db_pool_init);
+	conn = pthread_getspecific(dbpool_key);
+	if (conn != NULL) {
+		*handle = conn->dc_handle;
+		return (SQLITE_OK);
+	}
+	res = mfs_db_open(path, handle);
+	if (res != SQLITE_OK) {
+		DEBUG("Can't open database: %s\n", sqlite3_errmsg(*handle));
+		sqlite3_close(*handle);
+		*handle = NULL;
+		return (res);
+	}
+	conn = calloc(1, sizeof(*conn));
+	if (conn == NULL || pthread_setspecific(dbpool_key, conn) != 0) {
+		free(conn);
+		sqlite3_close(*handle);
+		*handle = NULL;
+		return (SQLITE_NOMEM);
+	}
+	conn->dc_handle = *handle;
+	__atomic_add_fetch(&dbpool_size, 1, __ATOMIC_RELAXED);
+	return (SQLITE_OK);
+}
+
+/*
+ * The pool entry of handle, if it is the connection of the calling thread.
+ */
+static struct mfs_dbconn *
+mfs_db_conn(sqlite3 *handle)
+{
+	struct mfs_dbconn *conn;
+
+	pthread_once(&dbpool_once, mfs_db_pool_init);
+	conn = pthread_getspecific(dbpool_key);
+	if (conn == NULL || conn->dc_handle != handle)
+		return (NULL);
+	return (conn);
+}
+
+/*
+ * Number of connections in the pool.
+ */
+int
+mfs_db_pool_size()
+{
+
+	return (__atomic_load_n(&dbpool_size, __ATOMIC_RELAXED));
+}
+
+/*
+ * Upgrade the database schema to MFS_DB_VERSION.
+ */
+int
+mfs_db_upgrade(sqlite3 *handle)
+{
+	sqlite3_stmt *st;
+	char *errmsg, *query;
+	int res, version;
+
+	res = sqlite3_prepare_v2(handle, "PRAGMA user_version", -1, &st,
+	    NULL);
+	if (res != SQLITE_OK) {
+		DEBUG("Error preparing statement: %s\n",
+		    sqlite3_errmsg(handle));
+		return (-1);
+	}
+	version = 0;
+	if (sqlite3_step(st) == SQLITE_ROW)
+		version = sqlite3_column_int(st, 0);
+	sqlite3_finalize(st);
+
+	for (; version < MFS_DB_VERSION; version++) {
+		DEBUG("upgrading database schema to version %d\n",
+		    version + 1);
+		if (asprintf(&query, "BEGIN;%sPRAGMA user_version = %d;COMMIT;",
+		    mfs_db_upgrades[version], version + 1) < 0)
+			return (-1);
+		res = sqlite3_exec(handle, query, NULL, NULL, &errmsg);
+		free(query);
+		if (res != SQLITE_OK) {
+			DEBUG("Error upgrading database: %s\n", errmsg);
+			sqlite3_free(errmsg);
+			sqlite3_exec(handle, "ROLLBACK", NULL, NULL, NULL);
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+static unsigned int
+mfs_stmtcache_hash(const char *query)
+{
+	unsigned int h;
+
+	/* FNV-1a over the query. */
+	h = 2166136261u;
+	while (*query != '\0') {
+		h ^= (unsigned char)*query++;
+		h *= 16777619u;
+	}
+	return (h % MFS_STMTCACHE_BUCKETS);
+}
+
+/*
+ * Get a prepared statement for query on handle, preparing it only if no
+ * idle one is cached. Return value is as for sqlite3_prepare_v2().
+ */
+int
+mfs_db_prepare(sqlite3 *handle, const char *query, sqlite3_stmt **stp)
+{
+	struct mfs_stmtcache_entry *ent;
+	struct mfs_dbconn *conn;
+	unsigned int bucket;
+	int res;
+
+	conn = mfs_db_conn(handle);
+	bucket = mfs_stmtcache_hash(query);
+	if (conn != NULL) {
+		for (ent = conn->dc_cache[bucket]; ent != NULL;
+		    ent = ent->sc_next) {
+			if (!ent->sc_busy &&
+			    strcmp(sqlite3_sql(ent->sc_st), query) == 0) {
+				ent->sc_busy = 1;
+				__atomic_add_fetch(&stmtcache_hits, 1,
+				    __ATOMIC_RELAXED);
+				*stp = ent->sc_st;
+				return (SQLITE_OK);
+			}
+		}
+	}
+	__atomic_add_fetch(&stmtcache_misses, 1, __ATOMIC_RELAXED);
+
+	res = sqlite3_prepare_v2(handle, query, -1, stp, NULL);
+	if (res != SQLITE_OK || conn == NULL)
+		return (res);
+	ent = malloc(sizeof(*ent));
+	if (ent == NULL) {
+		/* We can live without caching it. */
+		return (SQLITE_OK);
+	}
+	ent->sc_st = *stp;
+	ent->sc_busy = 1;
+	ent->sc_next = conn->dc_cache[bucket];
+	conn->dc_cache[bucket] = ent;
+	return (SQLITE_OK);
+}
+
+/*
+ * Give a statement from mfs_db_prepare() back to the cache.
+ */
+void
+mfs_db_release(sqlite3_stmt *st)
+{
+	struct mfs_stmtcache_entry *ent;
+	struct mfs_dbconn *conn;
+
+	if (st == NULL)
+		return;
+	sqlite3_reset(st);
+	sqlite3_clear_bindings(st);
+
+	conn = mfs_db_conn(sqlite3_db_handle(st));
+	if (conn != NULL) {
+		for (ent = conn->dc_cache[mfs_stmtcache_hash(sqlite3_sql(st))];
+		    ent != NULL; ent = ent->sc_next) {
+			if (ent->sc_st == st) {
+				ent->sc_busy = 0;
+				return;
+			}
+		}
+	}
+	/* Not cached. */
+	sqlite3_finalize(st);
+}
+
+/*
+ * Execute a statement without parameters or results through the cache.
+ */
+int
+mfs_db_exec(sqlite3 *handle, const char *query)
+{
+	sqlite3_stmt *st;
+	int res;
+
+	res = mfs_db_prepare(handle, query, &st);
+	if (res != SQLITE_OK) {
+		DEBUG("Error preparing statement: %s\n",
+		    sqlite3_errmsg(handle));
+		return (-1);
+	}
+	res = sqlite3_step(st);
+	mfs_db_release(st);
+	if (res != SQLITE_DONE && res != SQLITE_ROW) {
+		DEBUG("Error executing %s: %s\n", query,
+		    sqlite3_errmsg(handle));
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Close a connection. The connection of the calling thread leaves the pool,
+ * and the statements cached for it are finalized.
+ */
+void
+mfs_db_close(sqlite3 *handle)
+{
+	struct mfs_dbconn *conn;
+
+	conn = mfs_db_conn(handle);
+	if (conn == NULL) {
+		sqlite3_close(handle);
+		return;
+	}
+	pthread_setspecific(dbpool_key, NULL);
+	mfs_db_pool_destroy(conn);
+}
+
+/*
+ * Statement cache counters.
+ */
+void
+mfs_db_stmtcache_stats(unsigned long *hits, unsigned long *misses)
+{
+
+	*hits = __atomic_load_n(&stmtcache_hits, __ATOMIC_RELAXED);
+	*misses = __atomic_load_n(&stmtcache_misses, __ATOMIC_RELAXED);
+}
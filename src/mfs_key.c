@@ -0,0 +1,161 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+
+/*
+ * Lookup keys.
+ *
+ * A file in the tree is found by comparing the keys of the names in its
+ * path with keys stored when the song was scanned. Following Unicode's
+ * canonical caseless matching, a name is decomposed, case folded, and
+ * composed again into NFC. Names that are not valid UTF-8 get U+FFFD for
+ * the bad bytes, and if ICU fails altogether, only ASCII is folded.
+ */
+
+#include <pthread.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unicode/uchar.h>
+#include <unicode/unorm2.h>
+#include <unicode/ustring.h>
+
+#include <debug.h>
+#include <mfs_key.h>
+
+#define MFS_KEY_NFD	0
+#define MFS_KEY_FOLD	1
+#define MFS_KEY_NFC	2
+
+/*
+ * Apply one step to a UTF-16 string, returning the result in a new buffer.
+ */
+static UChar *
+mfs_key_step(int step, const UChar *src, int32_t len, int32_t *reslen)
+{
+	const UNormalizer2 *norm;
+	UErrorCode err;
+	UChar *dst;
+	int32_t cap, n;
+
+	/* Folding can make a string three times as long. */
+	cap = len * 3 + 1;
+	for (;;) {
+		dst = malloc(cap * sizeof(UChar));
+		if (dst == NULL)
+			return (NULL);
+		err = U_ZERO_ERROR;
+		n = 0;
+		if (step == MFS_KEY_FOLD) {
+			n = u_strFoldCase(dst, cap, src, len,
+			    U_FOLD_CASE_DEFAULT, &err);
+		} else {
+			norm = (step == MFS_KEY_NFD) ?
+			    unorm2_getNFDInstance(&err) :
+			    unorm2_getNFCInstance(&err);
+			if (U_SUCCESS(err))
+				n = unorm2_normalize(norm, src, len, dst, cap,
+				    &err);
+		}
+		if (err != U_BUFFER_OVERFLOW_ERROR)
+			break;
+		free(dst);
+		cap = n + 1;
+	}
+	if (U_FAILURE(err)) {
+		free(dst);
+		return (NULL);
+	}
+	*reslen = n;
+	return (dst);
+}
+
+static char *
+mfs_key_ascii(const char *name)
+{
+	char *key, *p;
+
+	key = strdup(name);
+	if (key == NULL)
+		return (NULL);
+	for (p = key; *p != '\0'; p++)
+		*p = tolower((unsigned char)*p);
+	return (key);
+}
+
+char *
+mfs_key(const char *name)
+{
+	static const int steps[] = { MFS_KEY_NFD, MFS_KEY_FOLD, MFS_KEY_NFC };
+	UErrorCode err;
+	UChar *s, *t;
+	int32_t len, ulen;
+	char *key;
+	int i;
+
+	/* To UTF-16. */
+	err = U_ZERO_ERROR;
+	u_strFromUTF8WithSub(NULL, 0, &ulen, name, -1, 0xfffd, NULL, &err);
+	if (U_FAILURE(err) && err != U_BUFFER_OVERFLOW_ERROR)
+		goto ascii;
+	s = malloc((ulen + 1) * sizeof(UChar));
+	if (s == NULL)
+		return (NULL);
+	err = U_ZERO_ERROR;
+	u_strFromUTF8WithSub(s, ulen + 1, &ulen, name, -1, 0xfffd, NULL,
+	    &err);
+	if (U_FAILURE(err)) {
+		free(s);
+		goto ascii;
+	}
+
+	for (i = 0; i < (int)(sizeof(steps) / sizeof(steps[0])); i++) {
+		t = mfs_key_step(steps[i], s, ulen, &ulen);
+		free(s);
+		if (t == NULL)
+			goto ascii;
+		s = t;
+	}
+
+	/* And back to UTF-8. */
+	err = U_ZERO_ERROR;
+	u_strToUTF8(NULL, 0, &len, s, ulen, &err);
+	if (U_FAILURE(err) && err != U_BUFFER_OVERFLOW_ERROR) {
+		free(s);
+		goto ascii;
+	}
+	key = malloc(len + 1);
+	if (key != NULL) {
+		err = U_ZERO_ERROR;
+		u_strToUTF8(key, len + 1, NULL, s, ulen, &err);
+	}
+	free(s);
+	if (key != NULL && U_FAILURE(err)) {
+		free(key);
+		goto ascii;
+	}
+	return (key);
+ascii:
+	DEBUG("Unable to fold %s, folding ASCII only\n", name);
+	return (mfs_key_ascii(name));
+}
@@ -0,0 +1,756 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+
+/*
+ * Low-level FUSE backend.
+ *
+ * With the path API, every request names a file by its full path, which
+ * is resolved from the root each time. Here the kernel is given an inode
+ * number for each name it looks up, and later requests come with that
+ * number. A lookup resolves one name in a directory the kernel already
+ * knows, and every other request finds its node in the inode table.
+ *
+ * An inode stands for a name in its parent directory rather than for a
+ * node of one catalog, so its number stays the same when a new catalog
+ * is loaded. It remembers the node it had in the catalog it was last
+ * used with, and looks its name up again in its parent when the catalog
+ * has changed. Inodes are kept while the kernel holds lookups of them or
+ * of an inode below them, and numbers are never reused.
+ *
+ * .config and the generated files in the root have fixed inode numbers,
+ * and are served by the path operations (see mfs_vnops.c).
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fusever.h>
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <debug.h>
+#include <musicfs.h>
+#include <mfs_catalog.h>
+#include <mfs_lowlevel.h>
+#include <mfs_qos.h>
+
+/* Seconds the kernel may cache names and attributes. */
+#define MFS_LL_TIMEOUT		1.0
+/* Inode numbers of the files that are not in the catalog. */
+#define MFS_LL_SPECIAL_INO	2
+/* The first inode number handed out for the catalog. */
+#define MFS_LL_FIRST_INO	16
+/* The inode of a directory entry whose name has not been looked up. */
+#define MFS_LL_UNKNOWN_INO	0xffffffff
+
+static const char *mfs_ll_specials[] = {
+	"/.config",
+	"/.stats",
+	"/.scan_status",
+	NULL
+};
+
+struct mfs_inode {
+	fuse_ino_t in_ino;
+	struct mfs_inode *in_parent;
+	char *in_name;
+	unsigned long in_nlookup;	/* Lookups the kernel holds. */
+	unsigned long in_kids;		/* Inodes below this one. */
+	unsigned long in_gen;		/* Catalog in_node is from. */
+	uint32_t in_node;
+	struct mfs_inode *in_inonext;	/* Hash chains. */
+	struct mfs_inode *in_namenext;
+};
+
+/* A directory being read, with the catalog it was opened in. */
+struct mfs_lldir {
+	struct mfs_catalog *d_cat;
+	uint32_t d_node;
+};
+
+static pthread_mutex_t ll_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mfs_inode ll_root = { FUSE_ROOT_ID, NULL, "", 1, 0, 0,
+    MFS_CATALOG_ROOT, NULL, NULL };
+/* Inodes by number and by parent and name, protected by ll_lock. */
+static struct mfs_inode **ll_byino;
+static struct mfs_inode **ll_byname;
+static size_t ll_buckets;
+static size_t ll_count;
+static fuse_ino_t ll_nextino = MFS_LL_FIRST_INO;
+
+static size_t
+mfs_ll_namehash(struct mfs_inode *parent, const char *name)
+{
+	size_t h;
+
+	h = 2166136261u ^ (size_t)parent->in_ino;
+	while (*name != '\0')
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	return (h & (ll_buckets - 1));
+}
+
+/*
+ * Double the hash tables when they get full. Called with ll_lock held.
+ */
+static int
+mfs_ll_grow()
+{
+	struct mfs_inode **byino, **byname, *in, *next;
+	size_t buckets, i, h, old;
+
+	old = ll_buckets;
+	buckets = (old == 0) ? 1024 : old * 2;
+	byino = calloc(buckets, sizeof(*byino));
+	byname = calloc(buckets, sizeof(*byname));
+	if (byino == NULL || byname == NULL) {
+		free(byino);
+		free(byname);
+		return (-1);
+	}
+	ll_buckets = buckets;
+	for (i = 0; i < old; i++) {
+		for (in = ll_byino[i]; in != NULL; in = next) {
+			next = in->in_inonext;
+			h = in->in_ino & (buckets - 1);
+			in->in_inonext = byino[h];
+			byino[h] = in;
+		}
+		for (in = ll_byname[i]; in != NULL; in = next) {
+			next = in->in_namenext;
+			h = mfs_ll_namehash(in->in_parent, in->in_name);
+			in->in_namenext = byname[h];
+			byname[h] = in;
+		}
+	}
+	free(ll_byino);
+	free(ll_byname);
+	ll_byino = byino;
+	ll_byname = byname;
+	return (0);
+}
+
+/* Find an inode by number. Called with ll_lock held. */
+static struct mfs_inode *
+mfs_ll_get(fuse_ino_t ino)
+{
+	struct mfs_inode *in;
+
+	if (ino == FUSE_ROOT_ID)
+		return (&ll_root);
+	if (ll_buckets == 0)
+		return (NULL);
+	for (in = ll_byino[ino & (ll_buckets - 1)]; in != NULL;
+	    in = in->in_inonext)
+		if (in->in_ino == ino)
+			return (in);
+	return (NULL);
+}
+
+/*
+ * Find the inode of a name in a directory, making one if there is none.
+ * Called with ll_lock held.
+ */
+static struct mfs_inode *
+mfs_ll_child(struct mfs_inode *parent, const char *name)
+{
+	struct mfs_inode *in;
+	size_t h;
+
+	if (ll_buckets > 0) {
+		for (in = ll_byname[mfs_ll_namehash(parent, name)]; in != NULL;
+		    in = in->in_namenext)
+			if (in->in_parent == parent &&
+			    strcmp(in->in_name, name) == 0)
+				return (in);
+	}
+	if (ll_count >= ll_buckets && mfs_ll_grow() != 0)
+		return (NULL);
+	if ((in = calloc(1, sizeof(*in))) == NULL)
+		return (NULL);
+	if ((in->in_name = strdup(name)) == NULL) {
+		free(in);
+		return (NULL);
+	}
+	in->in_ino = ll_nextino++;
+	in->in_parent = parent;
+	in->in_node = MFS_CATALOG_NONE;
+	parent->in_kids++;
+	h = in->in_ino & (ll_buckets - 1);
+	in->in_inonext = ll_byino[h];
+	ll_byino[h] = in;
+	h = mfs_ll_namehash(parent, name);
+	in->in_namenext = ll_byname[h];
+	ll_byname[h] = in;
+	ll_count++;
+	return (in);
+}
+
+/*
+ * Free an inode the kernel no longer knows, and its parents if that was
+ * all that kept them. Called with ll_lock held.
+ */
+static void
+mfs_ll_unref(struct mfs_inode *in)
+{
+	struct mfs_inode **inp, *parent;
+
+	while (in != &ll_root && in->in_nlookup == 0 && in->in_kids == 0) {
+		for (inp = &ll_byino[in->in_ino & (ll_buckets - 1)];
+		    *inp != in; inp = &(*inp)->in_inonext)
+			;
+		*inp = in->in_inonext;
+		for (inp = &ll_byname[mfs_ll_namehash(in->in_parent,
+		    in->in_name)]; *inp != in; inp = &(*inp)->in_namenext)
+			;
+		*inp = in->in_namenext;
+		parent = in->in_parent;
+		parent->in_kids--;
+		ll_count--;
+		free(in->in_name);
+		free(in);
+		in = parent;
+	}
+}
+
+/*
+ * The node of an inode in a catalog. When the catalog is not the one
+ * the inode was last used with, its name is looked up again in its
+ * parent. The names are matched without ll_lock, as that takes a while.
+ */
+static uint32_t
+mfs_ll_node(struct mfs_catalog *cat, fuse_ino_t ino)
+{
+	struct mfs_inode *in;
+	fuse_ino_t parent;
+	unsigned long gen;
+	uint32_t node;
+	char *name;
+
+	if (cat == NULL)
+		return (MFS_CATALOG_NONE);
+	if (ino == FUSE_ROOT_ID)
+		return (MFS_CATALOG_ROOT);
+	gen = mfs_catalog_generation(cat);
+	pthread_mutex_lock(&ll_lock);
+	if ((in = mfs_ll_get(ino)) == NULL || in->in_gen == gen) {
+		node = (in == NULL) ? MFS_CATALOG_NONE : in->in_node;
+		pthread_mutex_unlock(&ll_lock);
+		return (node);
+	}
+	parent = in->in_parent->in_ino;
+	name = strdup(in->in_name);
+	pthread_mutex_unlock(&ll_lock);
+	if (name == NULL)
+		return (MFS_CATALOG_NONE);
+
+	node = mfs_ll_node(cat, parent);
+	if (node != MFS_CATALOG_NONE)
+		node = mfs_catalog_lookup(cat, node, name);
+	free(name);
+
+	pthread_mutex_lock(&ll_lock);
+	if ((in = mfs_ll_get(ino)) != NULL) {
+		in->in_node = node;
+		in->in_gen = gen;
+	}
+	pthread_mutex_unlock(&ll_lock);
+	return (node);
+}
+
+/*
+ * The path of a file that is not in the catalog, or NULL for inodes
+ * that are.
+ */
+static const char *
+mfs_ll_special(fuse_ino_t ino)
+{
+	size_t n;
+
+	n = sizeof(mfs_ll_specials) / sizeof(mfs_ll_specials[0]) - 1;
+	if (ino < MFS_LL_SPECIAL_INO || ino >= MFS_LL_SPECIAL_INO + n)
+		return (NULL);
+	return (mfs_ll_specials[ino - MFS_LL_SPECIAL_INO]);
+}
+
+static void
+mfs_ll_init(void *data, struct fuse_conn_info *conn)
+{
+
+	mfs_ops.init(conn);
+}
+
+static void
+mfs_ll_destroy(void *data)
+{
+	struct mfs_inode *in, *next;
+	size_t i;
+
+	mfs_ops.destroy(NULL);
+	pthread_mutex_lock(&ll_lock);
+	for (i = 0; i < ll_buckets; i++) {
+		for (in = ll_byino[i]; in != NULL; in = next) {
+			next = in->in_inonext;
+			free(in->in_name);
+			free(in);
+		}
+	}
+	free(ll_byino);
+	free(ll_byname);
+	ll_byino = ll_byname = NULL;
+	ll_buckets = ll_count = 0;
+	pthread_mutex_unlock(&ll_lock);
+}
+
+static void
+mfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e;
+	struct mfs_catalog *cat;
+	struct mfs_inode *pin, *in;
+	uint32_t node;
+	int i, res;
+
+	memset(&e, 0, sizeof(e));
+	e.attr_timeout = MFS_LL_TIMEOUT;
+	e.entry_timeout = MFS_LL_TIMEOUT;
+	if (parent == FUSE_ROOT_ID) {
+		for (i = 0; mfs_ll_specials[i] != NULL; i++) {
+			if (strcmp(name, mfs_ll_specials[i] + 1) != 0)
+				continue;
+			res = mfs_ops.getattr(mfs_ll_specials[i], &e.attr);
+			if (res != 0) {
+				fuse_reply_err(req, res < 0 ? -res : EIO);
+				return;
+			}
+			/* These are not counted, and never forgotten. */
+			e.ino = MFS_LL_SPECIAL_INO + i;
+			e.attr.st_ino = e.ino;
+			fuse_reply_entry(req, &e);
+			return;
+		}
+	}
+
+	cat = mfs_catalog_get();
+	in = NULL;
+	if ((node = mfs_ll_node(cat, parent)) != MFS_CATALOG_NONE)
+		node = mfs_catalog_lookup(cat, node, name);
+	if (node != MFS_CATALOG_NONE) {
+		pthread_mutex_lock(&ll_lock);
+		if ((pin = mfs_ll_get(parent)) == NULL)
+			node = MFS_CATALOG_NONE;
+		else if ((in = mfs_ll_child(pin,
+		    mfs_catalog_name(cat, node))) != NULL) {
+			in->in_nlookup++;
+			in->in_node = node;
+			in->in_gen = mfs_catalog_generation(cat);
+			e.ino = in->in_ino;
+		}
+		pthread_mutex_unlock(&ll_lock);
+	}
+	if (in == NULL) {
+		mfs_catalog_put(cat);
+		fuse_reply_err(req, node == MFS_CATALOG_NONE ? ENOENT : ENOMEM);
+		return;
+	}
+	mfs_catalog_stat(cat, node, &e.attr);
+	e.attr.st_ino = e.ino;
+	mfs_catalog_put(cat);
+	fuse_reply_entry(req, &e);
+}
+
+static void
+mfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	struct mfs_inode *in;
+
+	pthread_mutex_lock(&ll_lock);
+	if ((in = mfs_ll_get(ino)) != NULL && in != &ll_root) {
+		in->in_nlookup -= (nlookup < in->in_nlookup) ? nlookup :
+		    in->in_nlookup;
+		mfs_ll_unref(in);
+	}
+	pthread_mutex_unlock(&ll_lock);
+	fuse_reply_none(req);
+}
+
+static void
+mfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct mfs_catalog *cat;
+	struct stat st;
+	const char *path;
+	uint32_t node;
+	int res;
+
+	if ((path = mfs_ll_special(ino)) != NULL) {
+		res = mfs_ops.getattr(path, &st);
+		if (res != 0) {
+			fuse_reply_err(req, res < 0 ? -res : EIO);
+			return;
+		}
+		st.st_ino = ino;
+		fuse_reply_attr(req, &st, MFS_LL_TIMEOUT);
+		return;
+	}
+	if (ino == FUSE_ROOT_ID) {
+		memset(&st, 0, sizeof(st));
+		st.st_ino = ino;
+		st.st_mode = S_IFDIR | 0755;
+		st.st_nlink = 2;
+		fuse_reply_attr(req, &st, MFS_LL_TIMEOUT);
+		return;
+	}
+
+	cat = mfs_catalog_get();
+	node = mfs_ll_node(cat, ino);
+	if (node == MFS_CATALOG_NONE) {
+		mfs_catalog_put(cat);
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	mfs_catalog_stat(cat, node, &st);
+	st.st_ino = ino;
+	mfs_catalog_put(cat);
+	fuse_reply_attr(req, &st, MFS_LL_TIMEOUT);
+}
+
+/*
+ * Only .config can be changed, by way of the path operations.
+ */
+static void
+mfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+    struct fuse_file_info *fi)
+{
+	struct timespec tv[2];
+	struct stat st;
+	const char *path;
+	int res;
+
+	if ((path = mfs_ll_special(ino)) == NULL ||
+	    strcmp(path, "/.config") != 0) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+	res = 0;
+	if (res == 0 && (to_set & FUSE_SET_ATTR_SIZE))
+		res = mfs_ops.truncate(path, attr->st_size);
+	if (res == 0 && (to_set & FUSE_SET_ATTR_MODE))
+		res = mfs_ops.chmod(path, attr->st_mode);
+	if (res == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+		tv[0].tv_sec = attr->st_atime;
+		tv[0].tv_nsec = 0;
+		tv[1].tv_sec = attr->st_mtime;
+		tv[1].tv_nsec = 0;
+		res = mfs_ops.utimens(path, tv);
+	}
+	if (res == 0)
+		res = mfs_ops.getattr(path, &st);
+	if (res != 0) {
+		fuse_reply_err(req, res < 0 ? -res : EPERM);
+		return;
+	}
+	st.st_ino = ino;
+	fuse_reply_attr(req, &st, MFS_LL_TIMEOUT);
+}
+
+static void
+mfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct mfs_catalog *cat;
+	const char *path;
+	uint32_t node;
+	int fd, res;
+
+	if ((path = mfs_ll_special(ino)) != NULL) {
+		res = mfs_ops.open(path, fi);
+		if (res != 0)
+			fuse_reply_err(req, res < 0 ? -res : EIO);
+		else
+			fuse_reply_open(req, fi);
+		return;
+	}
+
+	cat = mfs_catalog_get();
+	node = mfs_ll_node(cat, ino);
+	if (node == MFS_CATALOG_NONE || mfs_catalog_isdir(cat, node)) {
+		res = (node == MFS_CATALOG_NONE) ? ENOENT : EISDIR;
+		mfs_catalog_put(cat);
+		fuse_reply_err(req, res);
+		return;
+	}
+	fd = open(mfs_catalog_file(cat, node, NULL, NULL), O_RDONLY);
+	res = errno;
+	mfs_catalog_put(cat);
+	if (fd < 0) {
+		fuse_reply_err(req, res);
+		return;
+	}
+	fi->fh = (uint64_t)fd;
+	fuse_reply_open(req, fi);
+}
+
+static void
+mfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+    struct fuse_file_info *fi)
+{
+	struct timespec start, end;
+	const char *path;
+	ssize_t bytes;
+	char *buf;
+
+	if ((buf = malloc(size)) == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	if ((path = mfs_ll_special(ino)) != NULL)
+		bytes = mfs_ops.read(path, buf, size, off, fi);
+	else {
+		/* As in mfs_read(), slow reads hold the scanner back. */
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		bytes = pread((int)fi->fh, buf, size, off);
+		if (bytes < 0)
+			bytes = -errno;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		mfs_qos_fgread((end.tv_sec - start.tv_sec) +
+		    (end.tv_nsec - start.tv_nsec) / 1e9);
+	}
+	if (bytes < 0)
+		fuse_reply_err(req, (int)-bytes);
+	else
+		fuse_reply_buf(req, buf, bytes);
+	free(buf);
+}
+
+static void
+mfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+    off_t off, struct fuse_file_info *fi)
+{
+	const char *path;
+	int res;
+
+	if ((path = mfs_ll_special(ino)) == NULL) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+	res = mfs_ops.write(path, buf, size, off, fi);
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_write(req, res);
+}
+
+static void
+mfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+
+	fuse_reply_err(req, 0);
+}
+
+static void
+mfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	const char *path;
+
+	if ((path = mfs_ll_special(ino)) != NULL)
+		mfs_ops.release(path, fi);
+	else
+		close((int)fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+static void
+mfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+    struct fuse_file_info *fi)
+{
+
+	fuse_reply_err(req, 0);
+}
+
+/*
+ * A directory is read from the catalog it was opened in, so a listing
+ * is consistent even if a new catalog is loaded while it is read.
+ */
+static void
+mfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct mfs_lldir *d;
+
+	if ((d = malloc(sizeof(*d))) == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	d->d_cat = mfs_catalog_get();
+	d->d_node = mfs_ll_node(d->d_cat, ino);
+	/* The root is listed even before there is a catalog. */
+	if (ino != FUSE_ROOT_ID && (d->d_node == MFS_CATALOG_NONE ||
+	    !mfs_catalog_isdir(d->d_cat, d->d_node))) {
+		mfs_catalog_put(d->d_cat);
+		free(d);
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+	fi->fh = (uint64_t)(uintptr_t)d;
+	fuse_reply_open(req, fi);
+}
+
+/*
+ * The entries are ".", "..", the children of the node and, in the root,
+ * the files that are not in the catalog. The offset of an entry is its
+ * position in that list, plus one.
+ */
+static void
+mfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+    struct fuse_file_info *fi)
+{
+	struct mfs_lldir *d;
+	struct mfs_inode *in, *pin;
+	struct stat st;
+	const char *name;
+	uint32_t first, count, node;
+	size_t len, entlen, nspecial;
+	off_t i;
+	char *buf;
+
+	d = (struct mfs_lldir *)(uintptr_t)fi->fh;
+	if ((buf = malloc(size)) == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	first = 0;
+	count = 0;
+	if (d->d_node != MFS_CATALOG_NONE)
+		first = mfs_catalog_children(d->d_cat, d->d_node, &count);
+	nspecial = (ino == FUSE_ROOT_ID) ?
+	    sizeof(mfs_ll_specials) / sizeof(mfs_ll_specials[0]) - 1 : 0;
+
+	pthread_mutex_lock(&ll_lock);
+	pin = mfs_ll_get(ino);
+	len = 0;
+	for (i = off; i < 2 + (off_t)count + (off_t)nspecial; i++) {
+		memset(&st, 0, sizeof(st));
+		st.st_ino = MFS_LL_UNKNOWN_INO;
+		if (i < 2) {
+			name = (i == 0) ? "." : "..";
+			st.st_mode = S_IFDIR;
+		} else if (i < 2 + (off_t)count) {
+			node = first + (uint32_t)(i - 2);
+			name = mfs_catalog_name(d->d_cat, node);
+			st.st_mode = mfs_catalog_isdir(d->d_cat, node) ?
+			    S_IFDIR : S_IFREG;
+		} else {
+			name = mfs_ll_specials[i - 2 - count] + 1;
+			st.st_ino = MFS_LL_SPECIAL_INO + (i - 2 - count);
+			st.st_mode = S_IFREG;
+		}
+		/* Names that have been looked up have their inode. */
+		if (i >= 2 && i < 2 + (off_t)count && pin != NULL &&
+		    ll_buckets > 0) {
+			for (in = ll_byname[mfs_ll_namehash(pin, name)];
+			    in != NULL; in = in->in_namenext)
+				if (in->in_parent == pin &&
+				    strcmp(in->in_name, name) == 0) {
+					st.st_ino = in->in_ino;
+					break;
+				}
+		}
+		entlen = fuse_add_direntry(req, buf + len, size - len, name,
+		    &st, i + 1);
+		if (entlen > size - len)
+			break;
+		len += entlen;
+	}
+	pthread_mutex_unlock(&ll_lock);
+	fuse_reply_buf(req, buf, len);
+	free(buf);
+}
+
+static void
+mfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct mfs_lldir *d;
+
+	d = (struct mfs_lldir *)(uintptr_t)fi->fh;
+	mfs_catalog_put(d->d_cat);
+	free(d);
+	fuse_reply_err(req, 0);
+}
+
+static struct fuse_lowlevel_ops mfs_llops = {
+	.init       = mfs_ll_init,
+	.destroy    = mfs_ll_destroy,
+	.lookup     = mfs_ll_lookup,
+	.forget     = mfs_ll_forget,
+	.getattr    = mfs_ll_getattr,
+	.setattr    = mfs_ll_setattr,
+	.open       = mfs_ll_open,
+	.read       = mfs_ll_read,
+	.write      = mfs_ll_write,
+	.flush      = mfs_ll_flush,
+	.release    = mfs_ll_release,
+	.fsync      = mfs_ll_fsync,
+	.opendir    = mfs_ll_opendir,
+	.readdir    = mfs_ll_readdir,
+	.releasedir = mfs_ll_releasedir,
+};
+
+int
+mfs_lowlevel_main(struct fuse_args *args)
+{
+	struct fuse_session *se;
+	struct fuse_chan *ch;
+	char *mountpoint;
+	int foreground, multithreaded, ret;
+
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded,
+	    &foreground) != 0 || mountpoint == NULL)
+		return (1);
+	ret = 1;
+	if ((ch = fuse_mount(mountpoint, args)) == NULL) {
+		free(mountpoint);
+		return (1);
+	}
+	se = fuse_lowlevel_new(args, &mfs_llops, sizeof(mfs_llops), NULL);
+	if (se != NULL) {
+		if (fuse_set_signal_handlers(se) == 0) {
+			fuse_session_add_chan(se, ch);
+			if (fuse_daemonize(foreground) == 0)
+				ret = multithreaded ? fuse_session_loop_mt(se) :
+				    fuse_session_loop(se);
+			fuse_remove_signal_handlers(se);
+			fuse_session_remove_chan(ch);
+		}
+		fuse_session_destroy(se);
+	}
+	fuse_unmount(mountpoint, ch);
+	free(mountpoint);
+	return (ret);
+}
@@ -18,15 +18,29 @@
  * A copy of the license can typically be found in COPYING
  */
 
-#if defined(__FreeBSD__)
+/* O_PATH, struct file_handle and open_by_handle_at() for fanotify. */
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/param.h>
+#if defined(__FreeBSD__)
 #include <sys/event.h>
 #include <sys/time.h>
+#elif defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/vfs.h>
+#if defined(FAN_REPORT_DFID_NAME)
+#define MFS_NOTIFY_FANOTIFY
+#endif
 #endif
 
+#include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <unistd.h>
 
 #include <assert.h>
@@ -36,98 +50,594 @@
 #include <mfs_notify.h>
 
 /*
- * One entry for the file that should be handled.
+ * One entry for the file that should be handled. A root is a directory
+ * watched with everything below it, through a fanotify mark on its
+ * filesystem. Roots are not hashed by descriptor.
  */
 struct mfs_notify_entry {
-	int fd;
-	char path[MAXPATHLEN + 1];
-	LIST_ENTRY(mfs_notify_entry) next;
+	int fd;			/* Open file, or inotify watch on Linux. */
+	char *path;
+	unsigned int ne_hash;	/* Hash of the path. */
+	struct mfs_notify_entry *ne_pathnext;
+	struct mfs_notify_entry *ne_fdnext;
+	int ne_root;
+#if defined(MFS_NOTIFY_FANOTIFY)
+	fsid_t ne_fsid;		/* Filesystem of a root. */
+#endif
+	struct mfs_notify_entry *ne_rootnext;
 };
 
 /*
  * Data structure to keep track of all files and directories we want to keep
- * track of.
+ * track of. The entries are hashed both by path, for registering and
+ * unregistering, and by descriptor, for finding the entry of an event.
+ * Both tables have the same size, and grow with the number of entries.
  */
+#define MFS_NOTIFY_MINBUCKETS	256
+
 struct mfs_notify_list {
-	LIST_HEAD(, mfs_notify_entry) nl_head;
+	struct mfs_notify_entry **nl_bypath;
+	struct mfs_notify_entry **nl_byfd;
+	size_t nl_nbuckets;	/* A power of two. */
+	size_t nl_count;
+	struct mfs_notify_entry *nl_roots;
 	pthread_mutex_t nl_lock;
 #define MFS_NOTIFYLIST_LOCK(l) pthread_mutex_lock(&(l)->nl_lock)
 #define MFS_NOTIFYLIST_UNLOCK(l) pthread_mutex_unlock(&(l)->nl_lock)
 
 #if defined(__FreeBSD__)
 	int kqueue_fd;
+#elif defined(__linux__)
+	int inotify_fd;
+	int fanotify_fd;	/* Only with CAP_SYS_ADMIN, else -1. */
+	int epoll_fd;
+	int stop_fd;		/* Wakes the thread up to exit. */
 #endif
+	pthread_t nl_thr;	/* The one thread handling events. */
+	int nl_running;
 	mfs_callback_fn_t *handler;
 };
 
 /* XXX: We use a global list for now. */
-struct mfs_notify_list nl;
+struct mfs_notify_list nl = {
+	.nl_lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
 #if defined(__FreeBSD__)
-pthread_t mfs_notify_kqueue_thr;
+/* The user event telling the thread to stop. */
+#define MFS_NOTIFY_STOP	1
+
 static void *mfs_notify_kqueue_handler(void *);
+#elif defined(__linux__)
+/*
+ * Directories are watched for changes to the files in them. A file that is
+ * written gives IN_MODIFY for every write, and IN_CLOSE_WRITE when it is
+ * done.
+ */
+#define MFS_NOTIFY_MASK	(IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | \
+    IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE | IN_DELETE_SELF | \
+    IN_MOVE_SELF | IN_EXCL_UNLINK)
+
+#if defined(MFS_NOTIFY_FANOTIFY)
+/* The same events for a whole filesystem. */
+#define MFS_FANOTIFY_MASK	(FAN_CREATE | FAN_MODIFY | FAN_CLOSE_WRITE | \
+    FAN_ATTRIB | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_DELETE | FAN_ONDIR)
 #endif
 
-/* Initialize the notification system. */
+static void *mfs_notify_epoll_handler(void *);
+#endif
+
+static unsigned int
+mfs_notify_hash(const char *path)
+{
+	unsigned int h;
+
+	/* FNV-1a */
+	h = 2166136261u;
+	while (*path != '\0') {
+		h ^= (unsigned char)*path++;
+		h *= 16777619u;
+	}
+	return (h);
+}
+
+/* Check if a path is a directory or below it. */
+static int
+mfs_notify_below(const char *path, const char *dir)
+{
+	size_t len;
+
+	len = strlen(dir);
+	return (strncmp(path, dir, len) == 0 &&
+	    (path[len] == '\0' || path[len] == '/'));
+}
+
+#define MFS_NOTIFY_PATHSLOT(h)	((h) & (nl.nl_nbuckets - 1))
+#define MFS_NOTIFY_FDSLOT(fd)	(((unsigned int)(fd) * 2654435761u) & \
+    (nl.nl_nbuckets - 1))
+
+/* Find the entry of a file or watch. Called with the list locked. */
+static struct mfs_notify_entry *
+mfs_notify_lookup_fd(int fd)
+{
+	struct mfs_notify_entry *ent;
+
+	if (nl.nl_nbuckets == 0)
+		return (NULL);
+	for (ent = nl.nl_byfd[MFS_NOTIFY_FDSLOT(fd)]; ent != NULL;
+	    ent = ent->ne_fdnext) {
+		if (ent->fd == fd)
+			return (ent);
+	}
+	return (NULL);
+}
+
+/* Find the entry of a path. Called with the list locked. */
+static struct mfs_notify_entry *
+mfs_notify_lookup_path(const char *path)
+{
+	struct mfs_notify_entry *ent;
+	unsigned int h;
+
+	if (nl.nl_nbuckets == 0)
+		return (NULL);
+	h = mfs_notify_hash(path);
+	for (ent = nl.nl_bypath[MFS_NOTIFY_PATHSLOT(h)]; ent != NULL;
+	    ent = ent->ne_pathnext) {
+		if (ent->ne_hash == h && strcmp(ent->path, path) == 0)
+			return (ent);
+	}
+	return (NULL);
+}
+
+static void
+mfs_notify_link_path(struct mfs_notify_entry *ent)
+{
+	struct mfs_notify_entry **slot;
+
+	slot = &nl.nl_bypath[MFS_NOTIFY_PATHSLOT(ent->ne_hash)];
+	ent->ne_pathnext = *slot;
+	*slot = ent;
+}
+
+static void
+mfs_notify_unlink_path(struct mfs_notify_entry *ent)
+{
+	struct mfs_notify_entry **pp;
+
+	pp = &nl.nl_bypath[MFS_NOTIFY_PATHSLOT(ent->ne_hash)];
+	while (*pp != ent)
+		pp = &(*pp)->ne_pathnext;
+	*pp = ent->ne_pathnext;
+}
+
+static void
+mfs_notify_link_fd(struct mfs_notify_entry *ent)
+{
+	struct mfs_notify_entry **slot;
+
+	slot = &nl.nl_byfd[MFS_NOTIFY_FDSLOT(ent->fd)];
+	ent->ne_fdnext = *slot;
+	*slot = ent;
+}
+
+static void
+mfs_notify_unlink_fd(struct mfs_notify_entry *ent)
+{
+	struct mfs_notify_entry **pp;
+
+	pp = &nl.nl_byfd[MFS_NOTIFY_FDSLOT(ent->fd)];
+	while (*pp != ent)
+		pp = &(*pp)->ne_fdnext;
+	*pp = ent->ne_fdnext;
+}
+
+/*
+ * Make room for one more entry, doubling the tables when they get as many
+ * entries as buckets. Called with the list locked.
+ */
+static int
+mfs_notify_grow()
+{
+	struct mfs_notify_entry **bypath, **byfd, *ent, *next;
+	size_t i, oldn, n;
+
+	if (nl.nl_count < nl.nl_nbuckets)
+		return (0);
+	oldn = nl.nl_nbuckets;
+	n = (oldn > 0) ? oldn * 2 : MFS_NOTIFY_MINBUCKETS;
+	bypath = calloc(n, sizeof(*bypath));
+	byfd = calloc(n, sizeof(*byfd));
+	if (bypath == NULL || byfd == NULL) {
+		free(bypath);
+		free(byfd);
+		return (-1);
+	}
+	nl.nl_nbuckets = n;
+	/* Every entry is in both tables, so one of them finds them all. */
+	for (i = 0; i < oldn; i++) {
+		for (ent = nl.nl_bypath[i]; ent != NULL; ent = next) {
+			next = ent->ne_pathnext;
+			ent->ne_pathnext = bypath[MFS_NOTIFY_PATHSLOT(
+			    ent->ne_hash)];
+			bypath[MFS_NOTIFY_PATHSLOT(ent->ne_hash)] = ent;
+			if (ent->ne_root)
+				continue;
+			ent->ne_fdnext = byfd[MFS_NOTIFY_FDSLOT(ent->fd)];
+			byfd[MFS_NOTIFY_FDSLOT(ent->fd)] = ent;
+		}
+	}
+	free(nl.nl_bypath);
+	free(nl.nl_byfd);
+	nl.nl_bypath = bypath;
+	nl.nl_byfd = byfd;
+	return (0);
+}
+
+/* Give an entry a new path. Called with the list locked. */
+static void
+mfs_notify_rename(struct mfs_notify_entry *ent, const char *path)
+{
+	char *newpath;
+
+	if ((newpath = strdup(path)) == NULL)
+		return;
+	mfs_notify_unlink_path(ent);
+	free(ent->path);
+	ent->path = newpath;
+	ent->ne_hash = mfs_notify_hash(path);
+	mfs_notify_link_path(ent);
+}
+
+/* Forget an entry that the kernel is done with. */
+static void
+mfs_notify_free(struct mfs_notify_entry *ent)
+{
+
+	mfs_notify_unlink_path(ent);
+	if (!ent->ne_root)
+		mfs_notify_unlink_fd(ent);
+	nl.nl_count--;
+	free(ent->path);
+	free(ent);
+}
+
+/* Stop watching an entry and free it. Called with the list locked. */
+static void
+mfs_notify_remove(struct mfs_notify_entry *ent)
+{
+	struct mfs_notify_entry **pp;
+
+	if (ent->ne_root) {
+		for (pp = &nl.nl_roots; *pp != ent; pp = &(*pp)->ne_rootnext)
+			;
+		*pp = ent->ne_rootnext;
+#if defined(MFS_NOTIFY_FANOTIFY)
+		struct mfs_notify_entry *other;
+
+		/* Keep the mark while another root is on the filesystem. */
+		for (other = nl.nl_roots; other != NULL;
+		    other = other->ne_rootnext) {
+			if (memcmp(&other->ne_fsid, &ent->ne_fsid,
+			    sizeof(ent->ne_fsid)) == 0)
+				break;
+		}
+		if (other == NULL)
+			fanotify_mark(nl.fanotify_fd, FAN_MARK_REMOVE |
+			    FAN_MARK_FILESYSTEM, MFS_FANOTIFY_MASK, ent->fd,
+			    NULL);
+#endif
+		close(ent->fd);
+		mfs_notify_free(ent);
+		return;
+	}
+#if defined(__linux__)
+	inotify_rm_watch(nl.inotify_fd, ent->fd);
+#else
+	close(ent->fd);
+#endif
+	mfs_notify_free(ent);
+}
+
+/*
+ * Initialize the notification system, and start the thread that waits for
+ * events on all registered files.
+ */
 int
 mfs_notify_init(mfs_callback_fn_t *fn)
 {
 	assert(fn != NULL);
 
-	LIST_INIT(&nl.nl_head);
-	pthread_mutex_init(&nl.nl_lock, NULL);
+	MFS_NOTIFYLIST_LOCK(&nl);
+	if (nl.nl_running) {
+		MFS_NOTIFYLIST_UNLOCK(&nl);
+		return (0);
+	}
 	nl.handler = fn;
 
 #if defined(__FreeBSD__)
+	struct kevent ev;
+
 	nl.kqueue_fd = kqueue();
+	if (nl.kqueue_fd < 0) {
+		MFS_NOTIFYLIST_UNLOCK(&nl);
+		return (-1);
+	}
+	EV_SET(&ev, MFS_NOTIFY_STOP, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0,
+	    NULL);
+	kevent(nl.kqueue_fd, &ev, 1, NULL, 0, NULL);
+	if (pthread_create(&nl.nl_thr, NULL, mfs_notify_kqueue_handler,
+	    &nl) != 0) {
+		close(nl.kqueue_fd);
+		MFS_NOTIFYLIST_UNLOCK(&nl);
+		return (-1);
+	}
+	nl.nl_running = 1;
+#elif defined(__linux__)
+	struct epoll_event ev;
+
+	nl.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	nl.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	nl.stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	/*
+	 * Marking whole filesystems takes CAP_SYS_ADMIN. Without it, every
+	 * directory gets an inotify watch.
+	 */
+	nl.fanotify_fd = -1;
+#if defined(MFS_NOTIFY_FANOTIFY)
+	nl.fanotify_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME |
+	    FAN_NONBLOCK | FAN_CLOEXEC, O_RDONLY | O_LARGEFILE);
 #endif
+	if (nl.inotify_fd < 0 || nl.epoll_fd < 0 || nl.stop_fd < 0)
+		goto fail;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = nl.inotify_fd;
+	if (epoll_ctl(nl.epoll_fd, EPOLL_CTL_ADD, nl.inotify_fd, &ev) < 0)
+		goto fail;
+	ev.data.fd = nl.fanotify_fd;
+	if (nl.fanotify_fd >= 0 &&
+	    epoll_ctl(nl.epoll_fd, EPOLL_CTL_ADD, nl.fanotify_fd, &ev) < 0)
+		goto fail;
+	ev.data.fd = nl.stop_fd;
+	if (epoll_ctl(nl.epoll_fd, EPOLL_CTL_ADD, nl.stop_fd, &ev) < 0)
+		goto fail;
+	if (pthread_create(&nl.nl_thr, NULL, mfs_notify_epoll_handler,
+	    &nl) != 0)
+		goto fail;
+	nl.nl_running = 1;
+#endif
+	MFS_NOTIFYLIST_UNLOCK(&nl);
 	return (0);
+
+#if defined(__linux__)
+fail:
+	if (nl.inotify_fd >= 0)
+		close(nl.inotify_fd);
+	if (nl.fanotify_fd >= 0)
+		close(nl.fanotify_fd);
+	if (nl.epoll_fd >= 0)
+		close(nl.epoll_fd);
+	if (nl.stop_fd >= 0)
+		close(nl.stop_fd);
+	MFS_NOTIFYLIST_UNLOCK(&nl);
+	return (-1);
+#endif
+}
+
+/*
+ * Stop the event thread and forget all registered files.
+ */
+void
+mfs_notify_stop()
+{
+	struct mfs_notify_entry *ent;
+	size_t i;
+
+	MFS_NOTIFYLIST_LOCK(&nl);
+	if (!nl.nl_running) {
+		MFS_NOTIFYLIST_UNLOCK(&nl);
+		return;
+	}
+	nl.nl_running = 0;
+#if defined(__FreeBSD__)
+	struct kevent ev;
+
+	EV_SET(&ev, MFS_NOTIFY_STOP, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+	kevent(nl.kqueue_fd, &ev, 1, NULL, 0, NULL);
+#elif defined(__linux__)
+	uint64_t one = 1;
+
+	if (write(nl.stop_fd, &one, sizeof(one)) < 0)
+		perror("mfs_notify_stop");
+#endif
+	MFS_NOTIFYLIST_UNLOCK(&nl);
+	pthread_join(nl.nl_thr, NULL);
+
+	MFS_NOTIFYLIST_LOCK(&nl);
+	for (i = 0; i < nl.nl_nbuckets; i++) {
+		while ((ent = nl.nl_bypath[i]) != NULL)
+			mfs_notify_remove(ent);
+	}
+	free(nl.nl_bypath);
+	free(nl.nl_byfd);
+	nl.nl_bypath = nl.nl_byfd = NULL;
+	nl.nl_nbuckets = 0;
+#if defined(__FreeBSD__)
+	close(nl.kqueue_fd);
+#elif defined(__linux__)
+	close(nl.inotify_fd);
+	if (nl.fanotify_fd >= 0)
+		close(nl.fanotify_fd);
+	close(nl.epoll_fd);
+	close(nl.stop_fd);
+#endif
+	MFS_NOTIFYLIST_UNLOCK(&nl);
 }
 
-/* Register a file for events. */
+/*
+ * Register a file for events. Registering a file again does nothing.
+ */
 int
 mfs_notify_register(const char *path)
 {
 	struct mfs_notify_entry *ent;
-	
+	int fd;
+
 	assert(path != NULL);
-	ent = malloc(sizeof(struct mfs_notify_entry));
-	if (ent == NULL)
+#if defined(__linux__)
+	MFS_NOTIFYLIST_LOCK(&nl);
+	if (!nl.nl_running) {
+		MFS_NOTIFYLIST_UNLOCK(&nl);
 		return (-1);
-	strlcpy(ent->path, path, sizeof(ent->path));
-	ent->fd = open(path, O_RDONLY);
-	if (ent->fd < 0)
+	}
+	fd = inotify_add_watch(nl.inotify_fd, path, MFS_NOTIFY_MASK);
+	if (fd < 0) {
+		MFS_NOTIFYLIST_UNLOCK(&nl);
 		return (-1);
+	}
+	/*
+	 * The watch of a directory that was already registered is handed
+	 * out again, also when the directory has been moved.
+	 */
+	ent = mfs_notify_lookup_fd(fd);
+	if (ent != NULL) {
+		if (strcmp(ent->path, path) != 0)
+			mfs_notify_rename(ent, path);
+		MFS_NOTIFYLIST_UNLOCK(&nl);
+		return (0);
+	}
+#else
 	MFS_NOTIFYLIST_LOCK(&nl);
-	LIST_INSERT_HEAD(&nl.nl_head, ent, next);
-	MFS_NOTIFYLIST_UNLOCK(&nl);
+	if (mfs_notify_lookup_path(path) != NULL) {
+		MFS_NOTIFYLIST_UNLOCK(&nl);
+		return (0);
+	}
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		MFS_NOTIFYLIST_UNLOCK(&nl);
+		return (-1);
+	}
+#endif
+	ent = NULL;
+	if (mfs_notify_grow() == 0 &&
+	    (ent = calloc(1, sizeof(*ent))) != NULL &&
+	    (ent->path = strdup(path)) == NULL) {
+		free(ent);
+		ent = NULL;
+	}
+	if (ent == NULL) {
+#if defined(__linux__)
+		inotify_rm_watch(nl.inotify_fd, fd);
+#else
+		close(fd);
+#endif
+		MFS_NOTIFYLIST_UNLOCK(&nl);
+		return (-1);
+	}
+	ent->fd = fd;
+	ent->ne_hash = mfs_notify_hash(path);
+	mfs_notify_link_path(ent);
+	mfs_notify_link_fd(ent);
+	nl.nl_count++;
 
 #if defined(__FreeBSD__)
 	struct kevent ev;
 	EV_SET(&ev, ent->fd, EVFILT_VNODE, EV_ADD | EV_ENABLE | EV_CLEAR,
 	    NOTE_RENAME | NOTE_WRITE | NOTE_DELETE, 0, ent);
 	kevent(nl.kqueue_fd, &ev, 1, NULL, 0, NULL);
-	pthread_create(&mfs_notify_kqueue_thr, NULL, mfs_notify_kqueue_handler,
-	    &nl);
 #endif
+	MFS_NOTIFYLIST_UNLOCK(&nl);
 	return (0);
 }
 
-/* Unregister a file for events. */
+/*
+ * Register a directory with everything below it, using one mark on its
+ * filesystem, which costs the same however many directories there are.
+ * Events elsewhere on the filesystem are dropped here. Returns -1 if
+ * that can't be done, and the directories have to be registered one by
+ * one.
+ */
 int
-mfs_notify_unregister_file(const char *path)
+mfs_notify_register_root(const char *path)
 {
+#if defined(MFS_NOTIFY_FANOTIFY)
 	struct mfs_notify_entry *ent;
+	struct statfs sfs;
+	int fd;
 
+	assert(path != NULL);
 	MFS_NOTIFYLIST_LOCK(&nl);
-	LIST_FOREACH(ent, &nl.nl_head, next) {
+	if (!nl.nl_running || nl.fanotify_fd < 0) {
+		MFS_NOTIFYLIST_UNLOCK(&nl);
+		return (-1);
+	}
+	for (ent = nl.nl_roots; ent != NULL; ent = ent->ne_rootnext) {
 		if (strcmp(ent->path, path) == 0) {
-			LIST_REMOVE(ent, next);
-			close(ent->fd);
-			free(ent);
-			break;
+			MFS_NOTIFYLIST_UNLOCK(&nl);
+			return (0);
 		}
 	}
+	/* The root also resolves the file handles in its events. */
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		MFS_NOTIFYLIST_UNLOCK(&nl);
+		return (-1);
+	}
+	ent = NULL;
+	if (fstatfs(fd, &sfs) < 0 ||
+	    fanotify_mark(nl.fanotify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+	    MFS_FANOTIFY_MASK, fd, NULL) < 0 || mfs_notify_grow() != 0 ||
+	    (ent = calloc(1, sizeof(*ent))) == NULL ||
+	    (ent->path = strdup(path)) == NULL) {
+		free(ent);
+		close(fd);
+		MFS_NOTIFYLIST_UNLOCK(&nl);
+		return (-1);
+	}
+	ent->fd = fd;
+	ent->ne_root = 1;
+	memcpy(&ent->ne_fsid, &sfs.f_fsid, sizeof(ent->ne_fsid));
+	ent->ne_hash = mfs_notify_hash(path);
+	mfs_notify_link_path(ent);
+	ent->ne_rootnext = nl.nl_roots;
+	nl.nl_roots = ent;
+	nl.nl_count++;
+	MFS_NOTIFYLIST_UNLOCK(&nl);
+	return (0);
+#else
+	return (-1);
+#endif
+}
+
+/*
+ * Check if a path is below a directory registered with
+ * mfs_notify_register_root().
+ */
+int
+mfs_notify_covered(const char *path)
+{
+	struct mfs_notify_entry *ent;
+
+	MFS_NOTIFYLIST_LOCK(&nl);
+	for (ent = nl.nl_roots; ent != NULL; ent = ent->ne_rootnext) {
+		if (mfs_notify_below(path, ent->path))
+			break;
+	}
+	MFS_NOTIFYLIST_UNLOCK(&nl);
+	return (ent != NULL);
+}
+
+/* Unregister a file for events. */
+int
+mfs_notify_unregister_file(const char *path)
+{
+	struct mfs_notify_entry *ent;
+
+	MFS_NOTIFYLIST_LOCK(&nl);
+	ent = mfs_notify_lookup_path(path);
+	if (ent != NULL)
+		mfs_notify_remove(ent);
 	MFS_NOTIFYLIST_UNLOCK(&nl);
 	return (0);
 }
@@ -139,6 +649,26 @@ mfs_notify_unregister_entry(struct mfs_notify_entry *ent)
 	return (mfs_notify_unregister_file(ent->path));
 }
 
+/* Unregister a directory and all files below it. */
+int
+mfs_notify_unregister_tree(const char *path)
+{
+	struct mfs_notify_entry *ent, *tmp;
+	size_t i;
+
+	MFS_NOTIFYLIST_LOCK(&nl);
+	/* Nothing is indexed by prefix, so this looks at every entry. */
+	for (i = 0; i < nl.nl_nbuckets && nl.nl_count > 0; i++) {
+		for (ent = nl.nl_bypath[i]; ent != NULL; ent = tmp) {
+			tmp = ent->ne_pathnext;
+			if (mfs_notify_below(ent->path, path))
+				mfs_notify_remove(ent);
+		}
+	}
+	MFS_NOTIFYLIST_UNLOCK(&nl);
+	return (0);
+}
+
 /* Return path associated with entry. */
 const char *
 mfs_notify_path(struct mfs_notify_entry *ent)
@@ -160,6 +690,8 @@ mfs_notify_kqueue_handler(void *arg)
 		n = kevent(nlp->kqueue_fd, NULL, 0, &ev, 1, NULL);
 		if (n <= 0)
 			continue;
+		if (ev.filter == EVFILT_USER)
+			break;
 		struct mfs_notify_entry *ent = ev.udata;
 		assert(ent != NULL);
 
@@ -181,8 +713,213 @@ mfs_notify_kqueue_handler(void *arg)
 		else if (ev.fflags & NOTE_REVOKE)
 			e.ev_type |= EVENT_REVOKE;
 
+		/* kqueue does not say which file in a directory changed. */
 		e.ev_data = ent;
+		e.ev_name = NULL;
+		MFS_NOTIFYLIST_LOCK(nlp);
+		nlp->handler(&e);
+		MFS_NOTIFYLIST_UNLOCK(nlp);
+	}
+	return (NULL);
+}
+#elif defined(__linux__)
+/* Hand one inotify event to the handler. */
+static void
+mfs_notify_inotify_event(struct mfs_notify_list *nlp,
+    const struct inotify_event *ie)
+{
+	struct mfs_notify_entry *ent;
+	struct mfs_notify_event e;
+
+	memset(&e, 0, sizeof(e));
+	MFS_NOTIFYLIST_LOCK(nlp);
+	if (ie->mask & IN_Q_OVERFLOW) {
+		e.ev_type = EVENT_REVOKE;
+		nlp->handler(&e);
+		MFS_NOTIFYLIST_UNLOCK(nlp);
+		return;
+	}
+	ent = mfs_notify_lookup_fd(ie->wd);
+	if (ent == NULL) {
+		MFS_NOTIFYLIST_UNLOCK(nlp);
+		return;
+	}
+	if (ie->mask & IN_IGNORED) {
+		/* The watch went away with its directory. */
+		mfs_notify_free(ent);
+		MFS_NOTIFYLIST_UNLOCK(nlp);
+		return;
+	}
+
+	/* Convert to system independent flags. */
+	if (ie->mask & IN_CREATE)
+		e.ev_type |= EVENT_CREATE;
+	if (ie->mask & IN_MOVED_TO)
+		e.ev_type |= EVENT_CREATE | EVENT_RENAME;
+	if (ie->mask & IN_MOVED_FROM)
+		e.ev_type |= EVENT_DELETE | EVENT_RENAME;
+	if (ie->mask & (IN_DELETE | IN_DELETE_SELF))
+		e.ev_type |= EVENT_DELETE;
+	if (ie->mask & IN_MOVE_SELF)
+		e.ev_type |= EVENT_RENAME;
+	if (ie->mask & IN_MODIFY)
+		e.ev_type |= EVENT_EXTEND;
+	if (ie->mask & IN_CLOSE_WRITE)
+		e.ev_type |= EVENT_WRITE;
+	if (ie->mask & IN_ATTRIB)
+		e.ev_type |= EVENT_ATTRIB;
+	e.ev_data = ent;
+	e.ev_name = (ie->len > 0) ? ie->name : NULL;
+	if (e.ev_type != 0)
 		nlp->handler(&e);
+	MFS_NOTIFYLIST_UNLOCK(nlp);
+}
+
+#if defined(MFS_NOTIFY_FANOTIFY)
+/*
+ * Hand one fanotify event to the handler. The event names the directory
+ * by its file handle, and the file in it by name. The event is given to
+ * the root it is below, with the path of the file relative to the root.
+ */
+static void
+mfs_notify_fanotify_event(struct mfs_notify_list *nlp,
+    const struct fanotify_event_metadata *md)
+{
+	const struct fanotify_event_info_fid *fid;
+	struct file_handle *fh;
+	struct mfs_notify_entry *ent;
+	struct mfs_notify_event e;
+	char link[64], dirpath[MAXPATHLEN], relpath[MAXPATHLEN];
+	const char *name, *rel;
+	ssize_t len;
+	int dfd;
+
+	memset(&e, 0, sizeof(e));
+	MFS_NOTIFYLIST_LOCK(nlp);
+	if (md->mask & FAN_Q_OVERFLOW) {
+		e.ev_type = EVENT_REVOKE;
+		nlp->handler(&e);
+		MFS_NOTIFYLIST_UNLOCK(nlp);
+		return;
+	}
+	fid = (const struct fanotify_event_info_fid *)(md + 1);
+	if (md->event_len < sizeof(*md) + sizeof(*fid) ||
+	    fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+		MFS_NOTIFYLIST_UNLOCK(nlp);
+		return;
+	}
+	fh = (struct file_handle *)fid->handle;
+	name = (const char *)(fh->f_handle + fh->handle_bytes);
+
+	/* Find the directory through any root on its filesystem. */
+	for (ent = nlp->nl_roots; ent != NULL; ent = ent->ne_rootnext) {
+		if (memcmp(&fid->fsid, &ent->ne_fsid,
+		    sizeof(ent->ne_fsid)) == 0)
+			break;
+	}
+	if (ent == NULL ||
+	    (dfd = open_by_handle_at(ent->fd, fh, O_PATH)) < 0) {
+		/* The directory may be gone already. */
+		MFS_NOTIFYLIST_UNLOCK(nlp);
+		return;
+	}
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", dfd);
+	len = readlink(link, dirpath, sizeof(dirpath) - 1);
+	close(dfd);
+	if (len < 0) {
+		MFS_NOTIFYLIST_UNLOCK(nlp);
+		return;
+	}
+	dirpath[len] = '\0';
+
+	/* Drop what happens outside the music paths. */
+	for (ent = nlp->nl_roots; ent != NULL; ent = ent->ne_rootnext) {
+		if (mfs_notify_below(dirpath, ent->path))
+			break;
+	}
+	if (ent == NULL) {
+		MFS_NOTIFYLIST_UNLOCK(nlp);
+		return;
+	}
+	rel = dirpath + strlen(ent->path);
+	if (*rel == '/')
+		rel++;
+	if (strcmp(name, ".") == 0)
+		name = "";
+	len = snprintf(relpath, sizeof(relpath), "%s%s%s", rel,
+	    (*rel != '\0' && *name != '\0') ? "/" : "", name);
+	if (len < 0 || (size_t)len >= sizeof(relpath)) {
+		MFS_NOTIFYLIST_UNLOCK(nlp);
+		return;
+	}
+
+	/* Convert to system independent flags. */
+	if (md->mask & FAN_CREATE)
+		e.ev_type |= EVENT_CREATE;
+	if (md->mask & FAN_MOVED_TO)
+		e.ev_type |= EVENT_CREATE | EVENT_RENAME;
+	if (md->mask & FAN_MOVED_FROM)
+		e.ev_type |= EVENT_DELETE | EVENT_RENAME;
+	if (md->mask & FAN_DELETE)
+		e.ev_type |= EVENT_DELETE;
+	if (md->mask & FAN_MODIFY)
+		e.ev_type |= EVENT_EXTEND;
+	if (md->mask & FAN_CLOSE_WRITE)
+		e.ev_type |= EVENT_WRITE;
+	if (md->mask & FAN_ATTRIB)
+		e.ev_type |= EVENT_ATTRIB;
+	e.ev_data = ent;
+	e.ev_name = (relpath[0] != '\0') ? relpath : NULL;
+	if (e.ev_type != 0)
+		nlp->handler(&e);
+	MFS_NOTIFYLIST_UNLOCK(nlp);
+}
+#endif
+
+static void *
+mfs_notify_epoll_handler(void *arg)
+{
+	struct mfs_notify_list *nlp = (struct mfs_notify_list *)arg;
+	const struct inotify_event *ie;
+	struct epoll_event ev;
+	char buf[16384]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	char *p;
+	int n;
+
+	assert(nlp != NULL);
+
+	for (;;) {
+		n = epoll_wait(nlp->epoll_fd, &ev, 1, -1);
+		if (n <= 0)
+			continue;
+		if (ev.data.fd == nlp->stop_fd)
+			break;
+#if defined(MFS_NOTIFY_FANOTIFY)
+		if (ev.data.fd == nlp->fanotify_fd) {
+			const struct fanotify_event_metadata *md;
+			struct fanotify_event_metadata fbuf[4096 /
+			    sizeof(struct fanotify_event_metadata)];
+
+			while ((len = read(nlp->fanotify_fd, fbuf,
+			    sizeof(fbuf))) > 0) {
+				for (md = fbuf; FAN_EVENT_OK(md, len);
+				    md = FAN_EVENT_NEXT(md, len))
+					mfs_notify_fanotify_event(nlp, md);
+			}
+			continue;
+		}
+#endif
+		/* Drain the queue; one read returns many events. */
+		while ((len = read(nlp->inotify_fd, buf, sizeof(buf))) > 0) {
+			for (p = buf; p < buf + len;
+			    p += sizeof(*ie) + ie->len) {
+				ie = (const struct inotify_event *)p;
+				mfs_notify_inotify_event(nlp, ie);
+			}
+		}
 	}
+	return (NULL);
 }
 #endif
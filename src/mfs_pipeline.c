@@ -0,0 +1,826 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+/*
+ * Pipelined scanner.
+ *
+ * Scanning a music path is split into four stages:
+ *
+ *  discovery	Walks the hierarchy with the parallel scanner. Files that
+ *		have not changed since the last scan go straight to the
+ *		writer.
+ *  I/O		Opens the files and reads their first and last bytes,
+ *		which is where the tags usually are. With io_uring, the
+ *		opens and reads for a batch of files are submitted at
+ *		once, so the device sees more than one request at a time.
+ *  parse	Parses the tags from those buffers, reading more of the file
+ *		only when a tag is bigger, and falls back to taglib.
+ *  writer	A single thread writing the songs to the database in
+ *		batched transactions.
+ *
+ * The stages are connected by bounded queues, so a fast stage waits for a
+ * slow one instead of piling up work, and disk latency in the I/O stage is
+ * overlapped with parsing. Only the writer ever writes to the database.
+ *
+ * Every file reaches the writer, even if it could not be read, so that
+ * the writer knows when all files in a directory are stored and can
+ * record that in the scan journal. A directory that lost a file on the
+ * way is not recorded, and its songs are kept instead.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <debug.h>
+#include <musicfs.h>
+#include <mfs_queue.h>
+#include <mfs_scanner.h>
+#include <mfs_tags.h>
+#include <mfs_uring.h>
+#include <mfs_scanctl.h>
+#include <mfs_qos.h>
+#include <mfs_watch.h>
+#include <mfs_pipeline.h>
+
+#define MFS_PIPELINE_QUEUE	256	/* Files waiting between two stages. */
+#define MFS_PIPELINE_HEAD	65536	/* Bytes read from the start of a file. */
+#define MFS_PIPELINE_TAIL	128	/* Bytes read from the end (ID3v1). */
+#define MFS_PIPELINE_BATCH	32	/* Files per io_uring submission. */
+
+/*
+ * A directory whose files are in the pipeline. It holds a reference for
+ * each of them, and one until all of them have been found.
+ */
+struct mfs_scandir {
+	char *sd_path;
+	int sd_refs;
+	int sd_failed;			/* A file was lost in discovery. */
+	char **sd_seen;			/* Unchanged files, for the writer. */
+	int sd_nseen;
+	int sd_maxseen;
+	struct mfs_scanfile *sd_end;	/* Marks the end, for the writer. */
+};
+
+/*
+ * A file on its way through the pipeline. A file without a path marks
+ * the end of its directory.
+ */
+struct mfs_scanfile {
+	char *sf_path;
+	struct mfs_scandir *sf_dir;
+	struct stat sf_st;
+	int sf_state;			/* From mfs_scan_check(). */
+	char *sf_from;			/* Old path of a moved file. */
+	int sf_failed;			/* Could not be opened. */
+	struct mfs_tagfile sf_tf;
+	unsigned char *sf_buf;		/* Head and tail of the file. */
+	struct mfs_tags sf_tags;
+	int sf_tagged;			/* sf_tags is valid. */
+};
+
+struct mfs_pipeline {
+	struct mfs_queue *pl_ioq;	/* Discovery to I/O. */
+	struct mfs_queue *pl_parseq;	/* I/O to parse. */
+	struct mfs_queue *pl_writeq;	/* Parse to writer. */
+
+	/* Progress, for /.scan_status. */
+	const char *pl_path;
+	struct timespec pl_start;
+	int pl_expected;		/* Files the last scan found. */
+	int pl_walked;			/* Discovery is done. */
+	unsigned long pl_found;
+	unsigned long pl_unchanged;
+	unsigned long pl_done;		/* Files through the writer. */
+};
+
+/*
+ * The running pipeline. Music paths are scanned one at a time. The lock
+ * keeps the pipeline around while its progress is being reported.
+ */
+static struct mfs_pipeline *pipeline;
+static pthread_mutex_t pipeline_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+mfs_scanfile_free(struct mfs_scanfile *sf)
+{
+
+	if (sf->sf_tf.tf_fd >= 0)
+		close(sf->sf_tf.tf_fd);
+	free(sf->sf_buf);
+	if (sf->sf_tagged)
+		mfs_tags_free(&sf->sf_tags);
+	free(sf->sf_from);
+	free(sf->sf_path);
+	free(sf);
+}
+
+/*
+ * Drop a reference to a directory, recording it as done when it was the
+ * last one. Only the writer does this.
+ */
+static void
+mfs_scandir_release(struct mfs_scandir *sd)
+{
+
+	int i;
+
+	if (__atomic_sub_fetch(&sd->sd_refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	if (sd->sd_failed)
+		mfs_scan_keep(sd->sd_path);
+	else
+		mfs_scan_dir_store(sd->sd_path, sd->sd_seen, sd->sd_nseen);
+	for (i = 0; i < sd->sd_nseen; i++)
+		free(sd->sd_seen[i]);
+	free(sd->sd_seen);
+	free(sd->sd_path);
+	free(sd);
+}
+
+/*
+ * Note that an unchanged file is still there, without writing to the
+ * database. Returns -1 if it could not be noted. Only the writer does
+ * this.
+ */
+static int
+mfs_scandir_seen(struct mfs_scandir *sd, struct mfs_scanfile *sf)
+{
+	char **seen;
+	int max;
+
+	if (sd->sd_nseen == sd->sd_maxseen) {
+		max = sd->sd_maxseen > 0 ? sd->sd_maxseen * 2 : 16;
+		seen = realloc(sd->sd_seen, max * sizeof(char *));
+		if (seen == NULL)
+			return (-1);
+		sd->sd_seen = seen;
+		sd->sd_maxseen = max;
+	}
+	/* The directory has the path now. */
+	sd->sd_seen[sd->sd_nseen++] = sf->sf_path;
+	sf->sf_path = NULL;
+	return (0);
+}
+
+/*
+ * Discovery stage: the scanner is about to read a directory. Its files
+ * are skipped if an earlier, interrupted run of this scan did them.
+ */
+static void *
+mfs_pipeline_enter(const char *dirpath)
+{
+	struct mfs_scandir *sd;
+
+	/* Watch it before it is read, so that no change is missed. */
+	mfs_watch_dir(dirpath);
+	if (mfs_scan_dir_check(dirpath)) {
+		DEBUG("%s was done before, skipping its files\n", dirpath);
+		return (NULL);
+	}
+	sd = calloc(1, sizeof(*sd));
+	if (sd == NULL ||
+	    (sd->sd_path = strdup(dirpath)) == NULL ||
+	    (sd->sd_end = calloc(1, sizeof(*sd->sd_end))) == NULL) {
+		if (sd != NULL)
+			free(sd->sd_path);
+		free(sd);
+		/* Its files are skipped, so keep their songs. */
+		mfs_scan_keep(dirpath);
+		return (NULL);
+	}
+	sd->sd_refs = 1;
+	sd->sd_end->sf_dir = sd;
+	sd->sd_end->sf_tf.tf_fd = -1;
+	return (sd);
+}
+
+/*
+ * Discovery stage, called by the scanner for every regular file.
+ */
+static void
+mfs_pipeline_discover(void *cookie, const char *filepath)
+{
+	struct mfs_scandir *sd = cookie;
+	struct mfs_scanfile *sf;
+	struct stat fstat;
+	char *from;
+	int error, state;
+
+	if (stat(filepath, &fstat) < 0) {
+		error = errno;
+		DEBUG("Error getting file info: %s\n", strerror(error));
+		/* It may well be there still. */
+		if (error != ENOENT)
+			sd->sd_failed = 1;
+		return;
+	}
+	state = MFS_SCAN_NEW;
+	from = NULL;
+	if (!mfs_opts.full_rescan)
+		state = mfs_scan_check(filepath, &fstat, &from);
+
+	sf = calloc(1, sizeof(*sf));
+	if (sf == NULL || (sf->sf_path = strdup(filepath)) == NULL) {
+		free(from);
+		free(sf);
+		sd->sd_failed = 1;
+		return;
+	}
+	__atomic_add_fetch(&sd->sd_refs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&pipeline->pl_found, 1, __ATOMIC_RELAXED);
+	if (state == MFS_SCAN_UNCHANGED || state == MFS_SCAN_NOID ||
+	    state == MFS_SCAN_MOVED)
+		__atomic_add_fetch(&pipeline->pl_unchanged, 1,
+		    __ATOMIC_RELAXED);
+	sf->sf_dir = sd;
+	sf->sf_st = fstat;
+	sf->sf_state = state;
+	sf->sf_from = from;
+	sf->sf_tf.tf_fd = -1;
+	sf->sf_tf.tf_size = fstat.st_size;
+	/*
+	 * The writer only has to note that the file is still there, or
+	 * where it went.
+	 */
+	if (state == MFS_SCAN_UNCHANGED || state == MFS_SCAN_NOID ||
+	    state == MFS_SCAN_MOVED)
+		mfs_queue_put(pipeline->pl_writeq, sf);
+	else
+		mfs_queue_put(pipeline->pl_ioq, sf);
+}
+
+/*
+ * Discovery stage: all files in a directory have been found.
+ */
+static void
+mfs_pipeline_leave(void *cookie)
+{
+	struct mfs_scandir *sd = cookie;
+
+	mfs_queue_put(pipeline->pl_writeq, sd->sd_end);
+}
+
+/*
+ * Discovery stage: something could not be read. The songs of a directory
+ * that could not be read at all are kept, and a directory that lost some
+ * of its files is kept when the writer is done with it.
+ */
+static void
+mfs_pipeline_error(void *cookie, const char *path, int error)
+{
+	struct mfs_scandir *sd = cookie;
+
+	DEBUG("lost %s: %s\n", path, strerror(error));
+	if (sd != NULL)
+		sd->sd_failed = 1;
+	else
+		mfs_scan_keep(path);
+}
+
+static const struct mfs_scanops mfs_pipeline_ops = {
+	.so_enter = mfs_pipeline_enter,
+	.so_file = mfs_pipeline_discover,
+	.so_leave = mfs_pipeline_leave,
+	.so_cancelled = mfs_scanctl_cancelled,
+	.so_error = mfs_pipeline_error,
+};
+
+static void
+mfs_pipeline_scan(void *cookie, const char *filepath)
+{
+
+	mfs_scan(filepath);
+}
+
+/* Without a pipeline, songs are written by the threads walking. */
+static const struct mfs_scanops mfs_pipeline_fallback = {
+	.so_file = mfs_pipeline_scan,
+	.so_cancelled = mfs_scanctl_cancelled,
+	.so_error = mfs_pipeline_error,
+};
+
+/* Read len bytes at off, or as many as there are. */
+static ssize_t
+mfs_pipeline_pread(int fd, unsigned char *buf, size_t len, off_t off)
+{
+	ssize_t n;
+	size_t done;
+
+	done = 0;
+	while (done < len) {
+		n = pread(fd, buf + done, len - done, off + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return (-1);
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return (done);
+}
+
+/*
+ * Decide how much to read from the start and the end of a file, and make
+ * room for it. Returns -1 if there is nothing to read.
+ */
+static int
+mfs_pipeline_alloc(struct mfs_scanfile *sf, size_t *headlen, size_t *taillen)
+{
+	off_t size = sf->sf_tf.tf_size;
+
+	*headlen = (size < MFS_PIPELINE_HEAD) ? (size_t)size :
+	    MFS_PIPELINE_HEAD;
+	*taillen = (size_t)size - *headlen;
+	if (*taillen > MFS_PIPELINE_TAIL)
+		*taillen = MFS_PIPELINE_TAIL;
+	if (*headlen + *taillen == 0)
+		return (-1);
+	sf->sf_buf = malloc(*headlen + *taillen);
+	if (sf->sf_buf == NULL)
+		return (-1);
+	return (0);
+}
+
+/* Bytes we will read from a file, for the rate limits. */
+static size_t
+mfs_pipeline_cost(struct mfs_scanfile *sf)
+{
+	off_t size = sf->sf_tf.tf_size;
+
+	if (size > MFS_PIPELINE_HEAD + MFS_PIPELINE_TAIL)
+		return (MFS_PIPELINE_HEAD + MFS_PIPELINE_TAIL);
+	return ((size_t)size);
+}
+
+/*
+ * Open a file and read its head and tail. Returns -1 if the file could not
+ * be opened; read errors are left for the parser to run into.
+ */
+static int
+mfs_pipeline_load(struct mfs_scanfile *sf)
+{
+	struct mfs_tagfile *tf = &sf->sf_tf;
+	size_t headlen, taillen;
+	ssize_t n;
+
+	tf->tf_fd = open(sf->sf_path, O_RDONLY);
+	if (tf->tf_fd < 0) {
+		DEBUG("Unable to open file %s: %s\n", sf->sf_path,
+		    strerror(errno));
+		return (-1);
+	}
+	if (mfs_pipeline_alloc(sf, &headlen, &taillen) != 0)
+		return (0);
+
+	n = mfs_pipeline_pread(tf->tf_fd, sf->sf_buf, headlen, 0);
+	if (n < 0)
+		return (0);
+	tf->tf_head = sf->sf_buf;
+	tf->tf_headlen = n;
+	if (taillen == 0 || (size_t)n < headlen)
+		return (0);
+	n = mfs_pipeline_pread(tf->tf_fd, sf->sf_buf + headlen, taillen,
+	    tf->tf_size - taillen);
+	if (n != (ssize_t)taillen)
+		return (0);
+	tf->tf_tail = sf->sf_buf + headlen;
+	tf->tf_taillen = taillen;
+	return (0);
+}
+
+/*
+ * An io_uring request for a file in a batch.
+ */
+struct mfs_ioreq {
+	struct mfs_scanfile *rq_sf;
+	int rq_res;
+};
+
+static void
+mfs_pipeline_iodone(void *data, int res)
+{
+	struct mfs_ioreq *rq = data;
+
+	rq->rq_res = res;
+}
+
+/*
+ * Load a batch of files with io_uring: open them all, then read all the
+ * heads and tails. Returns -1 if the ring failed, in which case the files
+ * that were not loaded are left in the batch. The ring holds two requests
+ * per file, so it only fills up if requests from before are stuck in it;
+ * a read that does not fit is left to the parser.
+ */
+static int
+mfs_pipeline_uring_batch(struct mfs_uring *ur, struct mfs_scanfile **batch,
+    int n)
+{
+	struct mfs_ioreq opens[MFS_PIPELINE_BATCH];
+	struct mfs_ioreq heads[MFS_PIPELINE_BATCH], tails[MFS_PIPELINE_BATCH];
+	struct mfs_scanfile *sf;
+	struct mfs_tagfile *tf;
+	size_t headlen[MFS_PIPELINE_BATCH], taillen[MFS_PIPELINE_BATCH];
+	int i;
+
+	for (i = 0; i < n; i++) {
+		opens[i].rq_sf = batch[i];
+		opens[i].rq_res = -EIO;
+		if (mfs_uring_openat(ur, batch[i]->sf_path, O_RDONLY,
+		    &opens[i]) != 0)
+			return (-1);
+	}
+	if (mfs_uring_run(ur, mfs_pipeline_iodone) != 0) {
+		/* The files are opened again without the ring. */
+		for (i = 0; i < n; i++)
+			if (opens[i].rq_res >= 0)
+				close(opens[i].rq_res);
+		return (-1);
+	}
+
+	for (i = 0; i < n; i++) {
+		sf = batch[i];
+		tf = &sf->sf_tf;
+		heads[i].rq_sf = tails[i].rq_sf = NULL;
+		if (opens[i].rq_res < 0) {
+			DEBUG("Unable to open file %s: %s\n", sf->sf_path,
+			    strerror(-opens[i].rq_res));
+			sf->sf_failed = 1;
+			continue;
+		}
+		tf->tf_fd = opens[i].rq_res;
+		if (mfs_pipeline_alloc(sf, &headlen[i], &taillen[i]) != 0)
+			continue;
+		heads[i].rq_res = -EIO;
+		if (mfs_uring_read(ur, tf->tf_fd, sf->sf_buf, headlen[i], 0,
+		    &heads[i]) != 0)
+			continue;
+		heads[i].rq_sf = sf;
+		if (taillen[i] == 0)
+			continue;
+		tails[i].rq_res = -EIO;
+		if (mfs_uring_read(ur, tf->tf_fd, sf->sf_buf + headlen[i],
+		    taillen[i], tf->tf_size - taillen[i], &tails[i]) != 0)
+			continue;
+		tails[i].rq_sf = sf;
+	}
+	if (mfs_uring_run(ur, mfs_pipeline_iodone) != 0) {
+		/* The kernel may still write to the buffers; let them be. */
+		for (i = 0; i < n; i++)
+			batch[i]->sf_buf = NULL;
+		return (-1);
+	}
+
+	for (i = 0; i < n; i++) {
+		sf = batch[i];
+		if (sf == NULL)
+			continue;
+		tf = &sf->sf_tf;
+		if (heads[i].rq_sf != NULL && heads[i].rq_res >= 0) {
+			tf->tf_head = sf->sf_buf;
+			tf->tf_headlen = heads[i].rq_res;
+		}
+		if (tails[i].rq_sf != NULL && tf->tf_headlen == headlen[i] &&
+		    tails[i].rq_res == (int)taillen[i]) {
+			tf->tf_tail = sf->sf_buf + headlen[i];
+			tf->tf_taillen = taillen[i];
+		}
+		mfs_queue_put(pipeline->pl_parseq, sf);
+		batch[i] = NULL;
+	}
+	return (0);
+}
+
+/*
+ * I/O stage using io_uring. Returns -1 if the ring broke, after passing
+ * on what it had in hand.
+ */
+static int
+mfs_pipeline_uring(struct mfs_uring *ur)
+{
+	struct mfs_scanfile *batch[MFS_PIPELINE_BATCH];
+	size_t bytes;
+	void *item;
+	int i, n;
+
+	while ((item = mfs_queue_get(pipeline->pl_ioq)) != NULL) {
+		n = 0;
+		batch[n++] = item;
+		while (n < MFS_PIPELINE_BATCH &&
+		    mfs_queue_poll(pipeline->pl_ioq, &item))
+			batch[n++] = item;
+		for (bytes = 0, i = 0; i < n; i++)
+			bytes += mfs_pipeline_cost(batch[i]);
+		mfs_qos_throttle(n, bytes);
+		if (mfs_pipeline_uring_batch(ur, batch, n) == 0)
+			continue;
+
+		/* Let the parser read whatever was not loaded. */
+		for (i = 0; i < n; i++) {
+			if (batch[i] == NULL)
+				continue;
+			if (batch[i]->sf_tf.tf_fd < 0 && !batch[i]->sf_failed &&
+			    mfs_pipeline_load(batch[i]) != 0)
+				batch[i]->sf_failed = 1;
+			mfs_queue_put(pipeline->pl_parseq, batch[i]);
+		}
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * I/O stage.
+ */
+static void *
+mfs_pipeline_io(void *arg)
+{
+	struct mfs_scanfile *sf;
+	struct mfs_uring *ur;
+	int error;
+
+	/* Taglib reads the file by itself. */
+	if (mfs_opts.io_uring && !mfs_opts.taglib_only) {
+		ur = mfs_uring_new(2 * MFS_PIPELINE_BATCH);
+		if (ur != NULL) {
+			error = mfs_pipeline_uring(ur);
+			if (error == 0) {
+				mfs_uring_free(ur);
+				return (NULL);
+			}
+			/* Requests may be in flight, so keep the ring. */
+		}
+		DEBUG("Using synchronous reads for scanning\n");
+	}
+
+	while ((sf = mfs_queue_get(pipeline->pl_ioq)) != NULL) {
+		mfs_qos_throttle(1, mfs_pipeline_cost(sf));
+		if (!mfs_opts.taglib_only && mfs_pipeline_load(sf) != 0)
+			sf->sf_failed = 1;
+		mfs_queue_put(pipeline->pl_parseq, sf);
+	}
+	return (NULL);
+}
+
+/*
+ * Parse stage.
+ */
+static void *
+mfs_pipeline_parse(void *arg)
+{
+	struct mfs_scanfile *sf;
+	int ret;
+
+	while ((sf = mfs_queue_get(pipeline->pl_parseq)) != NULL) {
+		ret = MFS_TAGS_UNSUPPORTED;
+		if (sf->sf_tf.tf_fd >= 0) {
+			ret = mfs_tags_read(&sf->sf_tf, sf->sf_path,
+			    &sf->sf_tags);
+			if (ret != MFS_TAGS_OK)
+				mfs_tags_free(&sf->sf_tags);
+			if (ret == MFS_TAGS_ERROR)
+				DEBUG("Error reading tags from %s, trying "
+				    "taglib\n", sf->sf_path);
+			/* The buffers are not needed anymore. */
+			close(sf->sf_tf.tf_fd);
+			sf->sf_tf.tf_fd = -1;
+			free(sf->sf_buf);
+			sf->sf_buf = NULL;
+		}
+		if (ret != MFS_TAGS_OK && !sf->sf_failed)
+			ret = mfs_tags_taglib(sf->sf_path, &sf->sf_tags);
+		sf->sf_tagged = (ret == MFS_TAGS_OK);
+		mfs_queue_put(pipeline->pl_writeq, sf);
+	}
+	return (NULL);
+}
+
+/*
+ * Writer stage.
+ */
+static void *
+mfs_pipeline_write(void *arg)
+{
+	struct mfs_scanfile *sf;
+
+	while ((sf = mfs_queue_get(pipeline->pl_writeq)) != NULL) {
+		/* A changed file without tags still has a song to remove. */
+		if (sf->sf_path != NULL && sf->sf_state == MFS_SCAN_MOVED) {
+			mfs_scan_move(sf->sf_from, sf->sf_path, &sf->sf_st);
+			__atomic_add_fetch(&pipeline->pl_done, 1,
+			    __ATOMIC_RELAXED);
+		} else if (sf->sf_path != NULL &&
+		    /* Only noted, or touched if that fails. */
+		    sf->sf_state == MFS_SCAN_UNCHANGED &&
+		    mfs_scandir_seen(sf->sf_dir, sf) == 0) {
+			__atomic_add_fetch(&pipeline->pl_done, 1,
+			    __ATOMIC_RELAXED);
+		} else if (sf->sf_path != NULL) {
+			mfs_scan_store(sf->sf_path, &sf->sf_st,
+			    sf->sf_tagged ? &sf->sf_tags : NULL, sf->sf_state);
+			__atomic_add_fetch(&pipeline->pl_done, 1,
+			    __ATOMIC_RELAXED);
+		}
+		if (sf->sf_dir != NULL)
+			mfs_scandir_release(sf->sf_dir);
+		mfs_scanfile_free(sf);
+	}
+	/* The transaction is on our connection, which goes with us. */
+	mfs_scan_flush();
+	return (NULL);
+}
+
+/* Start up to n threads, returning how many we got. */
+static int
+mfs_pipeline_start(pthread_t *thr, int n, void *(*fn)(void *))
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&thr[i], NULL, fn, NULL) != 0) {
+			DEBUG("Unable to start scanner thread\n");
+			break;
+		}
+	}
+	return (i);
+}
+
+static void
+mfs_pipeline_join(pthread_t *thr, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		pthread_join(thr[i], NULL);
+}
+
+/*
+ * Scan a music path. expected is roughly how many files there are, for
+ * estimating how long it takes. Returns 1 if the scan was cancelled.
+ */
+int
+mfs_pipeline_run(const char *dirpath, int expected)
+{
+	struct mfs_pipeline pl;
+	pthread_t writer, *io, *parse;
+	int nio, nparse, niostarted, nparsestarted, nwriter, error;
+
+	nio = mfs_opts.scan_io_threads;
+	if (nio <= 0)
+		nio = 1;
+	nparse = mfs_opts.scan_parse_threads;
+	if (nparse <= 0) {
+		nparse = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if (nparse <= 0)
+			nparse = 1;
+	}
+	DEBUG("scanning %s with %d I/O and %d parser threads\n", dirpath,
+	    nio, nparse);
+
+	memset(&pl, 0, sizeof(pl));
+	io = calloc(nio, sizeof(pthread_t));
+	parse = calloc(nparse, sizeof(pthread_t));
+	pl.pl_ioq = mfs_queue_new(MFS_PIPELINE_QUEUE);
+	pl.pl_parseq = mfs_queue_new(MFS_PIPELINE_QUEUE);
+	pl.pl_writeq = mfs_queue_new(MFS_PIPELINE_QUEUE);
+	if (io == NULL || parse == NULL || pl.pl_ioq == NULL ||
+	    pl.pl_parseq == NULL || pl.pl_writeq == NULL) {
+		/* Songs are written by the thread walking, which is us. */
+		error = mfs_scanner_walk(dirpath, &mfs_pipeline_fallback, 1);
+		goto out;
+	}
+	pl.pl_path = dirpath;
+	pl.pl_expected = expected;
+	clock_gettime(CLOCK_MONOTONIC, &pl.pl_start);
+	pthread_mutex_lock(&pipeline_lock);
+	pipeline = &pl;
+	pthread_mutex_unlock(&pipeline_lock);
+
+	/* Start from the end, so that every stage has someone to feed. */
+	nwriter = mfs_pipeline_start(&writer, 1, mfs_pipeline_write);
+	nparsestarted = nwriter ?
+	    mfs_pipeline_start(parse, nparse, mfs_pipeline_parse) : 0;
+	niostarted = nparsestarted ?
+	    mfs_pipeline_start(io, nio, mfs_pipeline_io) : 0;
+
+	error = 0;
+	if (niostarted > 0)
+		error = mfs_scanner_walk(dirpath, &mfs_pipeline_ops,
+		    mfs_opts.scan_threads);
+	__atomic_store_n(&pl.pl_walked, 1, __ATOMIC_RELAXED);
+
+	/* Drain the stages in order. */
+	mfs_queue_close(pl.pl_ioq);
+	mfs_pipeline_join(io, niostarted);
+	mfs_queue_close(pl.pl_parseq);
+	mfs_pipeline_join(parse, nparsestarted);
+	mfs_queue_close(pl.pl_writeq);
+	mfs_pipeline_join(&writer, nwriter);
+	pthread_mutex_lock(&pipeline_lock);
+	pipeline = NULL;
+	pthread_mutex_unlock(&pipeline_lock);
+
+	/* Without threads, scan the old way, in this thread. */
+	if (niostarted == 0)
+		error = mfs_scanner_walk(dirpath, &mfs_pipeline_fallback, 1);
+	if (error == 0 && mfs_scanctl_cancelled())
+		error = 1;
+out:
+	if (pl.pl_writeq != NULL)
+		mfs_queue_free(pl.pl_writeq);
+	if (pl.pl_parseq != NULL)
+		mfs_queue_free(pl.pl_parseq);
+	if (pl.pl_ioq != NULL)
+		mfs_queue_free(pl.pl_ioq);
+	free(parse);
+	free(io);
+	return (error);
+}
+
+/*
+ * Describe the progress of the running scan. Returns the length, which is
+ * 0 when nothing is being scanned.
+ */
+int
+mfs_pipeline_status(char *buf, size_t size)
+{
+	struct mfs_pipeline *pl;
+	struct timespec now;
+	unsigned long found, done, total;
+	double elapsed, rate;
+	char eta[32];
+	int len;
+
+	pthread_mutex_lock(&pipeline_lock);
+	pl = pipeline;
+	if (pl == NULL) {
+		pthread_mutex_unlock(&pipeline_lock);
+		return (0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - pl->pl_start.tv_sec) +
+	    (now.tv_nsec - pl->pl_start.tv_nsec) / 1e9;
+	found = __atomic_load_n(&pl->pl_found, __ATOMIC_RELAXED);
+	done = __atomic_load_n(&pl->pl_done, __ATOMIC_RELAXED);
+	rate = (elapsed > 0) ? done / elapsed : 0;
+
+	/* Until discovery is done, guess that the collection is as big. */
+	total = found;
+	if (!__atomic_load_n(&pl->pl_walked, __ATOMIC_RELAXED) &&
+	    (unsigned long)pl->pl_expected > total)
+		total = pl->pl_expected;
+	if (rate > 0)
+		snprintf(eta, sizeof(eta), "%.0f",
+		    total > done ? (total - done) / rate : 0);
+	else
+		strcpy(eta, "unknown");
+
+	len = snprintf(buf, size,
+	    "path: %s\n"
+	    "elapsed_seconds: %.1f\n"
+	    "files_found: %lu\n"
+	    "files_unchanged: %lu\n"
+	    "files_done: %lu\n"
+	    "files_per_second: %.1f\n"
+	    "queue_io: %lu\n"
+	    "queue_parse: %lu\n"
+	    "queue_write: %lu\n"
+	    "eta_seconds: %s\n",
+	    pl->pl_path, elapsed, found,
+	    __atomic_load_n(&pl->pl_unchanged, __ATOMIC_RELAXED), done, rate,
+	    (unsigned long)mfs_queue_depth(pl->pl_ioq),
+	    (unsigned long)mfs_queue_depth(pl->pl_parseq),
+	    (unsigned long)mfs_queue_depth(pl->pl_writeq), eta);
+	pthread_mutex_unlock(&pipeline_lock);
+	if (len < 0)
+		return (0);
+	return ((size_t)len >= size ? (int)size - 1 : len);
+}
@@ -0,0 +1,244 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+/*
+ * Scanner quality of service.
+ *
+ * The files and bytes the scanner reads are limited by two token buckets,
+ * each holding at most a second's worth of tokens. A bucket may go into
+ * debt for a big request, and the scanner then sleeps until it is paid
+ * back.
+ *
+ * Reads through the filesystem are timed, and while a moving average of
+ * their latency is above scan_read_latency, the scanner sleeps for longer
+ * and longer periods. Once nothing has been read for a while, the player
+ * is assumed to be idle (or buffering well) and the scanner goes on.
+ */
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <debug.h>
+#include <musicfs.h>
+#include <mfs_scanctl.h>
+#include <mfs_qos.h>
+
+#define MFS_QOS_ALPHA		0.2	/* Weight of a new latency sample. */
+#define MFS_QOS_IDLE		2.0	/* Seconds without reads to go on. */
+#define MFS_QOS_MINBACKOFF	0.01
+#define MFS_QOS_MAXBACKOFF	1.0
+
+/* Linux I/O priorities, from linux/ioprio.h. */
+#define MFS_IOPRIO_CLASS_SHIFT	13
+#define MFS_IOPRIO_CLASS_BE	2
+#define MFS_IOPRIO_CLASS_IDLE	3
+#define MFS_IOPRIO_WHO_PROCESS	1
+
+struct mfs_bucket {
+	double tb_rate;			/* Tokens per second, 0 is no limit. */
+	double tb_tokens;
+	double tb_last;			/* When it was last filled. */
+};
+
+static pthread_mutex_t qos_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mfs_bucket qos_files;
+static struct mfs_bucket qos_bytes;
+static double qos_latency;		/* Average read latency, seconds. */
+static double qos_lastread;		/* When we last saw a read. */
+static int qos_backingoff;
+static double qos_throttled;		/* Seconds spent waiting. */
+static const char *qos_ioprio = "none";
+
+static double
+mfs_qos_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void
+mfs_qos_sleep(double secs)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)secs;
+	ts.tv_nsec = (long)((secs - ts.tv_sec) * 1e9);
+	nanosleep(&ts, NULL);
+}
+
+/*
+ * Take n tokens from a bucket, returning how long to wait for them.
+ */
+static double
+mfs_bucket_take(struct mfs_bucket *tb, double n, double now)
+{
+
+	if (tb->tb_rate <= 0)
+		return (0);
+	if (tb->tb_last == 0)
+		tb->tb_tokens = tb->tb_rate;
+	else
+		tb->tb_tokens += (now - tb->tb_last) * tb->tb_rate;
+	if (tb->tb_tokens > tb->tb_rate)
+		tb->tb_tokens = tb->tb_rate;
+	tb->tb_last = now;
+	tb->tb_tokens -= n;
+	if (tb->tb_tokens >= 0)
+		return (0);
+	return (-tb->tb_tokens / tb->tb_rate);
+}
+
+/*
+ * Set the I/O priority of the calling thread as asked for with
+ * scan_ioprio. Threads it creates inherit it.
+ */
+void
+mfs_qos_thread()
+{
+#ifdef __linux__
+	int ioclass, level;
+
+	if (mfs_opts.scan_ioprio == NULL)
+		return;
+	if (strcmp(mfs_opts.scan_ioprio, "idle") == 0) {
+		ioclass = MFS_IOPRIO_CLASS_IDLE;
+		level = 0;
+	} else if (strcmp(mfs_opts.scan_ioprio, "be") == 0) {
+		/* The lowest best-effort level. */
+		ioclass = MFS_IOPRIO_CLASS_BE;
+		level = 7;
+	} else {
+		DEBUG("Unknown I/O priority %s\n", mfs_opts.scan_ioprio);
+		return;
+	}
+	/* With who 0, only the calling thread is changed. */
+	if (syscall(SYS_ioprio_set, MFS_IOPRIO_WHO_PROCESS, 0,
+	    (ioclass << MFS_IOPRIO_CLASS_SHIFT) | level) != 0) {
+		DEBUG("Unable to set I/O priority: %s\n", strerror(errno));
+		return;
+	}
+	pthread_mutex_lock(&qos_lock);
+	qos_ioprio = (ioclass == MFS_IOPRIO_CLASS_IDLE) ? "idle" :
+	    "best-effort";
+	pthread_mutex_unlock(&qos_lock);
+#endif
+}
+
+/* Check if reads through the filesystem are suffering. */
+static int
+mfs_qos_congested(double now)
+{
+
+	return (mfs_opts.scan_read_latency > 0 &&
+	    now - qos_lastread < MFS_QOS_IDLE &&
+	    qos_latency * 1000 > mfs_opts.scan_read_latency);
+}
+
+/*
+ * Called by the scanner before it reads files files of bytes bytes in
+ * total. Sleeps as long as the limits say.
+ */
+void
+mfs_qos_throttle(unsigned int files, size_t bytes)
+{
+	double now, wait, w, backoff;
+
+	pthread_mutex_lock(&qos_lock);
+	now = mfs_qos_now();
+	qos_files.tb_rate = mfs_opts.scan_files_per_sec;
+	qos_bytes.tb_rate = mfs_opts.scan_mb_per_sec * 1048576.0;
+	wait = mfs_bucket_take(&qos_files, files, now);
+	w = mfs_bucket_take(&qos_bytes, bytes, now);
+	if (w > wait)
+		wait = w;
+	qos_throttled += wait;
+	pthread_mutex_unlock(&qos_lock);
+	if (wait > 0)
+		mfs_qos_sleep(wait);
+
+	backoff = MFS_QOS_MINBACKOFF;
+	for (;;) {
+		pthread_mutex_lock(&qos_lock);
+		qos_backingoff = mfs_qos_congested(mfs_qos_now());
+		if (!qos_backingoff || mfs_scanctl_cancelled()) {
+			pthread_mutex_unlock(&qos_lock);
+			break;
+		}
+		qos_throttled += backoff;
+		pthread_mutex_unlock(&qos_lock);
+		mfs_qos_sleep(backoff);
+		backoff *= 2;
+		if (backoff > MFS_QOS_MAXBACKOFF)
+			backoff = MFS_QOS_MAXBACKOFF;
+	}
+}
+
+/*
+ * Record how long a read through the filesystem took.
+ */
+void
+mfs_qos_fgread(double secs)
+{
+
+	pthread_mutex_lock(&qos_lock);
+	qos_latency += MFS_QOS_ALPHA * (secs - qos_latency);
+	qos_lastread = mfs_qos_now();
+	pthread_mutex_unlock(&qos_lock);
+}
+
+/*
+ * Describe the scheduler state for /.stats. Returns the length.
+ */
+int
+mfs_qos_stats(char *buf, size_t size)
+{
+	int len;
+
+	pthread_mutex_lock(&qos_lock);
+	len = snprintf(buf, size,
+	    "scan_ioprio: %s\n"
+	    "scan_files_per_sec_limit: %d\n"
+	    "scan_mb_per_sec_limit: %d\n"
+	    "scan_read_latency_limit_ms: %d\n"
+	    "read_latency_ms: %.2f\n"
+	    "scan_backing_off: %d\n"
+	    "scan_throttled_seconds: %.1f\n",
+	    qos_ioprio, mfs_opts.scan_files_per_sec, mfs_opts.scan_mb_per_sec,
+	    mfs_opts.scan_read_latency, qos_latency * 1000,
+	    qos_backingoff && mfs_qos_congested(mfs_qos_now()),
+	    qos_throttled);
+	pthread_mutex_unlock(&qos_lock);
+	if (len < 0)
+		return (0);
+	return ((size_t)len >= size ? (int)size - 1 : len);
+}
@@ -0,0 +1,238 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+/*
+ * Bounded lock-free queue.
+ *
+ * This is Dmitry Vyukov's bounded MPMC queue: every cell carries a sequence
+ * number telling whether it is ready to be written or read for a given lap
+ * around the ring, and producers and consumers claim positions with a
+ * compare-and-swap. Nobody ever holds a lock, so a slow thread in one stage
+ * never blocks the others. Waiting for room or for items is done by
+ * spinning and then sleeping a little longer each time.
+ */
+
+#include <sys/types.h>
+#include <sched.h>
+#include <time.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <mfs_queue.h>
+
+#define MFS_QUEUE_SPINS		64
+#define MFS_QUEUE_MAXSLEEP	1000000	/* Nanoseconds. */
+
+struct mfs_queue_cell {
+	size_t qc_seq;
+	void *qc_data;
+};
+
+struct mfs_queue {
+	struct mfs_queue_cell *q_cells;
+	size_t q_mask;
+	int q_closed;
+	/* Keep the producer and consumer positions on separate lines. */
+	char q_pad0[64];
+	size_t q_enqueue;
+	char q_pad1[64];
+	size_t q_dequeue;
+	char q_pad2[64];
+};
+
+/*
+ * Create a queue with room for at least size items.
+ */
+struct mfs_queue *
+mfs_queue_new(size_t size)
+{
+	struct mfs_queue *q;
+	size_t i, n;
+
+	/* The size must be a power of two. */
+	for (n = 2; n < size; n <<= 1)
+		;
+	q = calloc(1, sizeof(*q));
+	if (q == NULL)
+		return (NULL);
+	q->q_cells = malloc(sizeof(struct mfs_queue_cell) * n);
+	if (q->q_cells == NULL) {
+		free(q);
+		return (NULL);
+	}
+	for (i = 0; i < n; i++)
+		q->q_cells[i].qc_seq = i;
+	q->q_mask = n - 1;
+	return (q);
+}
+
+void
+mfs_queue_free(struct mfs_queue *q)
+{
+	free(q->q_cells);
+	free(q);
+}
+
+static int
+mfs_queue_tryput(struct mfs_queue *q, void *data)
+{
+	struct mfs_queue_cell *cell;
+	size_t pos, seq;
+	long diff;
+
+	pos = __atomic_load_n(&q->q_enqueue, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &q->q_cells[pos & q->q_mask];
+		seq = __atomic_load_n(&cell->qc_seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->q_enqueue, &pos,
+			    pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* Full. */
+			return (0);
+		} else {
+			pos = __atomic_load_n(&q->q_enqueue, __ATOMIC_RELAXED);
+		}
+	}
+	cell->qc_data = data;
+	__atomic_store_n(&cell->qc_seq, pos + 1, __ATOMIC_RELEASE);
+	return (1);
+}
+
+static int
+mfs_queue_tryget(struct mfs_queue *q, void **data)
+{
+	struct mfs_queue_cell *cell;
+	size_t pos, seq;
+	long diff;
+
+	pos = __atomic_load_n(&q->q_dequeue, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &q->q_cells[pos & q->q_mask];
+		seq = __atomic_load_n(&cell->qc_seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)(pos + 1);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->q_dequeue, &pos,
+			    pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* Empty. */
+			return (0);
+		} else {
+			pos = __atomic_load_n(&q->q_dequeue, __ATOMIC_RELAXED);
+		}
+	}
+	*data = cell->qc_data;
+	__atomic_store_n(&cell->qc_seq, pos + q->q_mask + 1, __ATOMIC_RELEASE);
+	return (1);
+}
+
+/* Back off a little more for every failed attempt. */
+static void
+mfs_queue_wait(int *attempt)
+{
+	struct timespec ts;
+	long ns;
+
+	if (++*attempt < MFS_QUEUE_SPINS) {
+		sched_yield();
+		return;
+	}
+	ns = 1000L << ((*attempt - MFS_QUEUE_SPINS) < 10 ?
+	    (*attempt - MFS_QUEUE_SPINS) : 10);
+	if (ns > MFS_QUEUE_MAXSLEEP)
+		ns = MFS_QUEUE_MAXSLEEP;
+	ts.tv_sec = 0;
+	ts.tv_nsec = ns;
+	nanosleep(&ts, NULL);
+}
+
+/*
+ * Put an item on the queue, waiting for room if it is full.
+ */
+void
+mfs_queue_put(struct mfs_queue *q, void *data)
+{
+	int attempt;
+
+	attempt = 0;
+	while (!mfs_queue_tryput(q, data))
+		mfs_queue_wait(&attempt);
+}
+
+/*
+ * Get an item from the queue, waiting for one if it is empty. Returns NULL
+ * when the queue is closed and everything has been taken.
+ */
+void *
+mfs_queue_get(struct mfs_queue *q)
+{
+	void *data;
+	int attempt;
+
+	attempt = 0;
+	while (!mfs_queue_tryget(q, &data)) {
+		if (__atomic_load_n(&q->q_closed, __ATOMIC_ACQUIRE)) {
+			/* Items put before the close are visible now. */
+			if (mfs_queue_tryget(q, &data))
+				return (data);
+			return (NULL);
+		}
+		mfs_queue_wait(&attempt);
+	}
+	return (data);
+}
+
+/*
+ * Get an item from the queue if there is one. Returns 0 if it is empty.
+ */
+int
+mfs_queue_poll(struct mfs_queue *q, void **data)
+{
+
+	return (mfs_queue_tryget(q, data));
+}
+
+/*
+ * Tell consumers that nothing more will be put on the queue.
+ */
+void
+mfs_queue_close(struct mfs_queue *q)
+{
+	__atomic_store_n(&q->q_closed, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Number of items waiting in the queue.
+ */
+size_t
+mfs_queue_depth(struct mfs_queue *q)
+{
+	size_t enq, deq;
+
+	deq = __atomic_load_n(&q->q_dequeue, __ATOMIC_RELAXED);
+	enq = __atomic_load_n(&q->q_enqueue, __ATOMIC_RELAXED);
+	return (enq > deq ? enq - deq : 0);
+}
@@ -0,0 +1,390 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+/*
+ * Background scanner thread.
+ *
+ * The thread is started from the FUSE init callback rather than before
+ * fuse_main(), since threads do not survive FUSE daemonizing. It sleeps
+ * until a scan is requested, reloads the configuration and scans the
+ * music paths, and reports its progress in /.scan_status. Stopping it
+ * cancels a running scan, which the scan journal lets us resume later.
+ *
+ * Between scans, the thread applies the changes that mfs_watch sees.
+ * Copying an album or retagging it gives a burst of events, many of them
+ * for the same files, so the changed paths are collected once each, and
+ * only applied when no event has come for mfs_opts.watch_delay
+ * milliseconds. A whole burst is then written in one transaction. Events
+ * that never stop coming hold the changes back for at most
+ * MFS_SCANCTL_MAXDELAY times the delay.
+ */
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <debug.h>
+#include <musicfs.h>
+#include <mfs_pipeline.h>
+#include <mfs_qos.h>
+#include <mfs_scanctl.h>
+
+#define MFS_SCANCTL_BUCKETS	4096
+#define MFS_SCANCTL_MAXDELAY	10
+
+/* A path that changed, hashed so that it is only collected once. */
+struct mfs_scanupdate {
+	const char *su_path;
+	struct mfs_scanupdate *su_next;
+};
+
+static pthread_mutex_t scanctl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scanctl_cv = PTHREAD_COND_INITIALIZER;
+static pthread_t scanctl_thr;
+static int scanctl_running;	/* The thread has been started. */
+static int scanctl_requested;	/* A scan should be started. */
+static int scanctl_busy;	/* A scan is running. */
+static int scanctl_stop;	/* Cancel the scan and exit. */
+static unsigned long scanctl_scans;	/* Scans completed. */
+static time_t scanctl_last;	/* When the last scan finished. */
+static double scanctl_lastsecs;	/* How long it took. */
+static char **scanctl_updates;	/* Paths that changed since last time. */
+static int scanctl_nupdates;
+static int scanctl_maxupdates;
+static struct mfs_scanupdate *scanctl_pending[MFS_SCANCTL_BUCKETS];
+static double scanctl_first;	/* When the first change came. */
+static double scanctl_latest;	/* When the latest one came. */
+static int scanctl_updating;	/* Changes are being applied. */
+static unsigned long scanctl_applied;	/* Changed paths applied. */
+static unsigned long scanctl_coalesced;	/* Events for pending paths. */
+
+static double
+mfs_scanctl_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static unsigned int
+mfs_scanctl_hash(const char *path)
+{
+	unsigned int h;
+
+	/* FNV-1a */
+	h = 2166136261u;
+	while (*path != '\0') {
+		h ^= (unsigned char)*path++;
+		h *= 16777619u;
+	}
+	return (h % MFS_SCANCTL_BUCKETS);
+}
+
+/*
+ * Hand the changed paths over to the caller, who frees them. Called with
+ * scanctl_lock held.
+ */
+static char **
+mfs_scanctl_take_updates(int *n)
+{
+	struct mfs_scanupdate *su, *next;
+	char **updates;
+	int i;
+
+	for (i = 0; i < MFS_SCANCTL_BUCKETS; i++) {
+		for (su = scanctl_pending[i]; su != NULL; su = next) {
+			next = su->su_next;
+			free(su);
+		}
+		scanctl_pending[i] = NULL;
+	}
+	updates = scanctl_updates;
+	*n = scanctl_nupdates;
+	scanctl_updates = NULL;
+	scanctl_nupdates = 0;
+	scanctl_maxupdates = 0;
+	return (updates);
+}
+
+/* Forget the changed paths. Called with scanctl_lock held. */
+static void
+mfs_scanctl_clear_updates()
+{
+	char **updates;
+	int i, n;
+
+	updates = mfs_scanctl_take_updates(&n);
+	for (i = 0; i < n; i++)
+		free(updates[i]);
+	free(updates);
+}
+
+/*
+ * How many seconds to wait before the changes are applied. Called with
+ * scanctl_lock held.
+ */
+static double
+mfs_scanctl_settle()
+{
+	double delay, left, maxleft, now;
+
+	delay = mfs_opts.watch_delay / 1000.0;
+	now = mfs_scanctl_now();
+	left = scanctl_latest + delay - now;
+	maxleft = scanctl_first + delay * MFS_SCANCTL_MAXDELAY - now;
+	return (left < maxleft ? left : maxleft);
+}
+
+static void *
+mfs_scanctl_thread(void *arg)
+{
+	struct timespec ts;
+	char **updates;
+	double start, wait;
+	int i, n;
+
+	/* The scanner threads are started from here, and inherit this. */
+	mfs_qos_thread();
+
+	pthread_mutex_lock(&scanctl_lock);
+	for (;;) {
+		while (!scanctl_requested && scanctl_nupdates == 0 &&
+		    !scanctl_stop)
+			pthread_cond_wait(&scanctl_cv, &scanctl_lock);
+		if (scanctl_stop)
+			break;
+		if (!scanctl_requested) {
+			/* Let the burst settle first. */
+			if ((wait = mfs_scanctl_settle()) > 0) {
+				clock_gettime(CLOCK_REALTIME, &ts);
+				wait += ts.tv_nsec / 1e9;
+				ts.tv_sec += (time_t)wait;
+				ts.tv_nsec = (long)((wait - (time_t)wait) * 1e9);
+				pthread_cond_timedwait(&scanctl_cv, &scanctl_lock,
+				    &ts);
+				continue;
+			}
+			updates = mfs_scanctl_take_updates(&n);
+			scanctl_updating = 1;
+			pthread_mutex_unlock(&scanctl_lock);
+
+			DEBUG("applying %d changed paths\n", n);
+			mfs_update_paths(updates, n);
+			for (i = 0; i < n; i++)
+				free(updates[i]);
+			free(updates);
+
+			pthread_mutex_lock(&scanctl_lock);
+			scanctl_updating = 0;
+			scanctl_applied += n;
+			continue;
+		}
+		/* The scan will see whatever has changed so far. */
+		mfs_scanctl_clear_updates();
+		scanctl_requested = 0;
+		scanctl_busy = 1;
+		pthread_mutex_unlock(&scanctl_lock);
+
+		start = mfs_scanctl_now();
+		DEBUG("background scan starting\n");
+		mfs_reload_config();
+
+		pthread_mutex_lock(&scanctl_lock);
+		scanctl_busy = 0;
+		if (!scanctl_stop) {
+			scanctl_scans++;
+			scanctl_last = time(NULL);
+			scanctl_lastsecs = mfs_scanctl_now() - start;
+			DEBUG("background scan done in %.1f s\n",
+			    scanctl_lastsecs);
+		}
+	}
+	mfs_scanctl_clear_updates();
+	pthread_mutex_unlock(&scanctl_lock);
+	return (NULL);
+}
+
+/*
+ * Start the scanner thread.
+ */
+void
+mfs_scanctl_start()
+{
+
+	pthread_mutex_lock(&scanctl_lock);
+	if (!scanctl_running) {
+		__atomic_store_n(&scanctl_stop, 0, __ATOMIC_RELAXED);
+		if (pthread_create(&scanctl_thr, NULL, mfs_scanctl_thread,
+		    NULL) == 0)
+			scanctl_running = 1;
+		else
+			DEBUG("Unable to start the background scanner\n");
+	}
+	pthread_mutex_unlock(&scanctl_lock);
+}
+
+/*
+ * Cancel any running scan and stop the scanner thread.
+ */
+void
+mfs_scanctl_stop()
+{
+	int running;
+
+	pthread_mutex_lock(&scanctl_lock);
+	running = scanctl_running;
+	/* Scanner threads poll this without the lock. */
+	__atomic_store_n(&scanctl_stop, 1, __ATOMIC_RELAXED);
+	scanctl_running = 0;
+	pthread_cond_broadcast(&scanctl_cv);
+	pthread_mutex_unlock(&scanctl_lock);
+	if (running)
+		pthread_join(scanctl_thr, NULL);
+}
+
+/*
+ * Ask for the music paths to be scanned. Without the thread, for instance
+ * when FUSE never called init, the scan runs right away.
+ */
+void
+mfs_scanctl_request()
+{
+	int running;
+
+	pthread_mutex_lock(&scanctl_lock);
+	running = scanctl_running;
+	if (running) {
+		scanctl_requested = 1;
+		pthread_cond_signal(&scanctl_cv);
+	}
+	pthread_mutex_unlock(&scanctl_lock);
+	if (!running)
+		mfs_reload_config();
+}
+
+/*
+ * Ask for a path that changed on disk to be brought up to date. A NULL
+ * path asks for a scan of everything. Unlike mfs_scanctl_request(), this
+ * does nothing without the thread.
+ */
+void
+mfs_scanctl_update(const char *path)
+{
+	struct mfs_scanupdate *su;
+	char **updates;
+	unsigned int h;
+	int max;
+
+	pthread_mutex_lock(&scanctl_lock);
+	if (!scanctl_running) {
+		pthread_mutex_unlock(&scanctl_lock);
+		return;
+	}
+	if (path == NULL) {
+		scanctl_requested = 1;
+		pthread_cond_signal(&scanctl_cv);
+		pthread_mutex_unlock(&scanctl_lock);
+		return;
+	}
+	scanctl_latest = mfs_scanctl_now();
+	if (scanctl_nupdates == 0)
+		scanctl_first = scanctl_latest;
+	h = mfs_scanctl_hash(path);
+	for (su = scanctl_pending[h]; su != NULL; su = su->su_next) {
+		if (strcmp(su->su_path, path) == 0) {
+			scanctl_coalesced++;
+			pthread_mutex_unlock(&scanctl_lock);
+			return;
+		}
+	}
+	if (scanctl_nupdates == scanctl_maxupdates) {
+		max = scanctl_maxupdates > 0 ? scanctl_maxupdates * 2 : 64;
+		updates = realloc(scanctl_updates, max * sizeof(char *));
+		if (updates == NULL) {
+			pthread_mutex_unlock(&scanctl_lock);
+			return;
+		}
+		scanctl_updates = updates;
+		scanctl_maxupdates = max;
+	}
+	su = malloc(sizeof(*su));
+	if (su == NULL) {
+		pthread_mutex_unlock(&scanctl_lock);
+		return;
+	}
+	if ((su->su_path = strdup(path)) == NULL) {
+		free(su);
+		pthread_mutex_unlock(&scanctl_lock);
+		return;
+	}
+	scanctl_updates[scanctl_nupdates++] = (char *)su->su_path;
+	su->su_next = scanctl_pending[h];
+	scanctl_pending[h] = su;
+	pthread_cond_signal(&scanctl_cv);
+	pthread_mutex_unlock(&scanctl_lock);
+}
+
+/*
+ * Check if the running scan should give up.
+ */
+int
+mfs_scanctl_cancelled()
+{
+
+	return (__atomic_load_n(&scanctl_stop, __ATOMIC_RELAXED));
+}
+
+/*
+ * Produce the contents of the /.scan_status file. Returns its length.
+ */
+int
+mfs_scanctl_status(char *buf, size_t size)
+{
+	int len, n;
+
+	pthread_mutex_lock(&scanctl_lock);
+	len = snprintf(buf, size,
+	    "state: %s\n"
+	    "scans_completed: %lu\n"
+	    "last_scan_finished: %ld\n"
+	    "last_scan_seconds: %.1f\n"
+	    "pending_updates: %d\n"
+	    "updates_applied: %lu\n"
+	    "events_coalesced: %lu\n",
+	    scanctl_busy ? "scanning" : (scanctl_requested ? "queued" :
+	    (scanctl_updating ? "updating" : "idle")),
+	    scanctl_scans, (long)scanctl_last, scanctl_lastsecs,
+	    scanctl_nupdates, scanctl_applied, scanctl_coalesced);
+	pthread_mutex_unlock(&scanctl_lock);
+	if (len < 0)
+		return (0);
+	if ((size_t)len >= size)
+		return ((int)size - 1);
+	n = mfs_pipeline_status(buf + len, size - len);
+	len += n;
+	return (len);
+}
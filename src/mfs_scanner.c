@@ -0,0 +1,693 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+/*
+ * Parallel scanner.
+ *
+ * Every worker thread owns a deque of directories. A worker pushes the
+ * sub-directories it finds to the tail of its own deque and pops from the
+ * tail as well, so it mostly works depth-first on a hierarchy it has warm in
+ * the cache. When its deque runs empty, it steals from the head of another
+ * worker's deque, which is where the biggest (least explored) parts of the
+ * tree are. The scan is finished when no directories are queued or being
+ * read.
+ *
+ * With a single worker, the scan runs in the calling thread and the deque
+ * is simply the stack of an iterative depth-first traversal.
+ *
+ * Directories are read relative to their descriptor, and opened relative
+ * to the descriptor of their parent, so the kernel does not look up the
+ * whole path again for each of them. The type in the directory entry is
+ * trusted when the filesystem provides it, so most entries cost no stat
+ * at all. Every directory is identified by its device
+ * and inode number, and one that has been seen before (through a symlink
+ * loop or a bind mount) is skipped.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <debug.h>
+#include <musicfs.h>
+#include <mfs_scanner.h>
+
+#define MFS_DEQUE_INITSIZE 64
+#define MFS_VISITED_BUCKETS 4096
+
+/*
+ * An open directory that queued directories are opened relative to. It is
+ * closed when the last of them has been opened.
+ */
+struct mfs_dirfd {
+	int df_fd;
+	int df_refs;
+};
+
+/*
+ * A directory to read. The full path is kept for the hooks and for
+ * messages.
+ */
+struct mfs_scanitem {
+	struct mfs_dirfd *si_parent;	/* NULL to open it by its path. */
+	const char *si_name;		/* Name in the parent. */
+	int si_nofollow;		/* Was no symlink when it was found. */
+	char si_path[];
+};
+
+/*
+ * A double ended queue of directories.
+ */
+struct mfs_deque {
+	struct mfs_scanitem **dq_items;
+	int dq_head;		/* Index of the first item. */
+	int dq_count;		/* Number of items. */
+	int dq_size;		/* Allocated slots. */
+	pthread_mutex_t dq_lock;
+};
+
+struct mfs_scanner;
+
+struct mfs_scanworker {
+	pthread_t sw_thr;
+	int sw_id;
+	unsigned int sw_seed;		/* For picking a victim to steal from. */
+	struct mfs_deque sw_deque;
+	struct mfs_scanner *sw_scanner;
+	char *sw_path;			/* Buffer for building file paths. */
+	size_t sw_pathsize;
+};
+
+/*
+ * A directory we have been in.
+ */
+struct mfs_visited {
+	dev_t vi_dev;
+	ino_t vi_ino;
+	struct mfs_visited *vi_next;
+};
+
+struct mfs_scanner {
+	struct mfs_scanworker *sc_workers;
+	int sc_nworkers;
+	traverse_fn_t *sc_fileop;
+	const struct mfs_scanops *sc_ops;
+
+	pthread_mutex_t sc_lock;
+	pthread_cond_t sc_cv;		/* Idle workers wait here. */
+	int sc_pending;			/* Directories queued or in progress. */
+	unsigned long sc_pushed;	/* Bumped every time work is added. */
+
+	struct mfs_visited **sc_visited;
+	pthread_mutex_t sc_visited_lock;
+};
+
+/*
+ * Keep a copy of fd for the directories in it. Returns NULL if we can't,
+ * and they are opened by their path instead.
+ */
+static struct mfs_dirfd *
+mfs_dirfd_new(int fd)
+{
+	struct mfs_dirfd *df;
+
+	df = malloc(sizeof(*df));
+	if (df == NULL)
+		return (NULL);
+	df->df_fd = dup(fd);
+	if (df->df_fd < 0) {
+		free(df);
+		return (NULL);
+	}
+	df->df_refs = 1;
+	return (df);
+}
+
+static void
+mfs_dirfd_release(struct mfs_dirfd *df)
+{
+
+	if (df == NULL ||
+	    __atomic_sub_fetch(&df->df_refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	close(df->df_fd);
+	free(df);
+}
+
+/*
+ * Make a directory to read, which is name in the open directory parent, or
+ * dirpath itself when there is no parent.
+ */
+static struct mfs_scanitem *
+mfs_scanitem_new(struct mfs_dirfd *parent, const char *dirpath,
+    size_t dirlen, const char *name, int nofollow)
+{
+	struct mfs_scanitem *si;
+	size_t namelen;
+
+	namelen = (name != NULL) ? strlen(name) : 0;
+	si = malloc(sizeof(*si) + dirlen + 1 + namelen + 1);
+	if (si == NULL)
+		return (NULL);
+	memcpy(si->si_path, dirpath, dirlen);
+	si->si_path[dirlen] = '\0';
+	si->si_name = si->si_path;
+	if (name != NULL) {
+		si->si_path[dirlen] = '/';
+		memcpy(si->si_path + dirlen + 1, name, namelen + 1);
+		si->si_name = si->si_path + dirlen + 1;
+	}
+	si->si_parent = parent;
+	if (parent != NULL)
+		__atomic_add_fetch(&parent->df_refs, 1, __ATOMIC_RELAXED);
+	si->si_nofollow = nofollow;
+	return (si);
+}
+
+static void
+mfs_scanitem_free(struct mfs_scanitem *si)
+{
+
+	mfs_dirfd_release(si->si_parent);
+	free(si);
+}
+
+static int
+mfs_deque_init(struct mfs_deque *dq)
+{
+	dq->dq_items = malloc(sizeof(*dq->dq_items) * MFS_DEQUE_INITSIZE);
+	if (dq->dq_items == NULL)
+		return (-1);
+	dq->dq_head = 0;
+	dq->dq_count = 0;
+	dq->dq_size = MFS_DEQUE_INITSIZE;
+	pthread_mutex_init(&dq->dq_lock, NULL);
+	return (0);
+}
+
+static void
+mfs_deque_destroy(struct mfs_deque *dq)
+{
+	int i;
+
+	for (i = 0; i < dq->dq_count; i++)
+		mfs_scanitem_free(dq->dq_items[(dq->dq_head + i) %
+		    dq->dq_size]);
+	free(dq->dq_items);
+	pthread_mutex_destroy(&dq->dq_lock);
+}
+
+/* Push a directory to the tail. The deque takes ownership of it. */
+static int
+mfs_deque_push(struct mfs_deque *dq, struct mfs_scanitem *si)
+{
+	struct mfs_scanitem **items;
+	int i, size;
+
+	pthread_mutex_lock(&dq->dq_lock);
+	if (dq->dq_count == dq->dq_size) {
+		size = dq->dq_size * 2;
+		items = malloc(sizeof(*items) * size);
+		if (items == NULL) {
+			pthread_mutex_unlock(&dq->dq_lock);
+			return (-1);
+		}
+		for (i = 0; i < dq->dq_count; i++)
+			items[i] = dq->dq_items[(dq->dq_head + i) % dq->dq_size];
+		free(dq->dq_items);
+		dq->dq_items = items;
+		dq->dq_head = 0;
+		dq->dq_size = size;
+	}
+	dq->dq_items[(dq->dq_head + dq->dq_count) % dq->dq_size] = si;
+	dq->dq_count++;
+	pthread_mutex_unlock(&dq->dq_lock);
+	return (0);
+}
+
+/* Pop a directory from the tail. Used by the owner. */
+static struct mfs_scanitem *
+mfs_deque_pop(struct mfs_deque *dq)
+{
+	struct mfs_scanitem *si;
+
+	pthread_mutex_lock(&dq->dq_lock);
+	if (dq->dq_count == 0) {
+		pthread_mutex_unlock(&dq->dq_lock);
+		return (NULL);
+	}
+	dq->dq_count--;
+	si = dq->dq_items[(dq->dq_head + dq->dq_count) % dq->dq_size];
+	pthread_mutex_unlock(&dq->dq_lock);
+	return (si);
+}
+
+/* Take a directory from the head. Used by thieves. */
+static struct mfs_scanitem *
+mfs_deque_steal(struct mfs_deque *dq)
+{
+	struct mfs_scanitem *si;
+
+	pthread_mutex_lock(&dq->dq_lock);
+	if (dq->dq_count == 0) {
+		pthread_mutex_unlock(&dq->dq_lock);
+		return (NULL);
+	}
+	si = dq->dq_items[dq->dq_head];
+	dq->dq_head = (dq->dq_head + 1) % dq->dq_size;
+	dq->dq_count--;
+	pthread_mutex_unlock(&dq->dq_lock);
+	return (si);
+}
+
+/*
+ * Queue a directory on a worker's deque and wake up anyone idle.
+ */
+static void
+mfs_scanner_push(struct mfs_scanworker *sw, struct mfs_scanitem *si)
+{
+	struct mfs_scanner *sc = sw->sw_scanner;
+	const struct mfs_scanops *ops = sc->sc_ops;
+
+	pthread_mutex_lock(&sc->sc_lock);
+	sc->sc_pending++;
+	sc->sc_pushed++;
+	pthread_mutex_unlock(&sc->sc_lock);
+
+	if (mfs_deque_push(&sw->sw_deque, si) != 0) {
+		DEBUG("Out of memory queueing %s\n", si->si_path);
+		if (ops->so_error != NULL)
+			ops->so_error(NULL, si->si_path, ENOMEM);
+		mfs_scanitem_free(si);
+		pthread_mutex_lock(&sc->sc_lock);
+		sc->sc_pending--;
+		pthread_mutex_unlock(&sc->sc_lock);
+		return;
+	}
+	pthread_cond_broadcast(&sc->sc_cv);
+}
+
+/*
+ * Try to steal a directory from the other workers, starting at a random
+ * victim.
+ */
+static struct mfs_scanitem *
+mfs_scanner_steal(struct mfs_scanworker *sw)
+{
+	struct mfs_scanner *sc = sw->sw_scanner;
+	struct mfs_scanitem *si;
+	int i, start;
+
+	start = rand_r(&sw->sw_seed) % sc->sc_nworkers;
+	for (i = 0; i < sc->sc_nworkers; i++) {
+		struct mfs_scanworker *victim;
+
+		victim = &sc->sc_workers[(start + i) % sc->sc_nworkers];
+		if (victim == sw)
+			continue;
+		si = mfs_deque_steal(&victim->sw_deque);
+		if (si != NULL)
+			return (si);
+	}
+	return (NULL);
+}
+
+/*
+ * Mark a directory as visited. Returns 1 if it already was.
+ */
+static int
+mfs_scanner_visit(struct mfs_scanner *sc, dev_t dev, ino_t ino)
+{
+	struct mfs_visited *vi;
+	unsigned int bucket;
+
+	bucket = (unsigned int)((ino ^ (ino >> 16) ^ (dev << 8)) %
+	    MFS_VISITED_BUCKETS);
+	pthread_mutex_lock(&sc->sc_visited_lock);
+	for (vi = sc->sc_visited[bucket]; vi != NULL; vi = vi->vi_next) {
+		if (vi->vi_dev == dev && vi->vi_ino == ino) {
+			pthread_mutex_unlock(&sc->sc_visited_lock);
+			return (1);
+		}
+	}
+	vi = malloc(sizeof(*vi));
+	if (vi != NULL) {
+		vi->vi_dev = dev;
+		vi->vi_ino = ino;
+		vi->vi_next = sc->sc_visited[bucket];
+		sc->sc_visited[bucket] = vi;
+	}
+	pthread_mutex_unlock(&sc->sc_visited_lock);
+	return (0);
+}
+
+/*
+ * Put dirpath/name in the worker's path buffer.
+ */
+static const char *
+mfs_scanner_path(struct mfs_scanworker *sw, const char *dirpath, size_t dirlen,
+    const char *name)
+{
+	size_t len;
+	char *path;
+
+	len = dirlen + 1 + strlen(name) + 1;
+	if (len > sw->sw_pathsize) {
+		path = realloc(sw->sw_path, len * 2);
+		if (path == NULL)
+			return (NULL);
+		sw->sw_path = path;
+		sw->sw_pathsize = len * 2;
+	}
+	memcpy(sw->sw_path, dirpath, dirlen);
+	sw->sw_path[dirlen] = '/';
+	strcpy(sw->sw_path + dirlen + 1, name);
+	return (sw->sw_path);
+}
+
+/*
+ * Read one directory, queueing sub-directories and running the file
+ * operation on regular files. Errors make us skip the entry, and are
+ * told to the error hook.
+ */
+static void
+mfs_scanner_dir(struct mfs_scanworker *sw, struct mfs_scanitem *si)
+{
+	DIR *dirp;
+	struct dirent *dp;
+	struct stat st;
+	const struct mfs_scanops *ops = sw->sw_scanner->sc_ops;
+	const char *dirpath = si->si_path;
+	const char *filepath;
+	struct mfs_scanitem *subdir;
+	struct mfs_dirfd *self;
+	void *cookie;
+	size_t dirlen;
+	int error, fd, isdir, nofollow, skip;
+
+	if (ops->so_cancelled != NULL && ops->so_cancelled())
+		return;
+	DEBUG("[%d] traversing %s\n", sw->sw_id, dirpath);
+	/*
+	 * A directory that was no symlink when it was read is not followed
+	 * if it has been replaced by one since.
+	 */
+	if (si->si_parent != NULL)
+		fd = openat(si->si_parent->df_fd, si->si_name, O_RDONLY |
+		    O_DIRECTORY | (si->si_nofollow ? O_NOFOLLOW : 0));
+	else
+		fd = open(dirpath, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		error = errno;
+		DEBUG("error opening %s: %s\n", dirpath, strerror(error));
+		if (ops->so_error != NULL)
+			ops->so_error(NULL, dirpath, error);
+		return;
+	}
+	if (fstat(fd, &st) < 0) {
+		error = errno;
+		DEBUG("error doing stat on %s: %s\n", dirpath,
+		    strerror(error));
+		close(fd);
+		if (ops->so_error != NULL)
+			ops->so_error(NULL, dirpath, error);
+		return;
+	}
+	if (mfs_scanner_visit(sw->sw_scanner, st.st_dev, st.st_ino)) {
+		DEBUG("%s has been visited already, skipping\n", dirpath);
+		close(fd);
+		return;
+	}
+	dirp = fdopendir(fd);
+	if (dirp == NULL) {
+		error = errno;
+		close(fd);
+		if (ops->so_error != NULL)
+			ops->so_error(NULL, dirpath, error);
+		return;
+	}
+
+	cookie = NULL;
+	skip = 0;
+	if (ops->so_enter != NULL) {
+		cookie = ops->so_enter(dirpath);
+		skip = (cookie == NULL);
+	}
+
+	self = NULL;
+	dirlen = strlen(dirpath);
+	for (;;) {
+		/* Tell the end of the directory from an error. */
+		errno = 0;
+		if ((dp = readdir(dirp)) == NULL)
+			break;
+		if (!strcmp(dp->d_name, ".") ||
+		    !strcmp(dp->d_name, ".."))
+			continue;
+
+		nofollow = 0;
+		switch (dp->d_type) {
+		case DT_DIR:
+			isdir = 1;
+			nofollow = 1;
+			break;
+		case DT_REG:
+			isdir = 0;
+			break;
+		case DT_LNK:
+		case DT_UNKNOWN:
+			/* Follow symlinks, and find out what it really is. */
+			if (fstatat(fd, dp->d_name, &st, 0) < 0) {
+				error = errno;
+				DEBUG("error doing stat on %s/%s: %s\n",
+				    dirpath, dp->d_name, strerror(error));
+				/* A dangling symlink is no loss. */
+				if (error != ENOENT && ops->so_error != NULL)
+					ops->so_error(cookie, dirpath, error);
+				continue;
+			}
+			if (S_ISDIR(st.st_mode))
+				isdir = 1;
+			else if (S_ISREG(st.st_mode))
+				isdir = 0;
+			else
+				continue;
+			break;
+		default:
+			/* Devices, sockets, fifos. */
+			continue;
+		}
+
+		if (isdir) {
+			/* Keep this directory open for its sub-directories. */
+			if (self == NULL)
+				self = mfs_dirfd_new(fd);
+			subdir = mfs_scanitem_new(self, dirpath, dirlen,
+			    dp->d_name, nofollow);
+			/* The deque owns it now. */
+			if (subdir != NULL)
+				mfs_scanner_push(sw, subdir);
+			else if (ops->so_error != NULL)
+				ops->so_error(cookie, dirpath, ENOMEM);
+			continue;
+		}
+		if (skip)
+			continue;
+		filepath = mfs_scanner_path(sw, dirpath, dirlen, dp->d_name);
+		if (filepath == NULL) {
+			if (ops->so_error != NULL)
+				ops->so_error(cookie, dirpath, ENOMEM);
+			continue;
+		}
+		if (ops->so_file != NULL)
+			ops->so_file(cookie, filepath);
+		else
+			sw->sw_scanner->sc_fileop(filepath);
+	}
+	if (errno != 0) {
+		error = errno;
+		DEBUG("error reading %s: %s\n", dirpath, strerror(error));
+		if (ops->so_error != NULL)
+			ops->so_error(cookie, dirpath, error);
+	}
+	/* Closes fd as well. */
+	closedir(dirp);
+	mfs_dirfd_release(self);
+	if (!skip && ops->so_leave != NULL)
+		ops->so_leave(cookie);
+}
+
+static void *
+mfs_scanner_worker(void *arg)
+{
+	struct mfs_scanworker *sw = arg;
+	struct mfs_scanner *sc = sw->sw_scanner;
+	unsigned long pushed;
+	struct mfs_scanitem *si;
+
+	for (;;) {
+		pthread_mutex_lock(&sc->sc_lock);
+		pushed = sc->sc_pushed;
+		pthread_mutex_unlock(&sc->sc_lock);
+
+		si = mfs_deque_pop(&sw->sw_deque);
+		if (si == NULL)
+			si = mfs_scanner_steal(sw);
+		if (si == NULL) {
+			/*
+			 * Nothing to do. Sleep until more work is pushed,
+			 * unless everyone is done.
+			 */
+			pthread_mutex_lock(&sc->sc_lock);
+			while (sc->sc_pending > 0 && sc->sc_pushed == pushed)
+				pthread_cond_wait(&sc->sc_cv, &sc->sc_lock);
+			if (sc->sc_pending == 0) {
+				pthread_mutex_unlock(&sc->sc_lock);
+				break;
+			}
+			pthread_mutex_unlock(&sc->sc_lock);
+			continue;
+		}
+
+		mfs_scanner_dir(sw, si);
+		mfs_scanitem_free(si);
+
+		pthread_mutex_lock(&sc->sc_lock);
+		if (--sc->sc_pending == 0)
+			pthread_cond_broadcast(&sc->sc_cv);
+		pthread_mutex_unlock(&sc->sc_lock);
+	}
+	return (NULL);
+}
+
+/*
+ * Scan a hierarchy in parallel. Returns when every file below dirpath has
+ * been handed to fileop, or to the file hook in ops.
+ */
+static int
+mfs_scanner_start(const char *dirpath, const struct mfs_scanops *ops,
+    traverse_fn_t *fileop, int nthreads)
+{
+	struct mfs_scanner sc;
+	struct mfs_scanitem *root;
+	int i, started;
+
+	if (nthreads <= 0) {
+		nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if (nthreads <= 0)
+			nthreads = 1;
+	}
+	DEBUG("scanning %s with %d threads\n", dirpath, nthreads);
+
+	memset(&sc, 0, sizeof(sc));
+	sc.sc_fileop = fileop;
+	sc.sc_ops = ops;
+	sc.sc_nworkers = nthreads;
+	sc.sc_workers = calloc(nthreads, sizeof(struct mfs_scanworker));
+	if (sc.sc_workers == NULL)
+		return (-1);
+	sc.sc_visited = calloc(MFS_VISITED_BUCKETS, sizeof(struct mfs_visited *));
+	if (sc.sc_visited == NULL) {
+		free(sc.sc_workers);
+		return (-1);
+	}
+	pthread_mutex_init(&sc.sc_lock, NULL);
+	pthread_cond_init(&sc.sc_cv, NULL);
+	pthread_mutex_init(&sc.sc_visited_lock, NULL);
+
+	for (i = 0; i < nthreads; i++) {
+		sc.sc_workers[i].sw_id = i;
+		sc.sc_workers[i].sw_seed = (unsigned int)i + 1;
+		sc.sc_workers[i].sw_scanner = &sc;
+		if (mfs_deque_init(&sc.sc_workers[i].sw_deque) != 0) {
+			while (--i >= 0)
+				mfs_deque_destroy(&sc.sc_workers[i].sw_deque);
+			free(sc.sc_workers);
+			free(sc.sc_visited);
+			return (-1);
+		}
+	}
+
+	root = mfs_scanitem_new(NULL, dirpath, strlen(dirpath), NULL, 0);
+	if (root != NULL)
+		mfs_scanner_push(&sc.sc_workers[0], root);
+	else if (ops->so_error != NULL)
+		ops->so_error(NULL, dirpath, ENOMEM);
+
+	started = 0;
+	for (i = 0; nthreads > 1 && i < nthreads; i++) {
+		if (pthread_create(&sc.sc_workers[i].sw_thr, NULL,
+		    mfs_scanner_worker, &sc.sc_workers[i]) != 0) {
+			DEBUG("Unable to start scanner thread %d\n", i);
+			break;
+		}
+		started++;
+	}
+	/* With one thread, or if we could not start any, do it ourselves. */
+	if (started == 0)
+		mfs_scanner_worker(&sc.sc_workers[0]);
+	for (i = 0; i < started; i++)
+		pthread_join(sc.sc_workers[i].sw_thr, NULL);
+
+	for (i = 0; i < nthreads; i++) {
+		mfs_deque_destroy(&sc.sc_workers[i].sw_deque);
+		free(sc.sc_workers[i].sw_path);
+	}
+	free(sc.sc_workers);
+	for (i = 0; i < MFS_VISITED_BUCKETS; i++) {
+		struct mfs_visited *vi, *next;
+
+		for (vi = sc.sc_visited[i]; vi != NULL; vi = next) {
+			next = vi->vi_next;
+			free(vi);
+		}
+	}
+	free(sc.sc_visited);
+	pthread_mutex_destroy(&sc.sc_visited_lock);
+	pthread_cond_destroy(&sc.sc_cv);
+	pthread_mutex_destroy(&sc.sc_lock);
+	return (0);
+}
+
+int
+mfs_scanner_run(const char *dirpath, traverse_fn_t *fileop, int nthreads)
+{
+	static const struct mfs_scanops noops;
+
+	return (mfs_scanner_start(dirpath, &noops, fileop, nthreads));
+}
+
+int
+mfs_scanner_walk(const char *dirpath, const struct mfs_scanops *ops,
+    int nthreads)
+{
+
+	return (mfs_scanner_start(dirpath, ops, NULL, nthreads));
+}
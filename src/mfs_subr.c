@@ -29,7 +29,6 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
-#include <err.h>
 
 #include <fusever.h>
 #include <fuse.h>
@@ -38,17 +37,16 @@
 #include <musicfs.h>
 #include <sqlite3.h>
 #include <mfs_cleanup_db.h>
+#include <mfs_scanner.h>
+#include <mfs_pipeline.h>
+#include <mfs_scanctl.h>
+#include <mfs_db.h>
+#include <mfs_catalog.h>
+#include <mfs_tags.h>
+#include <mfs_watch.h>
 
 #define MFS_HANDLE ((void*)-1)
 
-#ifdef SQLITE_THREADED
-#define MFS_DB_LOCK()
-#define MFS_DB_UNLOCK()
-#else
-#define MFS_DB_LOCK() pthread_mutex_lock(&dblock)
-#define MFS_DB_UNLOCK() pthread_mutex_unlock(&dblock)
-#endif
-
 struct lookuphandle {
 	sqlite3 *handle;
 	sqlite3_stmt *st;
@@ -59,9 +57,31 @@ struct lookuphandle {
 	lookup_fn_t *lookup;
 };
 
-sqlite3 *handle;
-pthread_mutex_t dblock;
 pthread_mutex_t __debug_lock__;
+/*
+ * Serializes writes from the scanner. Every thread uses its own
+ * connection (see mfs_db_get()), and the songs of a scan are written
+ * by one thread at a time: the writer of the pipeline while it runs,
+ * and the thread that started the scan otherwise.
+ */
+pthread_mutex_t scanlock;
+
+struct mfs_options mfs_opts = {
+	.scan_threads = 1,
+	.scan_io_threads = 4,
+	.scan_parse_threads = 0,
+	.full_rescan = 0,
+	.scan_batch = 500,
+	.taglib_only = 0,
+	.io_uring = 0,
+	.noscan = 0,
+	.nowatch = 0,
+	.watch_delay = 1000,
+	.scan_ioprio = NULL,
+	.scan_files_per_sec = 0,
+	.scan_mb_per_sec = 0,
+	.scan_read_latency = 0,
+};
 
 /*
  * Returns the path to $HOME[/extra]
@@ -95,9 +115,8 @@ mfs_insert_path(const char *path, sqlite3 *handle)
 	sqlite3_stmt *st;
 
 	/* Add path to registered paths in DB */
-	res = sqlite3_prepare_v2(handle,
-	    "SELECT path FROM path WHERE path LIKE ?",
-	    -1, &st, NULL);
+	res = mfs_db_prepare(handle,
+	    "SELECT path FROM path WHERE path LIKE ?", &st);
 	if (res != SQLITE_OK) {
 		DEBUG("Error preparing statement: %s\n",
 		    sqlite3_errmsg(handle));
@@ -105,14 +124,13 @@ mfs_insert_path(const char *path, sqlite3 *handle)
 	}
 	sqlite3_bind_text(st, 1, path, -1, SQLITE_TRANSIENT);
 	res = sqlite3_step(st);
-	sqlite3_finalize(st);
+	mfs_db_release(st);
 
 	if (res == SQLITE_DONE) {
 		DEBUG("Inserting path '%s' to paths\n", path);
 		/* Doesn't exist. Insert it */
-		res = sqlite3_prepare_v2(handle,
-		    "INSERT INTO path(path, active) VALUES(?,1)",
-		    -1, &st, NULL);
+		res = mfs_db_prepare(handle,
+		    "INSERT INTO path(path, active) VALUES(?,1)", &st);
 		if (res != SQLITE_OK) {
 			DEBUG("Error preparing stamtement: %s\n",
 				  sqlite3_errmsg(handle));
@@ -120,7 +138,7 @@ mfs_insert_path(const char *path, sqlite3 *handle)
 		}
 		sqlite3_bind_text(st, 1, path, -1, SQLITE_TRANSIENT);
 		res = sqlite3_step(st);
-		sqlite3_finalize(st);
+		mfs_db_release(st);
 		if (res != SQLITE_DONE) {
 			DEBUG("Error inserting into database: %s\n",
 			    sqlite3_errmsg(handle));
@@ -129,8 +147,8 @@ mfs_insert_path(const char *path, sqlite3 *handle)
 	}
 	else {
 		/* Path already in database, just activate it */
-		res = sqlite3_prepare_v2(handle, "UPDATE path SET active = 1 "
-		    "WHERE path LIKE ?", -1, &st, NULL);
+		res = mfs_db_prepare(handle, "UPDATE path SET active = 1 "
+		    "WHERE path LIKE ?", &st);
 		if (res != SQLITE_OK) {
 			DEBUG("Error preparing statement: %s\n",
 			    sqlite3_errmsg(handle));
@@ -138,7 +156,7 @@ mfs_insert_path(const char *path, sqlite3 *handle)
 		}
 		sqlite3_bind_text(st, 1, path, -1, SQLITE_TRANSIENT);
 		res = sqlite3_step(st);
-		sqlite3_finalize(st);
+		mfs_db_release(st);
 		if (res != SQLITE_DONE) {
 			DEBUG("Error activating path '%s'\n", path);
 		}
@@ -153,9 +171,10 @@ mfs_insert_path(const char *path, sqlite3 *handle)
 int
 mfs_reload_config()
 {
-	int res, len;
+	int res, len, i, n, max;
 	char *mfsrc = mfs_get_home_path(".mfsrc");
 	char line[4096];
+	char **paths, **tmp;
 	struct lookuphandle *lh;
 	sqlite3 *handle;
 	sqlite3_stmt *st;
@@ -167,26 +186,22 @@ mfs_reload_config()
 		return (-1);
 	}
 
-	MFS_DB_LOCK();
-	res = sqlite3_open(db_path, &handle);
+	res = mfs_db_get(db_path, &handle);
 	if (res) {
-		DEBUG("Can't open database: %s\n", sqlite3_errmsg(handle));
-		sqlite3_close(handle);
-		MFS_DB_UNLOCK();
+		fclose(f);
+		free(mfsrc);
 		return (-1);
 	}
 
 	/* Deactivate all paths */
-	res = sqlite3_prepare_v2(handle, "UPDATE path SET active = 0",
-	    -1, &st, NULL);
+	res = mfs_db_prepare(handle, "UPDATE path SET active = 0", &st);
 	if (res != SQLITE_OK) {
 		DEBUG("Error preparing statement: %s\n",
 			  sqlite3_errmsg(handle));
-		MFS_DB_UNLOCK();
 		return (-1);
 	}
 	res = sqlite3_step(st);
-	sqlite3_finalize(st);
+	mfs_db_release(st);
 	if (res != SQLITE_DONE) {
 		DEBUG("Error deactivating paths.\n");
 	}
@@ -202,17 +217,51 @@ mfs_reload_config()
 		}
 	}
 
-	mfs_cleanup_db(handle);
-
+	fclose(f);
 	free (mfsrc);
-	sqlite3_close(handle);
 
-	/* Do the actual loading */
-	lh = mfs_lookup_start(0, MFS_HANDLE, mfs_lookup_load_path,
-	    "SELECT path FROM path");
+	/*
+	 * Do the actual loading. The paths are read first: the scan writes
+	 * on other connections, and a query still open on this one would
+	 * keep it from seeing what they wrote.
+	 */
+	mfs_catalog_invalidate();
+	paths = NULL;
+	n = max = 0;
+	if (mfs_db_prepare(handle, "SELECT path FROM path WHERE active = 1",
+	    &st) == SQLITE_OK) {
+		while (sqlite3_step(st) == SQLITE_ROW) {
+			if (n == max) {
+				max = max > 0 ? max * 2 : 8;
+				tmp = realloc(paths, max * sizeof(char *));
+				if (tmp == NULL)
+					break;
+				paths = tmp;
+			}
+			paths[n] = strdup((const char *)
+			    sqlite3_column_text(st, 0));
+			if (paths[n] != NULL)
+				n++;
+		}
+		mfs_db_release(st);
+	}
+	for (i = 0; i < n; i++) {
+		if (mfs_lookup_load_path(NULL, paths[i]) != 0)
+			break;
+	}
+	for (i = 0; i < n; i++)
+		free(paths[i]);
+	free(paths);
+
+	/* Stop watching paths that were removed from the configuration. */
+	lh = mfs_lookup_start(0, NULL, mfs_lookup_unwatch_path,
+	    "SELECT path FROM path WHERE active = 0");
 	mfs_lookup_finish(lh);
 
-	MFS_DB_UNLOCK();
+	/* Remove what went away, both paths and files within paths. */
+	mfs_cleanup_db(handle);
+	mfs_catalog_load();
+
 	return (0);
 }
 
@@ -221,23 +270,42 @@ int
 mfs_init()
 {
 /*	int error;*/
+	sqlite3 *handle;
+
 	db_path = mfs_get_home_path(".mfs.db");
 
+	/*
+	 * Make sure the database schema is up to date. In WAL mode, which
+	 * is kept in the database file, lookups read while the scanner
+	 * writes.
+	 */
+	if (mfs_db_open(db_path, &handle) == SQLITE_OK) {
+		mfs_db_upgrade(handle);
+		sqlite3_exec(handle, "PRAGMA journal_mode = WAL", NULL, NULL,
+		    NULL);
+	} else
+		DEBUG("Can't open database: %s\n", sqlite3_errmsg(handle));
+	sqlite3_close(handle);
+
 	/* Init locks. */
-	pthread_mutex_init(&dblock, NULL);
 	pthread_mutex_init(&__debug_lock__, NULL);
+	pthread_mutex_init(&scanlock, NULL);
+
+	/*
+	 * The scanner may run taglib from several threads, and the string
+	 * list taglib keeps for taglib_tag_free_strings() is not protected.
+	 * Manage the strings ourselves instead.
+	 */
+	taglib_set_string_management_enabled(0);
 
 /* 	error = mfs_insert_path(musicpath, handle); */
 /* 	if (error != 0) */
 /* 		return (error); */
-	
-	/* Scan the music initially. (Disabled, since it's really
-	   annoying with huge collections) */
-/* 	error = mfs_reload_config(); */
-/* 	if (error != 0) { */
-/* 		return (error); */
-/* 	} */
-	
+
+	/*
+	 * The music is scanned initially by the background scanner, once
+	 * the filesystem is mounted.
+	 */
 	return (0);
 }
 
@@ -249,37 +317,9 @@ mfs_init()
 void
 traverse_hierarchy(const char *dirpath, traverse_fn_t fileop)
 {
-	DEBUG("traversing %s\n", dirpath);
-	DIR *dirp;
-	struct dirent *dp;
-	char filepath[MAXPATHLEN];
-	struct stat st;
 
-	dirp = opendir(dirpath);
-	if (dirp == NULL)
-		return;
-	
-	/* Loop through all files. */
-	while ((dp = readdir(dirp)) != NULL) {
-		if (!strcmp(dp->d_name, ".") ||
-		    !strcmp(dp->d_name, ".."))
-			continue;
-		
-		snprintf(filepath, sizeof(filepath), "%s/%s",
-		    dirpath, dp->d_name);
-		if (stat(filepath, &st) < 0)
-			err(1, "error doing stat on %s", filepath);
-		/* Recurse if it's a directory. */
-		if (st.st_mode & S_IFDIR)  {
-			traverse_hierarchy(filepath, fileop);
-			continue;
-		}
-		/* If it's a regular file, perform the operation. */
-		if (st.st_mode & S_IFREG) {
-			fileop(filepath);
-		}
-	}
-	closedir(dirp);
+	/* A single scanner thread is an iterative walk in this thread. */
+	mfs_scanner_run(dirpath, fileop, 1);
 }
 
 /* Check if a string is empty (either NULL or "") */
@@ -289,119 +329,905 @@ mfs_empty(const char *str)
 	return (str == NULL || strlen(str) == 0);
 }
 
-/* Scan the music initially. */
-void
-mfs_scan(const char *filepath)
+/*
+ * Scanned files are written in batches of mfs_opts.scan_batch files per
+ * transaction, rather than one implicit transaction (and fsync) for each
+ * statement. The transaction is on the connection of the thread writing,
+ * which commits it before another thread writes. Protected by scanlock.
+ */
+static int scan_txn;		/* A transaction is open. */
+static int scan_batched;	/* Files written in the transaction. */
+static int scan_burst;		/* Hold everything in one transaction. */
+static int scan_committed;	/* The catalog has not seen the last commit. */
+
+/*
+ * The scan journal. Every scan of a music path gets a generation number,
+ * which is stamped on each song it adds or changes, and records the
+ * directories it has finished in scan_dir. Unchanged songs are not
+ * written at all: when a directory is finished, its songs whose files
+ * were not seen are marked as gone, and the songs in finished
+ * directories are known to be there. A scan that is interrupted keeps
+ * its generation, and when it is resumed, the files in finished
+ * directories are not looked at again. Songs that are gone, or in
+ * directories the scan did not finish, are only removed once the scan
+ * completes, so that a file moved elsewhere keeps its song. The songs
+ * at and below a path the scan could not read are kept as they are, as
+ * they may well be there; a directory that lost a file is not recorded
+ * as finished, so that it is looked at again if the scan is resumed.
+ * Protected by scanlock.
+ */
+#define MFS_SCAN_GONE	-1	/* Generation of songs whose file is gone. */
+
+static char *scan_root;		/* Music path being scanned. */
+static int scan_generation;
+static int scan_resumed;	/* Some directories may be done already. */
+static char **scan_keep;	/* Paths that could not be read. */
+static int scan_nkeep, scan_maxkeep;
+static int scan_lost;		/* One of them could not be kept. */
+
+static void
+mfs_scan_txn_begin(sqlite3 *handle)
 {
-	TagLib_File *file;
-	TagLib_Tag *tag;
-	char *artist, *album, *genre, *title, *trackno;
-	const char *extension;
-	int ret;
-	unsigned int track, year;
-	sqlite3_stmt *st;
-	struct stat fstat;
-	
-	file = taglib_file_new(filepath);
-	/* XXX: errmsg. */
-	if (file == NULL) {
-		DEBUG("Unable to open file %s\n", filepath);
+
+	if (scan_txn)
+		return;
+	if (mfs_db_exec(handle, "BEGIN") != 0)
+		return;
+	scan_txn = 1;
+	scan_batched = 0;
+}
+
+static void
+mfs_scan_txn_commit(sqlite3 *handle)
+{
+
+	if (!scan_txn)
 		return;
+	if (mfs_db_exec(handle, "COMMIT") != 0)
+		mfs_db_exec(handle, "ROLLBACK");
+	scan_txn = 0;
+	scan_batched = 0;
+	scan_committed = 1;
+}
+
+/* Count a file written, committing when we have gathered enough. */
+static void
+mfs_scan_txn_count(sqlite3 *handle)
+{
+
+	if (++scan_batched >= mfs_opts.scan_batch && !scan_burst)
+		mfs_scan_txn_commit(handle);
+}
+
+/*
+ * Let the songs committed so far show up while the scan goes on. The
+ * catalog is built without scanlock, which lookups would otherwise wait
+ * for, and not while a batch is open on a connection.
+ */
+static void
+mfs_scan_refresh()
+{
+	int due;
+
+	pthread_mutex_lock(&scanlock);
+	due = scan_committed && !scan_txn;
+	if (due)
+		scan_committed = 0;
+	pthread_mutex_unlock(&scanlock);
+	if (due)
+		mfs_catalog_refresh();
+}
+
+/*
+ * Look for the song of a file that has been moved or renamed: one with the
+ * same device, inode, size and modification time, whose file is gone. The
+ * old path is returned.
+ */
+static char *
+mfs_scan_find_moved(sqlite3 *handle, const struct stat *fstat)
+{
+	struct stat ost;
+	sqlite3_stmt *st;
+	const char *oldpath;
+	char *from;
+
+	if (mfs_db_prepare(handle, "SELECT filepath FROM song WHERE "
+	    "ino = ? AND dev = ? AND size = ? AND mtime = ?", &st) !=
+	    SQLITE_OK) {
+		DEBUG("Error preparing statement: %s\n",
+		    sqlite3_errmsg(handle));
+		return (NULL);
+	}
+	sqlite3_bind_int64(st, 1, (sqlite3_int64)fstat->st_ino);
+	sqlite3_bind_int64(st, 2, (sqlite3_int64)fstat->st_dev);
+	sqlite3_bind_int64(st, 3, (sqlite3_int64)fstat->st_size);
+	sqlite3_bind_int(st, 4, fstat->st_mtime);
+	from = NULL;
+	while (from == NULL && sqlite3_step(st) == SQLITE_ROW) {
+		oldpath = (const char *)sqlite3_column_text(st, 0);
+		if (oldpath == NULL)
+			continue;
+		/*
+		 * A hard link leaves the old path in place, and it keeps its
+		 * song. The inode may also have been reused by a new file.
+		 */
+		if (stat(oldpath, &ost) == 0 && ost.st_ino == fstat->st_ino &&
+		    ost.st_dev == fstat->st_dev)
+			continue;
+		from = strdup(oldpath);
 	}
-	tag = taglib_file_tag(file);
-	if (tag == NULL) {
-		DEBUG("Error getting tag from %s\n", filepath);
+	mfs_db_release(st);
+	return (from);
+}
+
+/*
+ * Check if a file is in the database with the same modification time and
+ * size as it has now. If the file is not known under its path, but was
+ * moved here, the path it had is stored in from, unless from is NULL.
+ * This only reads, on the connection of the calling thread, so discovery
+ * does not wait for the writer.
+ */
+int
+mfs_scan_check(const char *filepath, const struct stat *fstat, char **from)
+{
+	sqlite3 *handle;
+	sqlite3_stmt *st;
+	int ret;
+
+	if (from != NULL)
+		*from = NULL;
+	if (mfs_db_get(db_path, &handle) != SQLITE_OK)
+		return (MFS_SCAN_NEW);
+	ret = mfs_db_prepare(handle, "SELECT mtime, size, ino IS NULL "
+	    "FROM song WHERE filepath = ?", &st);
+	if (ret != SQLITE_OK) {
+		DEBUG("Error preparing statement: %s\n",
+		    sqlite3_errmsg(handle));
+		return (MFS_SCAN_NEW);
+	}
+	sqlite3_bind_text(st, 1, filepath, -1, SQLITE_STATIC);
+	if (sqlite3_step(st) != SQLITE_ROW)
+		ret = MFS_SCAN_NEW;
+	else if (sqlite3_column_int(st, 0) == (int)fstat->st_mtime &&
+	    sqlite3_column_type(st, 1) != SQLITE_NULL &&
+	    sqlite3_column_int64(st, 1) == (sqlite3_int64)fstat->st_size)
+		ret = sqlite3_column_int(st, 2) ? MFS_SCAN_NOID :
+		    MFS_SCAN_UNCHANGED;
+	else
+		ret = MFS_SCAN_CHANGED;
+	mfs_db_release(st);
+	if (ret == MFS_SCAN_NEW && from != NULL &&
+	    (*from = mfs_scan_find_moved(handle, fstat)) != NULL)
+		ret = MFS_SCAN_MOVED;
+	return (ret);
+}
+
+/*
+ * Remove the song of a file that has changed, so that it can be inserted
+ * again with fresh tags. Called with scanlock held.
+ */
+static void
+mfs_scan_forget(sqlite3 *handle, const char *filepath)
+{
+	sqlite3_stmt *st;
+	int ret;
+
+	DEBUG("%s has changed, rescanning\n", filepath);
+	ret = mfs_db_prepare(handle, "DELETE FROM song WHERE filepath = ?",
+	    &st);
+	if (ret != SQLITE_OK) {
+		DEBUG("Error preparing statement: %s\n",
+		    sqlite3_errmsg(handle));
 		return;
 	}
+	sqlite3_bind_text(st, 1, filepath, -1, SQLITE_STATIC);
+	if (sqlite3_step(st) != SQLITE_DONE)
+		DEBUG("Error removing %s: %s\n", filepath,
+		    sqlite3_errmsg(handle));
+	mfs_db_release(st);
+}
 
-	if (stat(filepath, &fstat) < 0) {
-		DEBUG("Error getting file info: %s\n", strerror(errno));
+/*
+ * Mark the song of an unchanged file as seen by the current scan. Its
+ * identity is refreshed too, since songs stored before we kept it have
+ * none. The pipeline only does this for those, and leaves the songs of
+ * other unchanged files alone (see mfs_scan_dir_store()). Called with
+ * scanlock held.
+ */
+static void
+mfs_scan_touch(sqlite3 *handle, const char *filepath,
+    const struct stat *fstat)
+{
+	sqlite3_stmt *st;
+
+	if (mfs_db_prepare(handle, "UPDATE song SET generation = ?, "
+	    "dev = ?, ino = ? WHERE filepath = ?", &st) != SQLITE_OK) {
+		DEBUG("Error preparing statement: %s\n",
+		    sqlite3_errmsg(handle));
 		return;
 	}
+	sqlite3_bind_int(st, 1, scan_generation);
+	sqlite3_bind_int64(st, 2, (sqlite3_int64)fstat->st_dev);
+	sqlite3_bind_int64(st, 3, (sqlite3_int64)fstat->st_ino);
+	sqlite3_bind_text(st, 4, filepath, -1, SQLITE_STATIC);
+	if (sqlite3_step(st) != SQLITE_DONE)
+		DEBUG("Error updating %s: %s\n", filepath,
+		    sqlite3_errmsg(handle));
+	mfs_db_release(st);
+}
 
-	/* XXX: The main query code should perhaps be a bit generalized. */
+/* Forget the paths kept by a scan. Called with scanlock held. */
+static void
+mfs_scan_keep_clear()
+{
+	int i;
 
-	/* First insert artist if we have it. */
-	do {
-		artist = taglib_tag_artist(tag);
-		if (mfs_empty(artist))
-			break;
-		/* First find out if it exists. */
-		ret = sqlite3_prepare_v2(handle, "SELECT * FROM artist WHERE "
-		    "name=?", -1, &st, NULL);
-		if (ret != SQLITE_OK) {
-			DEBUG("Error preparing statement: %s\n",
+	for (i = 0; i < scan_nkeep; i++)
+		free(scan_keep[i]);
+	free(scan_keep);
+	scan_keep = NULL;
+	scan_nkeep = scan_maxkeep = 0;
+	scan_lost = 0;
+}
+
+/*
+ * Start or resume the scan of a music path. The number of songs we know
+ * in it is stored in expected.
+ */
+int
+mfs_scan_begin(const char *root, int *expected)
+{
+	sqlite3 *handle;
+	sqlite3_stmt *st;
+	int ret, complete;
+
+	*expected = 0;
+	if (mfs_db_get(db_path, &handle) != SQLITE_OK)
+		return (-1);
+	pthread_mutex_lock(&scanlock);
+	if (mfs_db_prepare(handle, "SELECT COUNT(*) FROM song WHERE "
+	    "filepath >= RTRIM(?1, '/')||'/' AND "
+	    "filepath < RTRIM(?1, '/')||'0'", &st) == SQLITE_OK) {
+		sqlite3_bind_text(st, 1, root, -1, SQLITE_STATIC);
+		if (sqlite3_step(st) == SQLITE_ROW)
+			*expected = sqlite3_column_int(st, 0);
+		mfs_db_release(st);
+	}
+	free(scan_root);
+	scan_root = strdup(root);
+	scan_resumed = 0;
+	mfs_scan_keep_clear();
+	ret = mfs_db_prepare(handle, "SELECT generation, complete FROM scan "
+	    "WHERE path = ?", &st);
+	if (ret != SQLITE_OK) {
+		DEBUG("Error preparing statement: %s\n",
+		    sqlite3_errmsg(handle));
+		pthread_mutex_unlock(&scanlock);
+		return (-1);
+	}
+	sqlite3_bind_text(st, 1, root, -1, SQLITE_STATIC);
+	complete = 1;
+	if (sqlite3_step(st) == SQLITE_ROW) {
+		scan_generation = sqlite3_column_int(st, 0);
+		complete = sqlite3_column_int(st, 1);
+	}
+	mfs_db_release(st);
+	if (!complete) {
+		DEBUG("resuming scan %d of %s\n", scan_generation, root);
+		scan_resumed = 1;
+		pthread_mutex_unlock(&scanlock);
+		return (0);
+	}
+
+	/* A new generation, newer than any song in the database. */
+	ret = mfs_db_prepare(handle, "SELECT MAX((SELECT COALESCE("
+	    "MAX(generation), 0) FROM scan), (SELECT COALESCE("
+	    "MAX(generation), 0) FROM song)) + 1", &st);
+	if (ret != SQLITE_OK) {
+		DEBUG("Error preparing statement: %s\n",
+		    sqlite3_errmsg(handle));
+		pthread_mutex_unlock(&scanlock);
+		return (-1);
+	}
+	scan_generation = 1;
+	if (sqlite3_step(st) == SQLITE_ROW)
+		scan_generation = sqlite3_column_int(st, 0);
+	mfs_db_release(st);
+
+	mfs_db_exec(handle, "BEGIN");
+	ret = mfs_db_prepare(handle, "INSERT INTO scan(path, generation, "
+	    "complete) VALUES(?, ?, 0) ON CONFLICT(path) DO UPDATE SET "
+	    "generation = excluded.generation, complete = 0", &st);
+	if (ret == SQLITE_OK) {
+		sqlite3_bind_text(st, 1, root, -1, SQLITE_STATIC);
+		sqlite3_bind_int(st, 2, scan_generation);
+		if (sqlite3_step(st) != SQLITE_DONE)
+			DEBUG("Error starting scan: %s\n",
 			    sqlite3_errmsg(handle));
-			break;
+		mfs_db_release(st);
+	}
+	ret = mfs_db_prepare(handle, "DELETE FROM scan_dir WHERE path = ?",
+	    &st);
+	if (ret == SQLITE_OK) {
+		sqlite3_bind_text(st, 1, root, -1, SQLITE_STATIC);
+		sqlite3_step(st);
+		mfs_db_release(st);
+	}
+	mfs_db_exec(handle, "COMMIT");
+	DEBUG("starting scan %d of %s\n", scan_generation, root);
+	pthread_mutex_unlock(&scanlock);
+	return (0);
+}
+
+/*
+ * Check if the files in a directory were done by an earlier run of the
+ * current scan.
+ */
+int
+mfs_scan_dir_check(const char *dirpath)
+{
+	sqlite3 *handle;
+	sqlite3_stmt *st;
+	char *root;
+	int done, generation;
+
+	/* Set before the walk starts, and not changed until it is done. */
+	pthread_mutex_lock(&scanlock);
+	root = scan_resumed ? scan_root : NULL;
+	generation = scan_generation;
+	pthread_mutex_unlock(&scanlock);
+	done = 0;
+	if (root != NULL && mfs_db_get(db_path, &handle) == SQLITE_OK &&
+	    mfs_db_prepare(handle, "SELECT 1 FROM scan_dir "
+	    "WHERE path = ? AND dirpath = ? AND generation = ?", &st) ==
+	    SQLITE_OK) {
+		sqlite3_bind_text(st, 1, root, -1, SQLITE_STATIC);
+		sqlite3_bind_text(st, 2, dirpath, -1, SQLITE_STATIC);
+		sqlite3_bind_int(st, 3, generation);
+		done = (sqlite3_step(st) == SQLITE_ROW);
+		mfs_db_release(st);
+	}
+	return (done);
+}
+
+static int
+mfs_scan_pathcmp(const void *a, const void *b)
+{
+
+	return (strcmp(*(char * const *)a, *(char * const *)b));
+}
+
+/*
+ * Record that all files in a directory have been stored. The unchanged
+ * files, which were not written, are given and are sorted here. The songs
+ * of other files that were right in the directory are gone. This goes
+ * into the same transaction as the last of the files.
+ */
+void
+mfs_scan_dir_store(const char *dirpath, char **seen, int nseen)
+{
+	sqlite3 *handle;
+	sqlite3_stmt *st;
+	char *filepath, **gone, **tmp;
+	int i, ngone, maxgone;
+
+	if (mfs_db_get(db_path, &handle) != SQLITE_OK)
+		return;
+	if (nseen > 0)
+		qsort(seen, nseen, sizeof(char *), mfs_scan_pathcmp);
+	gone = NULL;
+	ngone = maxgone = 0;
+	pthread_mutex_lock(&scanlock);
+	mfs_scan_txn_begin(handle);
+	/* The songs this scan did not write, right in the directory. */
+	if (mfs_db_prepare(handle, "SELECT filepath FROM song WHERE "
+	    "filepath >= ?1||'/' AND filepath < ?1||'0' AND "
+	    "rtrim(filepath, replace(filepath, '/', '')) = ?1||'/' AND "
+	    "generation < ?2 AND generation != ?3", &st) == SQLITE_OK) {
+		sqlite3_bind_text(st, 1, dirpath, -1, SQLITE_STATIC);
+		sqlite3_bind_int(st, 2, scan_generation);
+		sqlite3_bind_int(st, 3, MFS_SCAN_GONE);
+		while (sqlite3_step(st) == SQLITE_ROW) {
+			filepath = (char *)sqlite3_column_text(st, 0);
+			if (nseen > 0 && bsearch(&filepath, seen, nseen,
+			    sizeof(char *), mfs_scan_pathcmp) != NULL)
+				continue;
+			if (ngone == maxgone) {
+				maxgone = maxgone > 0 ? maxgone * 2 : 16;
+				tmp = realloc(gone, maxgone * sizeof(char *));
+				if (tmp == NULL)
+					break;
+				gone = tmp;
+			}
+			if ((gone[ngone] = strdup(filepath)) != NULL)
+				ngone++;
 		}
-		sqlite3_bind_text(st, 1, artist, -1, SQLITE_STATIC);
-		ret = sqlite3_step(st);
-		sqlite3_finalize(st);
-		/* Already exists or generic error. */
-		if (ret != SQLITE_DONE)
-			break;
-		/* Doesn't exist, so we can insert it. */
-		ret = sqlite3_prepare_v2(handle, "INSERT INTO artist(name) "
-		    "VALUES(?)", -1, &st, NULL);
-		if (ret != SQLITE_OK) {
-			DEBUG("Error preparing statement: %s\n",
-			    sqlite3_errmsg(handle));
-			break;
+		mfs_db_release(st);
+	}
+	for (i = 0; i < ngone; i++) {
+		DEBUG("%s is gone\n", gone[i]);
+		if (mfs_db_prepare(handle, "UPDATE song SET generation = ? "
+		    "WHERE filepath = ?", &st) == SQLITE_OK) {
+			sqlite3_bind_int(st, 1, MFS_SCAN_GONE);
+			sqlite3_bind_text(st, 2, gone[i], -1, SQLITE_STATIC);
+			if (sqlite3_step(st) != SQLITE_DONE)
+				DEBUG("Error updating %s: %s\n", gone[i],
+				    sqlite3_errmsg(handle));
+			mfs_db_release(st);
 		}
-		sqlite3_bind_text(st, 1, artist, -1, SQLITE_STATIC);
-		ret = sqlite3_step(st);
-		sqlite3_finalize(st);
-		if (ret != SQLITE_DONE) {
-			DEBUG("Error inserting into database: %s\n",
+		free(gone[i]);
+	}
+	free(gone);
+	if (mfs_db_prepare(handle, "INSERT OR REPLACE INTO scan_dir(path, "
+	    "dirpath, generation) VALUES(?, ?, ?)", &st) == SQLITE_OK) {
+		sqlite3_bind_text(st, 1, scan_root, -1, SQLITE_STATIC);
+		sqlite3_bind_text(st, 2, dirpath, -1, SQLITE_STATIC);
+		sqlite3_bind_int(st, 3, scan_generation);
+		if (sqlite3_step(st) != SQLITE_DONE)
+			DEBUG("Error recording %s: %s\n", dirpath,
 			    sqlite3_errmsg(handle));
-			break;
+		mfs_db_release(st);
+	}
+	pthread_mutex_unlock(&scanlock);
+}
+
+/*
+ * Keep the songs at and below a path that the scan could not read when it
+ * completes. If that can't be remembered, the scan is not completed, and
+ * is resumed the next time.
+ */
+void
+mfs_scan_keep(const char *path)
+{
+	char **tmp;
+	int max;
+
+	DEBUG("keeping the songs below %s\n", path);
+	pthread_mutex_lock(&scanlock);
+	if (scan_nkeep == scan_maxkeep) {
+		max = scan_maxkeep > 0 ? scan_maxkeep * 2 : 16;
+		tmp = realloc(scan_keep, max * sizeof(char *));
+		if (tmp != NULL) {
+			scan_keep = tmp;
+			scan_maxkeep = max;
 		}
-	} while (0);
+	}
+	if (scan_nkeep < scan_maxkeep &&
+	    (scan_keep[scan_nkeep] = strdup(path)) != NULL)
+		scan_nkeep++;
+	else
+		scan_lost = 1;
+	pthread_mutex_unlock(&scanlock);
+}
 
-	/* Insert genre if it doesn't exist. */
-	do {
-		genre = taglib_tag_genre(tag);
-		if (mfs_empty(genre))
-			break;
-		/* First find out if it exists. */
-		ret = sqlite3_prepare_v2(handle, "SELECT * FROM genre WHERE "
-		    "name=?", -1, &st, NULL);
-		if (ret != SQLITE_OK) {
-			DEBUG("Error preparing statement: %s\n",
+/*
+ * Finish the scan of a music path: remove the songs it did not see, and
+ * forget the journal. The songs it did not write are gone, or in a
+ * directory the scan did not finish, which is found by taking the file
+ * name off the path. The songs it kept are stamped with its generation
+ * first, unless they were found to be gone.
+ */
+void
+mfs_scan_finish(const char *root)
+{
+	sqlite3 *handle;
+	sqlite3_stmt *st;
+	int i;
+
+	if (mfs_db_get(db_path, &handle) != SQLITE_OK)
+		return;
+	pthread_mutex_lock(&scanlock);
+	mfs_scan_txn_commit(handle);
+	if (scan_lost) {
+		DEBUG("not completing the scan of %s\n", root);
+		mfs_scan_keep_clear();
+		pthread_mutex_unlock(&scanlock);
+		return;
+	}
+	mfs_db_exec(handle, "BEGIN");
+	for (i = 0; i < scan_nkeep; i++) {
+		if (mfs_db_prepare(handle, "UPDATE song SET generation = ?2 "
+		    "WHERE (filepath = ?1 OR (filepath >= RTRIM(?1, '/')||'/' "
+		    "AND filepath < RTRIM(?1, '/')||'0')) AND generation < ?2 "
+		    "AND generation != ?3", &st) != SQLITE_OK)
+			continue;
+		sqlite3_bind_text(st, 1, scan_keep[i], -1, SQLITE_STATIC);
+		sqlite3_bind_int(st, 2, scan_generation);
+		sqlite3_bind_int(st, 3, MFS_SCAN_GONE);
+		if (sqlite3_step(st) != SQLITE_DONE)
+			DEBUG("Error keeping %s: %s\n", scan_keep[i],
 			    sqlite3_errmsg(handle));
-			break;
-		}
-		sqlite3_bind_text(st, 1, genre, -1, SQLITE_STATIC);
-		ret = sqlite3_step(st);
-		sqlite3_finalize(st);
-		/* Already exists or generic error. */
-		if (ret != SQLITE_DONE)
-			break;
-		/* Doesn't exist, so we can insert it. */
-		ret = sqlite3_prepare_v2(handle, "INSERT INTO genre(name) "
-		    "VALUES(?)", -1, &st, NULL);
-		if (ret != SQLITE_OK) {
-			DEBUG("Error preparing statement: %s\n",
+		mfs_db_release(st);
+	}
+	/* A range on the filepath index rather than a LIKE prefix. */
+	if (mfs_db_prepare(handle, "DELETE FROM song WHERE "
+	    "filepath >= RTRIM(?1, '/')||'/' AND "
+	    "filepath < RTRIM(?1, '/')||'0' AND generation < ?2 AND "
+	    "(generation = ?3 OR NOT EXISTS (SELECT 1 FROM scan_dir WHERE "
+	    "path = ?1 AND generation = ?2 AND dirpath = "
+	    "substr(filepath, 1, length(rtrim(filepath, "
+	    "replace(filepath, '/', ''))) - 1)))",
+	    &st) == SQLITE_OK) {
+		sqlite3_bind_text(st, 1, root, -1, SQLITE_STATIC);
+		sqlite3_bind_int(st, 2, scan_generation);
+		sqlite3_bind_int(st, 3, MFS_SCAN_GONE);
+		if (sqlite3_step(st) != SQLITE_DONE)
+			DEBUG("Error removing old songs: %s\n",
 			    sqlite3_errmsg(handle));
-			break;
-		}
-		sqlite3_bind_text(st, 1, genre, -1, SQLITE_STATIC);
-		ret = sqlite3_step(st);
-		sqlite3_finalize(st);
-		if (ret != SQLITE_DONE) {
-			DEBUG("Error inserting into database: %s\n",
+		else
+			DEBUG("removed %d songs that are gone\n",
+			    sqlite3_changes(handle));
+		mfs_db_release(st);
+	}
+	if (mfs_db_prepare(handle, "UPDATE scan SET complete = 1 "
+	    "WHERE path = ?", &st) == SQLITE_OK) {
+		sqlite3_bind_text(st, 1, root, -1, SQLITE_STATIC);
+		sqlite3_step(st);
+		mfs_db_release(st);
+	}
+	if (mfs_db_prepare(handle, "DELETE FROM scan_dir WHERE path = ?",
+	    &st) == SQLITE_OK) {
+		sqlite3_bind_text(st, 1, root, -1, SQLITE_STATIC);
+		sqlite3_step(st);
+		mfs_db_release(st);
+	}
+	if (mfs_db_exec(handle, "COMMIT") != 0)
+		mfs_db_exec(handle, "ROLLBACK");
+	scan_resumed = 0;
+	mfs_scan_keep_clear();
+	pthread_mutex_unlock(&scanlock);
+}
+
+/*
+ * Point the song of a file that was moved to its new path, without reading
+ * the file again.
+ */
+void
+mfs_scan_move(const char *from, const char *to, const struct stat *fstat)
+{
+	sqlite3 *handle;
+	sqlite3_stmt *st;
+
+	DEBUG("%s was moved to %s\n", from, to);
+	if (mfs_db_get(db_path, &handle) != SQLITE_OK)
+		return;
+	pthread_mutex_lock(&scanlock);
+	mfs_scan_txn_begin(handle);
+	if (mfs_db_prepare(handle, "UPDATE song SET filepath = ?, "
+	    "generation = ? WHERE filepath = ? AND ino = ? AND dev = ?", &st) ==
+	    SQLITE_OK) {
+		sqlite3_bind_text(st, 1, to, -1, SQLITE_STATIC);
+		sqlite3_bind_int(st, 2, scan_generation);
+		sqlite3_bind_text(st, 3, from, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(st, 4, (sqlite3_int64)fstat->st_ino);
+		sqlite3_bind_int64(st, 5, (sqlite3_int64)fstat->st_dev);
+		if (sqlite3_step(st) != SQLITE_DONE)
+			DEBUG("Error moving %s: %s\n", from,
 			    sqlite3_errmsg(handle));
-			break;
+		mfs_db_release(st);
+	} else
+		DEBUG("Error preparing statement: %s\n",
+		    sqlite3_errmsg(handle));
+	mfs_scan_txn_count(handle);
+	pthread_mutex_unlock(&scanlock);
+	mfs_scan_refresh();
+}
+
+/*
+ * Remove the songs of a file, or of all files below a directory, that is
+ * gone. Returns how many songs were removed.
+ */
+int
+mfs_scan_remove(const char *path)
+{
+	sqlite3 *handle;
+	sqlite3_stmt *st;
+	int removed;
+
+	removed = 0;
+	if (mfs_db_get(db_path, &handle) != SQLITE_OK)
+		return (0);
+	pthread_mutex_lock(&scanlock);
+	mfs_scan_txn_begin(handle);
+	if (mfs_db_prepare(handle, "DELETE FROM song WHERE filepath = ?",
+	    &st) == SQLITE_OK) {
+		sqlite3_bind_text(st, 1, path, -1, SQLITE_STATIC);
+		if (sqlite3_step(st) == SQLITE_DONE)
+			removed += sqlite3_changes(handle);
+		mfs_db_release(st);
+	}
+	if (mfs_db_prepare(handle, "DELETE FROM song WHERE "
+	    "filepath >= RTRIM(?1, '/')||'/' AND "
+	    "filepath < RTRIM(?1, '/')||'0'", &st) == SQLITE_OK) {
+		sqlite3_bind_text(st, 1, path, -1, SQLITE_STATIC);
+		if (sqlite3_step(st) == SQLITE_DONE)
+			removed += sqlite3_changes(handle);
+		mfs_db_release(st);
+	}
+	mfs_scan_txn_count(handle);
+	pthread_mutex_unlock(&scanlock);
+	mfs_scan_refresh();
+	if (removed > 0)
+		DEBUG("removed %d songs below %s\n", removed, path);
+	return (removed);
+}
+
+/*
+ * Remove the songs below a directory whose files are gone. Returns how
+ * many songs were removed.
+ */
+int
+mfs_scan_prune(const char *dirpath)
+{
+	struct stat fstat;
+	sqlite3 *handle;
+	sqlite3_stmt *st;
+	char **paths, **tmp;
+	int i, n, max, removed;
+
+	paths = NULL;
+	n = max = 0;
+	if (mfs_db_get(db_path, &handle) != SQLITE_OK)
+		return (0);
+	pthread_mutex_lock(&scanlock);
+	if (mfs_db_prepare(handle, "SELECT filepath FROM song WHERE "
+	    "filepath >= RTRIM(?1, '/')||'/' AND "
+	    "filepath < RTRIM(?1, '/')||'0'", &st) == SQLITE_OK) {
+		sqlite3_bind_text(st, 1, dirpath, -1, SQLITE_STATIC);
+		while (sqlite3_step(st) == SQLITE_ROW) {
+			if (n == max) {
+				max = max > 0 ? max * 2 : 64;
+				tmp = realloc(paths, max * sizeof(char *));
+				if (tmp == NULL)
+					break;
+				paths = tmp;
+			}
+			paths[n] = strdup((const char *)
+			    sqlite3_column_text(st, 0));
+			if (paths[n] != NULL)
+				n++;
 		}
-	} while (0);
+		mfs_db_release(st);
+	}
+	pthread_mutex_unlock(&scanlock);
+
+	removed = 0;
+	for (i = 0; i < n; i++) {
+		if (stat(paths[i], &fstat) < 0 && errno == ENOENT)
+			removed += mfs_scan_remove(paths[i]);
+		free(paths[i]);
+	}
+	free(paths);
+	return (removed);
+}
+
+/* Hooks for walking a directory that changed. */
+static void *
+mfs_update_enter(const char *dirpath)
+{
+
+	mfs_watch_dir(dirpath);
+	/* Any cookie but NULL has the files looked at. */
+	return ((void *)dirpath);
+}
+
+static void
+mfs_update_file(void *cookie, const char *filepath)
+{
+
+	mfs_scan(filepath);
+}
+
+static void
+mfs_update_leave(void *cookie)
+{
+}
+
+static const struct mfs_scanops mfs_update_ops = {
+	.so_enter = mfs_update_enter,
+	.so_file = mfs_update_file,
+	.so_leave = mfs_update_leave,
+	.so_cancelled = mfs_scanctl_cancelled,
+};
+
+/*
+ * Bring the songs of some paths up to date after they changed on disk,
+ * without scanning the music paths. Paths that still exist are looked at
+ * first, so that files which were moved are found under their new path
+ * before the old one is forgotten.
+ */
+void
+mfs_update_paths(char **paths, int n)
+{
+	struct stat fstat;
+	sqlite3 *handle;
+	int i, removed;
+
+	if (mfs_db_get(db_path, &handle) != SQLITE_OK)
+		return;
+	mfs_catalog_invalidate();
+	/* A burst of changes is written in one transaction. */
+	pthread_mutex_lock(&scanlock);
+	scan_burst = 1;
+	pthread_mutex_unlock(&scanlock);
+	removed = 0;
+	for (i = 0; i < n; i++) {
+		if (stat(paths[i], &fstat) < 0)
+			continue;
+		if (S_ISDIR(fstat.st_mode)) {
+			mfs_scanner_walk(paths[i], &mfs_update_ops, 1);
+			removed += mfs_scan_prune(paths[i]);
+		} else if (S_ISREG(fstat.st_mode))
+			mfs_scan(paths[i]);
+	}
+	for (i = 0; i < n; i++) {
+		if (stat(paths[i], &fstat) == 0 || errno != ENOENT)
+			continue;
+		mfs_watch_forget(paths[i]);
+		removed += mfs_scan_remove(paths[i]);
+	}
+
+	/* Artists and genres may have lost their last song. */
+	if (removed > 0) {
+		cleanup_albums(handle);
+		cleanup_artists(handle);
+		cleanup_genres(handle);
+	}
+	pthread_mutex_lock(&scanlock);
+	scan_burst = 0;
+	pthread_mutex_unlock(&scanlock);
+	mfs_scan_flush();
+	mfs_catalog_load();
+}
+
+/* Scan the music initially. */
+void
+mfs_scan(const char *filepath)
+{
+	struct mfs_tags tags;
+	struct stat fstat;
+	char *from;
+	int error, state;
+
+	if (stat(filepath, &fstat) < 0) {
+		error = errno;
+		DEBUG("Error getting file info: %s\n", strerror(error));
+		/* It may well be there still. */
+		if (error != ENOENT)
+			mfs_scan_keep(filepath);
+		return;
+	}
+
+	/* Don't bother parsing files that haven't changed since last time. */
+	state = MFS_SCAN_NEW;
+	if (!mfs_opts.full_rescan) {
+		state = mfs_scan_check(filepath, &fstat, &from);
+		if (state == MFS_SCAN_UNCHANGED || state == MFS_SCAN_NOID) {
+			mfs_scan_store(filepath, &fstat, NULL, state);
+			return;
+		}
+		if (state == MFS_SCAN_MOVED) {
+			mfs_scan_move(from, filepath, &fstat);
+			free(from);
+			return;
+		}
+	}
+
+	/*
+	 * Read all the tags before taking the lock, so that parsing can
+	 * happen in parallel when the scanner runs several threads.
+	 */
+	if (mfs_tags_get(filepath, fstat.st_size, &tags) != MFS_TAGS_OK) {
+		/* The old song is stale either way. */
+		if (state == MFS_SCAN_CHANGED)
+			mfs_scan_store(filepath, &fstat, NULL, state);
+		return;
+	}
+	mfs_scan_store(filepath, &fstat, &tags, state);
+	mfs_tags_free(&tags);
+}
+
+/*
+ * Run a query taking a name as ?1, and possibly the id and name of its
+ * parent as ?2 and ?3. Returns the integer in the first row, if any.
+ */
+static sqlite3_int64
+mfs_scan_id_query(sqlite3 *handle, const char *query, const char *name,
+    sqlite3_int64 parent, const char *parentname)
+{
+	sqlite3_stmt *st;
+	sqlite3_int64 id;
+	int n, ret;
+
+	if (mfs_db_prepare(handle, query, &st) != SQLITE_OK) {
+		DEBUG("Error preparing statement: %s\n",
+		    sqlite3_errmsg(handle));
+		return (0);
+	}
+	n = sqlite3_bind_parameter_count(st);
+	sqlite3_bind_text(st, 1, name, -1, SQLITE_STATIC);
+	if (n >= 2)
+		sqlite3_bind_int64(st, 2, parent);
+	if (n >= 3)
+		sqlite3_bind_text(st, 3, parentname, -1, SQLITE_STATIC);
+	id = 0;
+	ret = sqlite3_step(st);
+	if (ret == SQLITE_ROW)
+		id = sqlite3_column_int64(st, 0);
+	else if (ret != SQLITE_DONE)
+		DEBUG("Error executing %s: %s\n", query,
+		    sqlite3_errmsg(handle));
+	mfs_db_release(st);
+	return (id);
+}
+
+/*
+ * Get the id of the row found by a query, adding the row if there is
+ * none. Returns 0 on errors. Called with scanlock held.
+ */
+static sqlite3_int64
+mfs_scan_id(sqlite3 *handle, const char *find, const char *add,
+    const char *name, sqlite3_int64 parent, const char *parentname)
+{
+	sqlite3_int64 id;
+
+	id = mfs_scan_id_query(handle, find, name, parent, parentname);
+	if (id == 0) {
+		mfs_scan_id_query(handle, add, name, parent, parentname);
+		id = mfs_scan_id_query(handle, find, name, parent,
+		    parentname);
+	}
+	return (id);
+}
+
+/*
+ * Write the tags of a scanned file to the database. The state is what
+ * mfs_scan_check() said about the file, and a changed file has its old
+ * song replaced. Without tags, the song of a changed file is removed, and
+ * the song of an unchanged one is marked as seen by this scan.
+ */
+void
+mfs_scan_store(const char *filepath, const struct stat *fstat,
+    struct mfs_tags *tags, int state)
+{
+	char *artist, *album, *genre, *title, *trackno;
+	const char *extension;
+	sqlite3_int64 artistid, albumid, genreid;
+	int ret;
+	unsigned int track, year;
+	sqlite3 *handle;
+	sqlite3_stmt *st;
+
+	if (tags == NULL && state == MFS_SCAN_NEW)
+		return;
+	if (mfs_db_get(db_path, &handle) != SQLITE_OK)
+		return;
+	if (tags == NULL) {
+		pthread_mutex_lock(&scanlock);
+		mfs_scan_txn_begin(handle);
+		if (state == MFS_SCAN_CHANGED)
+			mfs_scan_forget(handle, filepath);
+		else
+			mfs_scan_touch(handle, filepath, fstat);
+		mfs_scan_txn_count(handle);
+		pthread_mutex_unlock(&scanlock);
+		mfs_scan_refresh();
+		return;
+	}
+	artist = tags->artist;
+	genre = (tags->genre != NULL) ? tags->genre : "";
+	title = tags->title;
+	album = tags->album;
+	track = tags->track;
+	year = tags->year;
+
+	/* XXX: The main query code should perhaps be a bit generalized. */
+	pthread_mutex_lock(&scanlock);
+	mfs_scan_txn_begin(handle);
+	if (state == MFS_SCAN_CHANGED)
+		mfs_scan_forget(handle, filepath);
 
-	
-	/* Finally, insert song. */
 	do {
-		title = taglib_tag_title(tag);
-		album = taglib_tag_album(tag);
-		track = taglib_tag_track(tag);
-		year = taglib_tag_year(tag);
 		extension = strrchr(filepath, (int)'.');
 		if (extension == NULL)
 			extension = "";
@@ -412,47 +1238,75 @@ mfs_scan(const char *filepath)
 		if (mfs_empty(title) || mfs_empty(artist) || mfs_empty(album))
 			break;
 
-		/* First find out if it exists. */
-		ret = sqlite3_prepare_v2(handle, "SELECT * FROM song, artist "
-		    " WHERE artist.name=song.artistname AND title=? AND year=?"
-		    " AND song.album=?",
-		    -1, &st, NULL);
-		if (ret != SQLITE_OK) {
-			DEBUG("Error preparing statement: %s\n",
-			    sqlite3_errmsg(handle));
-			break;
-		}
-		sqlite3_bind_text(st, 1, title, -1, SQLITE_STATIC);
-		sqlite3_bind_int(st, 2, year);
-		sqlite3_bind_text(st, 3, album, -1, SQLITE_STATIC);
-		ret = sqlite3_step(st);
-		sqlite3_finalize(st);
-		if (ret == SQLITE_ROW)
-			/* Already exists. XXX: Update it if mtime mismatches */
+		/* Find the artist, album and genre, adding them if new. */
+		artistid = mfs_scan_id(handle, "SELECT id FROM artist WHERE name = ?1",
+		    "INSERT INTO artist(name, namekey) "
+		    "VALUES(?1, mfs_key(?1))", artist, 0, NULL);
+		if (artistid == 0)
 			break;
-		if (ret != SQLITE_DONE)
-			/* SQL Error. */
+		/*
+		 * An album gets the artist in its name under /Albums if
+		 * another album has its title already.
+		 */
+		albumid = mfs_scan_id(handle, "SELECT id FROM album "
+		    "WHERE artistid = ?2 AND title = ?1",
+		    "INSERT INTO album(artistid, title, titlekey, dirname, "
+		    "dirkey) SELECT ?2, ?1, mfs_key(?1), dirname, "
+		    "mfs_key(dirname) FROM (SELECT CASE WHEN EXISTS "
+		    "(SELECT 1 FROM album WHERE dirkey = mfs_key(?1)) "
+		    "THEN ?1||' ('||?3||')' ELSE ?1 END AS dirname)",
+		    album, artistid, artist);
+		if (albumid == 0)
 			break;
-		/* Now, finally insert it. */
-		ret = sqlite3_prepare_v2(handle, "INSERT INTO song(title, "
-		    "artistname, album, genrename, year, track, filepath, "
-		    "mtime, extension) VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?)",
-		    -1, &st, NULL);
+		genreid = 0;
+		if (!mfs_empty(genre)) {
+			genreid = mfs_scan_id(handle, "SELECT id FROM genre "
+			    "WHERE name = ?1", "INSERT INTO genre(name, namekey) "
+			    "VALUES(?1, mfs_key(?1))", genre, 0, NULL);
+		}
+
+		/*
+		 * If the song is already known, it is the same song in
+		 * another file, or it has been moved. Either way, point it
+		 * to the file we just scanned.
+		 */
+		ret = mfs_db_prepare(handle, "INSERT INTO song(title, "
+		    "albumid, genreid, year, track, filepath, mtime, "
+		    "extension, size, generation, dev, ino, entryname, "
+		    "trackname, entrykey, trackkey) "
+		    "VALUES(?1, ?2, ?3, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, "
+		    "?13, LTRIM(?6||' ')||?1||'.'||?9, ?4||' - '||?1||'.'||?9, "
+		    "mfs_key(LTRIM(?6||' ')||?1||'.'||?9), "
+		    "mfs_key(?4||' - '||?1||'.'||?9)) "
+		    "ON CONFLICT(albumid, title, year) DO UPDATE SET "
+		    "genreid = excluded.genreid, track = excluded.track, "
+		    "filepath = excluded.filepath, mtime = excluded.mtime, "
+		    "extension = excluded.extension, size = excluded.size, "
+		    "generation = excluded.generation, dev = excluded.dev, "
+		    "ino = excluded.ino, entryname = excluded.entryname, "
+		    "trackname = excluded.trackname, "
+		    "entrykey = excluded.entrykey, trackkey = excluded.trackkey",
+		    &st);
 		if (ret != SQLITE_OK) {
 			DEBUG("Error preparing insert statement: %s\n",
 			    sqlite3_errmsg(handle));
 			break;
 		}
 		sqlite3_bind_text(st, 1, title, -1, SQLITE_STATIC);
-		sqlite3_bind_text(st, 2, artist, -1, SQLITE_STATIC);
-		sqlite3_bind_text(st, 3, album, -1, SQLITE_STATIC);
-		sqlite3_bind_text(st, 4, genre, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(st, 2, albumid);
+		if (genreid != 0)
+			sqlite3_bind_int64(st, 3, genreid);
+		else
+			sqlite3_bind_null(st, 3);
+		sqlite3_bind_text(st, 4, artist, -1, SQLITE_STATIC);
 		sqlite3_bind_int(st, 5, year);
 
 		if (track) {
 			asprintf(&trackno, "%02d", track);
-			if (mfs_empty(trackno))
+			if (mfs_empty(trackno)) {
+				mfs_db_release(st);
 				break;
+			}
 			sqlite3_bind_text(st, 6, trackno, -1, SQLITE_TRANSIENT);
 			free(trackno);
 		} else {
@@ -460,18 +1314,40 @@ mfs_scan(const char *filepath)
 		}
 
 		sqlite3_bind_text(st, 7, filepath, -1, SQLITE_STATIC);
-		sqlite3_bind_int(st, 8, fstat.st_mtime);
+		sqlite3_bind_int(st, 8, fstat->st_mtime);
 		sqlite3_bind_text(st, 9, extension, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(st, 10, (sqlite3_int64)fstat->st_size);
+		sqlite3_bind_int(st, 11, scan_generation);
+		sqlite3_bind_int64(st, 12, (sqlite3_int64)fstat->st_dev);
+		sqlite3_bind_int64(st, 13, (sqlite3_int64)fstat->st_ino);
 		ret = sqlite3_step(st);
-		sqlite3_finalize(st);
+		mfs_db_release(st);
 		if (ret != SQLITE_DONE) {
 			DEBUG("Error inserting into database: %s\n",
 			    sqlite3_errmsg(handle));
 			break;
 		}
 	} while (0);
-	taglib_tag_free_strings();
-	taglib_file_free(file);
+
+	mfs_scan_txn_count(handle);
+	pthread_mutex_unlock(&scanlock);
+	mfs_scan_refresh();
+}
+
+/*
+ * Commit whatever the scan has not committed yet.
+ */
+void
+mfs_scan_flush()
+{
+	sqlite3 *handle;
+
+	if (mfs_db_get(db_path, &handle) != SQLITE_OK)
+		return;
+	pthread_mutex_lock(&scanlock);
+	mfs_scan_txn_commit(handle);
+	pthread_mutex_unlock(&scanlock);
+	mfs_scan_refresh();
 }
 
 /*
@@ -490,11 +1366,9 @@ mfs_lookup_start(int field, void *data, lookup_fn_t *fn, const char *query)
 	lh->field = field;
 	lh->lookup = fn;
 
-	/* Open database. */
-	error = sqlite3_open(db_path, &lh->handle);
+	/* The connection of this thread, opened once. */
+	error = mfs_db_get(db_path, &lh->handle);
 	if (error) {
-		DEBUG("Can't open database: %s\n", sqlite3_errmsg(lh->handle));
-		sqlite3_close(lh->handle);
 		free(lh);
 		return (NULL);
 	}
@@ -505,11 +1379,11 @@ mfs_lookup_start(int field, void *data, lookup_fn_t *fn, const char *query)
 	else
 		lh->priv = data;
 
-	ret = sqlite3_prepare_v2(lh->handle, query, -1, &lh->st, NULL);
+	ret = mfs_db_prepare(lh->handle, query, &lh->st);
 	if (ret != SQLITE_OK) {
-		free(lh);
 		DEBUG("Error preparing statement: %s\n",
-		    sqlite3_errmsg(handle));
+		    sqlite3_errmsg(lh->handle));
+		free(lh);
 		return (NULL);
 	}
 	lh->query = query;
@@ -611,409 +1485,62 @@ mfs_lookup_finish(struct lookuphandle *lh)
 		ret = sqlite3_step(lh->st);
 	}
 	// XXX: Check for errors too.
-	sqlite3_finalize(lh->st);
-	sqlite3_close(lh->handle);
+	mfs_db_release(lh->st);
 	free(lh);
 }
 
 /*
- * Return the realpath given a path in the musicfs tree.
- *
- * Returns pointer to real path or NULL if not found.
- */
-int 
-mfs_realpath(const char *path, char **realpath) {
-	DEBUG("getting real path for %s\n", path);
-	struct lookuphandle *lh;
-	char *genre, *artist, *album, *title;
-	int error;
-
-	lh = NULL;
-	error = 0;
-
-	/* Open a specific track. */
-	MFS_DB_LOCK();
-	if (strncmp(path, "/Tracks", 7) == 0) {
-		switch (mfs_numtoken(path)) {
-		case 2:
-			title = mfs_gettoken(path, 2);
-			if (title == NULL) {
-				error = -ENOENT;
-				break;
-			}
-			lh = mfs_lookup_start(0, realpath, mfs_lookup_path,
-			    "SELECT filepath FROM song "
-			    "WHERE (artistname||' - '||title||'.'||extension) LIKE ?");
-			if (lh == NULL) {
-				error = -EIO;
-				break;
-			}
-			mfs_lookup_insert(lh, title, LIST_DATATYPE_STRING);
-			break;
-		default:
-			error = -ENOENT;
-		}
-	} else if (strncmp(path, "/Albums", 7) == 0) {
-		switch (mfs_numtoken(path)) {
-		case 3:
-			album = mfs_gettoken(path, 2);
-			error = -ENOENT;
-			if (album == NULL)
-				break;
-			title = mfs_gettoken(path, 3);
-			if (title == NULL)
-				break;
-			error = 0;
-			lh = mfs_lookup_start(0, realpath, mfs_lookup_path,
-			    "SELECT filepath FROM song WHERE "
-			    "LTRIM(track||' ')||title||'.'||extension LIKE ? "
-			    "AND album LIKE ?");
-			if (lh == NULL) {
-				error = -EIO;
-				break;
-			}
-			mfs_lookup_insert(lh, title, LIST_DATATYPE_STRING);
-			mfs_lookup_insert(lh, album, LIST_DATATYPE_STRING);
-			break;
-		default:
-			error = -ENOENT;
-		}
-	} else if (strncmp(path, "/Artists", 8) == 0) {
-		switch (mfs_numtoken(path)) {
-		case 4:
-			artist = mfs_gettoken(path, 2);
-			album  = mfs_gettoken(path, 3);
-			title  = mfs_gettoken(path, 4);
-			DEBUG("artist(%s) album(%s) title(%s)\n", artist, album, title);
-			if (!(artist && album && title)) {
-				error = -ENOENT;
-				break;
-			}
-			lh = mfs_lookup_start(0, realpath, mfs_lookup_path,
-			    "SELECT filepath FROM song WHERE artistname LIKE ? AND "
-			    "album LIKE ? AND "
-			    "(LTRIM(track||' ')||title||'.'||extension) LIKE ?");
-			if (lh == NULL) {
-				error = -EIO;
-				break;
-			}
-			mfs_lookup_insert(lh, artist, LIST_DATATYPE_STRING);
-			mfs_lookup_insert(lh, album, LIST_DATATYPE_STRING);
-			mfs_lookup_insert(lh, title, LIST_DATATYPE_STRING);
-			break;
-		default:
-			error = -ENOENT;
-		}
-	} else if (strncmp(path, "/Genres", 7) == 0) {
-		switch (mfs_numtoken(path)) {
-		case 4:
-			genre = mfs_gettoken(path, 2);
-			album = mfs_gettoken(path, 3);
-			title = mfs_gettoken(path, 4);
-			DEBUG("genre(%s) album(%s) title(%s)\n", genre, album,
-			    title);
-			if (!(genre && album && title)) {
-				error = -ENOENT;
-				break;
-			}
-			lh = mfs_lookup_start(0, realpath, mfs_lookup_path,
-			    "SELECT filepath FROM song WHERE genrename LIKE ? "
-			    "AND album LIKE ? AND "
-			    "(LTRIM(track||' ')||title||'.'||extension) "
-			    "LIKE ?");
-			if (lh == NULL) {
-				error = -EIO;
-				break;
-			}
-			mfs_lookup_insert(lh, genre, LIST_DATATYPE_STRING);
-			mfs_lookup_insert(lh, album, LIST_DATATYPE_STRING);
-			mfs_lookup_insert(lh, title, LIST_DATATYPE_STRING);
-			break;
-		default:
-			error = -ENOENT;
-		}
-	}
-
-	if (lh) {
-		mfs_lookup_finish(lh);
-	}
-
-	MFS_DB_UNLOCK();
-	if (error != 0)
-		return (error);
-	if (*realpath == NULL)
-		return (-ENOMEM);
-	return 0;
-}
-
-/*
- * Count number of tokens in pathname.
- * XXX: should we strip the first and last?
+ * Return the real path of a file in the musicfs tree, allocated with
+ * malloc.
  */
 int
-mfs_numtoken(const char *str)
-{
-	const char *ptr;
-	int num;
-
-	num = 0;
-	ptr = str;
-	if (*ptr == '/')
-		ptr++;
-	while ((*ptr != '\0')) {
-		if (*ptr++ == '/')
-			num++;
-	}
-	if (*(ptr - 1) == '/')
-		num--;
-	return (num + 1);
-}
-
-/*
- * Extract token number toknum and return it in escaped form.
- */
-char *
-mfs_gettoken(const char *str, int toknum)
-{
-	const char *ptr, *start, *end;
-	char *ret, *dest;
-	int numescape;
-	int i;
-	size_t size;
-
-	start = str;
-	/* Find the token start. */
-	for (i = 0; i < toknum; i++) {
-		start = strchr(start, '/');
-		if (start == NULL)
-			return (NULL);
-		start++;
-	}
-	/* Find the end pointer. */
-	end = strchr(start, '/');
-	if (end == NULL)
-		end = strchr(start, '\0');
-	/* 
-	 * Count how many bytes extra to take into account because of escaping.
-	 */
-	numescape = 0;
-	ptr = start;
-	while ((ptr = strchr(ptr, '\'')) != NULL && ptr < end) {
-		ptr++;
-		numescape++;
-	}
-	size = (end - start) + numescape;
-	ret = malloc(size + 1);
-	if (ret == NULL)
-		return (ret);
-	ptr = start;
-	dest = ret;
-	while (ptr < end) {
-		if (*ptr == '\'')
-			*dest++ = '\\';
-		*dest++ = *ptr++;
-	}
-	ret[size] = '\0';
-	return (ret);
-}
-
-/*
- * List album given a path.
- */
-void
-mfs_lookup_album(const char *path, struct filler_data *fd)
-{
-	struct lookuphandle *lh;
-	char *album;
-
-	switch (mfs_numtoken(path)) {
-	case 1:
-		lh = mfs_lookup_start(0, fd, mfs_lookup_list,
-		    "SELECT DISTINCT album FROM song");
-		break;
-	case 2:
-		/* So, now we got to find out the artist and list its albums. */
-		album = mfs_gettoken(path, 2);
-		if (album == NULL)
-			break;
-		lh  = mfs_lookup_start(0, fd, mfs_lookup_list,
-		    "SELECT DISTINCT LTRIM(track||' ')||title||'.'||extension "
-		    "FROM song WHERE album LIKE ?");
-		mfs_lookup_insert(lh, album, LIST_DATATYPE_STRING);
-		break;
-	}
-	mfs_lookup_finish(lh);
-}
-
-/*
- * List artist given a path.
- */
-void
-mfs_lookup_artist(const char *path, struct filler_data *fd)
-{
-	struct lookuphandle *lh;
-	char *name, *album;
-
-	switch (mfs_numtoken(path)) {
-	case 1:
-		lh = mfs_lookup_start(0, fd, mfs_lookup_list,
-		    "SELECT name FROM artist");
-		break;
-	case 2:
-		/* So, now we got to find out the artist and list its albums. */
-		name = mfs_gettoken(path, 2);
-		if (name == NULL)
-			break;
-		lh  = mfs_lookup_start(0, fd, mfs_lookup_list,
-		    "SELECT DISTINCT album FROM song, "
-		    "artist WHERE song.artistname = artist.name AND artist.name"
-		    " LIKE ?");
-		mfs_lookup_insert(lh, name, LIST_DATATYPE_STRING);
-		break;
-	case 3:
-		/* List songs in an album. */
-		name = mfs_gettoken(path, 2);
-		if (name == NULL)
-			break;
-		album = mfs_gettoken(path, 3);
-		if (album == NULL)
-			break;
-		lh = mfs_lookup_start(0, fd, mfs_lookup_list,
-		    "SELECT LTRIM(track||' ')||title||'.'||extension "
-		    "FROM song, artist "
-		    "WHERE song.artistname = artist.name AND artist.name "
-		    "LIKE ? AND song.album LIKE ?");
-		mfs_lookup_insert(lh, name, LIST_DATATYPE_STRING);
-		mfs_lookup_insert(lh, album, LIST_DATATYPE_STRING);
-		break;
-	}
-	mfs_lookup_finish(lh);
-}
-
-/*
- * Looks up tracks given a genre, or all genres.
- */
-void
-mfs_lookup_genre(const char *path, struct filler_data *fd)
+mfs_realpath(const char *path, char **realpath)
 {
-	struct lookuphandle *lh;
-	char *genre, *album;
+	struct mfs_catalog *cat;
+	uint32_t node;
+	int error;
 
-	switch (mfs_numtoken(path)) {
-	case 1:
-		lh = mfs_lookup_start(0, fd, mfs_lookup_list,
-		    "SELECT name FROM genre");
-		break;
-	case 2:
-		genre = mfs_gettoken(path, 2);
-		if (genre == NULL)
-			break;
-		lh = mfs_lookup_start(0, fd, mfs_lookup_list,
-		    "SELECT DISTINCT album FROM song, "
-		    "genre WHERE song.genrename = genre.name AND genre.name "
-		    "LIKE ?");
-		mfs_lookup_insert(lh, genre, LIST_DATATYPE_STRING);
-		break;
-	case 3:
-		genre = mfs_gettoken(path, 2);
-		if (genre == NULL)
-			break;
-		album = mfs_gettoken(path, 3);
-		if (album == NULL)
-			break;
-		lh = mfs_lookup_start(0, fd, mfs_lookup_list,
-		    "SELECT LTRIM(track||' ')||title||'.'||extension FROM "
-		    "song, genre WHERE "
-		    "song.genrename = genre.name AND genre.name LIKE ? "
-		    "AND song.album LIKE ?");
-		mfs_lookup_insert(lh, genre, LIST_DATATYPE_STRING);
-		mfs_lookup_insert(lh, album, LIST_DATATYPE_STRING);
-		break;
-	}
-	mfs_lookup_finish(lh);
+	DEBUG("getting real path for %s\n", path);
+	*realpath = NULL;
+	error = 0;
+	cat = mfs_catalog_get();
+	node = mfs_catalog_resolve(cat, path);
+	if (node == MFS_CATALOG_NONE || mfs_catalog_isdir(cat, node))
+		error = -ENOENT;
+	else if ((*realpath = strdup(mfs_catalog_file(cat, node, NULL,
+	    NULL))) == NULL)
+		error = -ENOMEM;
+	mfs_catalog_put(cat);
+	return (error);
 }
 
 /*
- * Lookup function for filling given data into a filler.
+ * Load a path into database
  */
 int
-mfs_lookup_list(void *data, const char *str)
+mfs_lookup_load_path(void *data, const char *str)
 {
-	struct filler_data *fd;
-
-	fd = (struct filler_data *)data;
-	fd->filler(fd->buf, str, NULL, 0);
-	return (0);
-}
+	int expected;
 
-/*
- * Lookup the real path of a file.
- */
-int
-mfs_lookup_path(void *data, const char *str)
-{
+	mfs_watch_root(str);
+	if (mfs_scan_begin(str, &expected) != 0)
+		return (0);
+	if (mfs_pipeline_run(str, expected) == 0)
+		mfs_scan_finish(str);
+	else
+		mfs_scan_flush();
 
-	char **path;
-	path = data;
-	*path = strdup(str);
-	return (1);
+	/* Don't go on to the next path if we are shutting down. */
+	return (mfs_scanctl_cancelled());
 }
 
 /*
- * Load a path into database
+ * Stop watching a path that is no longer in the configuration.
  */
 int
-mfs_lookup_load_path(void *data, const char *str)
+mfs_lookup_unwatch_path(void *data, const char *str)
 {
-	handle = (sqlite3 *)data;
-	traverse_hierarchy(str, mfs_scan);
 
+	mfs_watch_forget(str);
 	return (0);
 }
-
-/*
- * Guess on a filetype for a path.
- *
- * Examples:
- *
- * - /Artists/Whoever should be a directory, since it's an
- *   Album.
- *
- * - /Tracks/Whatever should be a file, since Whatever is a song
- *
- * Note: This should only be used for paths inside the musicfs
- * directories (Artists, Tracks, ...)
- */
-enum mfs_filetype
-mfs_get_filetype(const char *path) {
-	int tokens = mfs_numtoken(path);
-
-	if (strncmp(path, "/Genres", 7) == 0 ||
-	    strncmp(path, "/Artists", 8) == 0) {
-		switch (tokens) {
-		case 1:
-		case 2:
-		case 3:
-			return (MFS_DIRECTORY);
-		case 4:
-			return (MFS_FILE);
-		}
-	} else if (strncmp(path, "/Albums", 7) == 0) {
-		switch (tokens) {
-		case 1:
-		case 2:
-			return (MFS_DIRECTORY);
-		case 3:
-			return (MFS_FILE);
-		}
-	} else if (strncmp(path, "/Tracks", 7) == 0) {
-		switch (tokens) {
-		case 1:
-			return (MFS_DIRECTORY);
-		case 2:
-			return (MFS_FILE);
-		}
-	}
-
-	return (-1);
-}
@@ -0,0 +1,953 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+/*
+ * Tag reader.
+ *
+ * taglib parses the whole container and computes audio properties we never
+ * look at. For the common formats we only read the tag blocks ourselves:
+ * the ID3v2 frames we want (skipping pictures and the like without reading
+ * them) and the ID3v1 trailer of MP3 files, the VORBIS_COMMENT block of
+ * FLAC files, and the comment packet of Ogg Vorbis and Opus streams.
+ * Anything else is handed to taglib.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#include <tag_c.h>
+#include <debug.h>
+#include <musicfs.h>
+#include <mfs_tags.h>
+
+/* Don't read more than this for a single tag frame or comment packet. */
+#define MFS_TAGS_MAXBLOCK	(16 * 1024 * 1024)
+
+static const char *id3v1_genres[] = {
+	"Blues", "Classic Rock", "Country", "Dance", "Disco", "Funk",
+	"Grunge", "Hip-Hop", "Jazz", "Metal", "New Age", "Oldies", "Other",
+	"Pop", "R&B", "Rap", "Reggae", "Rock", "Techno", "Industrial",
+	"Alternative", "Ska", "Death Metal", "Pranks", "Soundtrack",
+	"Euro-Techno", "Ambient", "Trip-Hop", "Vocal", "Jazz+Funk", "Fusion",
+	"Trance", "Classical", "Instrumental", "Acid", "House", "Game",
+	"Sound Clip", "Gospel", "Noise", "Alternative Rock", "Bass", "Soul",
+	"Punk", "Space", "Meditative", "Instrumental Pop",
+	"Instrumental Rock", "Ethnic", "Gothic", "Darkwave",
+	"Techno-Industrial", "Electronic", "Pop-Folk", "Eurodance", "Dream",
+	"Southern Rock", "Comedy", "Cult", "Gangsta", "Top 40",
+	"Christian Rap", "Pop/Funk", "Jungle", "Native American", "Cabaret",
+	"New Wave", "Psychedelic", "Rave", "Showtunes", "Trailer", "Lo-Fi",
+	"Tribal", "Acid Punk", "Acid Jazz", "Polka", "Retro", "Musical",
+	"Rock & Roll", "Hard Rock", "Folk", "Folk/Rock", "National Folk",
+	"Swing", "Fusion", "Bebob", "Latin", "Revival", "Celtic",
+	"Bluegrass", "Avantgarde", "Gothic Rock", "Progressive Rock",
+	"Psychedelic Rock", "Symphonic Rock", "Slow Rock", "Big Band",
+	"Chorus", "Easy Listening", "Acoustic", "Humour", "Speech",
+	"Chanson", "Opera", "Chamber Music", "Sonata", "Symphony",
+	"Booty Bass", "Primus", "Porn Groove", "Satire", "Slow Jam", "Club",
+	"Tango", "Samba", "Folklore", "Ballad", "Power Ballad",
+	"Rhythmic Soul", "Freestyle", "Duet", "Punk Rock", "Drum Solo",
+	"A Cappella", "Euro-House", "Dance Hall", "Goa", "Drum & Bass",
+	"Club-House", "Hardcore", "Terror", "Indie", "BritPop", "Negerpunk",
+	"Polsk Punk", "Beat", "Christian Gangsta Rap", "Heavy Metal",
+	"Black Metal", "Crossover", "Contemporary Christian",
+	"Christian Rock", "Merengue", "Salsa", "Thrash Metal", "Anime",
+	"JPop", "Synthpop",
+};
+#define ID3V1_NGENRES (sizeof(id3v1_genres) / sizeof(id3v1_genres[0]))
+
+/*
+ * Read len bytes at off, from the buffers if possible. Returns the number of
+ * bytes read, which is less than len only at end of file or on errors.
+ */
+static ssize_t
+mfs_tagfile_read(struct mfs_tagfile *tf, off_t off, void *buf, size_t len)
+{
+	off_t tailstart;
+	ssize_t n, total;
+
+	if (off < 0 || off >= tf->tf_size)
+		return (0);
+	if ((off_t)len > tf->tf_size - off)
+		len = tf->tf_size - off;
+
+	if (tf->tf_head != NULL && off + (off_t)len <= (off_t)tf->tf_headlen) {
+		memcpy(buf, tf->tf_head + off, len);
+		return (len);
+	}
+	tailstart = tf->tf_size - (off_t)tf->tf_taillen;
+	if (tf->tf_tail != NULL && off >= tailstart) {
+		memcpy(buf, tf->tf_tail + (off - tailstart), len);
+		return (len);
+	}
+
+	total = 0;
+	while ((size_t)total < len) {
+		n = pread(tf->tf_fd, (char *)buf + total, len - total,
+		    off + total);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		total += n;
+	}
+	return (total);
+}
+
+/* Read a block of len bytes into a new buffer. */
+static unsigned char *
+mfs_tagfile_block(struct mfs_tagfile *tf, off_t off, size_t len)
+{
+	unsigned char *buf;
+
+	if (len > MFS_TAGS_MAXBLOCK)
+		return (NULL);
+	buf = malloc(len + 1);
+	if (buf == NULL)
+		return (NULL);
+	if (mfs_tagfile_read(tf, off, buf, len) != (ssize_t)len) {
+		free(buf);
+		return (NULL);
+	}
+	buf[len] = '\0';
+	return (buf);
+}
+
+static unsigned int
+be32(const unsigned char *p)
+{
+	return (((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) |
+	    ((unsigned int)p[2] << 8) | p[3]);
+}
+
+static unsigned int
+le32(const unsigned char *p)
+{
+	return (((unsigned int)p[3] << 24) | ((unsigned int)p[2] << 16) |
+	    ((unsigned int)p[1] << 8) | p[0]);
+}
+
+static unsigned int
+syncsafe32(const unsigned char *p)
+{
+	return (((unsigned int)(p[0] & 0x7f) << 21) |
+	    ((unsigned int)(p[1] & 0x7f) << 14) |
+	    ((unsigned int)(p[2] & 0x7f) << 7) | (p[3] & 0x7f));
+}
+
+/*
+ * Append a code point to a UTF-8 buffer with room for it.
+ */
+static char *
+utf8_put(char *p, unsigned int c)
+{
+	if (c < 0x80) {
+		*p++ = c;
+	} else if (c < 0x800) {
+		*p++ = 0xc0 | (c >> 6);
+		*p++ = 0x80 | (c & 0x3f);
+	} else if (c < 0x10000) {
+		*p++ = 0xe0 | (c >> 12);
+		*p++ = 0x80 | ((c >> 6) & 0x3f);
+		*p++ = 0x80 | (c & 0x3f);
+	} else {
+		*p++ = 0xf0 | (c >> 18);
+		*p++ = 0x80 | ((c >> 12) & 0x3f);
+		*p++ = 0x80 | ((c >> 6) & 0x3f);
+		*p++ = 0x80 | (c & 0x3f);
+	}
+	return (p);
+}
+
+/* Convert ISO-8859-1 to UTF-8, stopping at the first NUL. */
+static char *
+latin1_to_utf8(const unsigned char *s, size_t len)
+{
+	char *res, *p;
+	size_t i;
+
+	res = malloc(len * 2 + 1);
+	if (res == NULL)
+		return (NULL);
+	p = res;
+	for (i = 0; i < len && s[i] != '\0'; i++)
+		p = utf8_put(p, s[i]);
+	*p = '\0';
+	return (res);
+}
+
+/*
+ * Convert UTF-16 to UTF-8, stopping at the first NUL. The byte order is
+ * taken from a BOM if there is one.
+ */
+static char *
+utf16_to_utf8(const unsigned char *s, size_t len, int bigendian)
+{
+	char *res, *p;
+	unsigned int c, c2;
+	size_t i;
+
+	if (len >= 2 && s[0] == 0xff && s[1] == 0xfe) {
+		bigendian = 0;
+		s += 2;
+		len -= 2;
+	} else if (len >= 2 && s[0] == 0xfe && s[1] == 0xff) {
+		bigendian = 1;
+		s += 2;
+		len -= 2;
+	}
+	/* At most 3 bytes of UTF-8 for every 2 bytes of UTF-16. */
+	res = malloc(len / 2 * 3 + 1);
+	if (res == NULL)
+		return (NULL);
+	p = res;
+	for (i = 0; i + 1 < len; i += 2) {
+		c = bigendian ? (s[i] << 8 | s[i + 1]) : (s[i + 1] << 8 | s[i]);
+		if (c == 0)
+			break;
+		if (c >= 0xd800 && c < 0xdc00 && i + 3 < len) {
+			c2 = bigendian ? (s[i + 2] << 8 | s[i + 3]) :
+			    (s[i + 3] << 8 | s[i + 2]);
+			if (c2 >= 0xdc00 && c2 < 0xe000) {
+				c = 0x10000 + ((c - 0xd800) << 10) +
+				    (c2 - 0xdc00);
+				i += 2;
+			}
+		}
+		p = utf8_put(p, c);
+	}
+	*p = '\0';
+	return (res);
+}
+
+/* Copy a UTF-8 string, stopping at the first NUL. */
+static char *
+utf8_dup(const unsigned char *s, size_t len)
+{
+	char *res;
+	size_t n;
+
+	for (n = 0; n < len && s[n] != '\0'; n++)
+		;
+	res = malloc(n + 1);
+	if (res == NULL)
+		return (NULL);
+	memcpy(res, s, n);
+	res[n] = '\0';
+	return (res);
+}
+
+/* Strip trailing white space in place. */
+static void
+rtrim(char *s)
+{
+	size_t len;
+
+	len = strlen(s);
+	while (len > 0 && (s[len - 1] == ' ' || s[len - 1] == '\t' ||
+	    s[len - 1] == '\r' || s[len - 1] == '\n'))
+		s[--len] = '\0';
+}
+
+/*
+ * Resolve ID3 genre references like "(17)", "(17)Rock" and "17".
+ */
+static char *
+id3_genre(char *genre)
+{
+	char *end, *res;
+	unsigned long n;
+
+	if (genre == NULL)
+		return (NULL);
+	if (genre[0] == '(' && genre[1] >= '0' && genre[1] <= '9') {
+		n = strtoul(genre + 1, &end, 10);
+		if (*end == ')') {
+			if (end[1] != '\0')
+				/* A refinement, which is what we want. */
+				res = strdup(end + 1);
+			else if (n < ID3V1_NGENRES)
+				res = strdup(id3v1_genres[n]);
+			else
+				return (genre);
+			free(genre);
+			return (res);
+		}
+	} else if (genre[0] >= '0' && genre[0] <= '9') {
+		n = strtoul(genre, &end, 10);
+		if (*end == '\0' && n < ID3V1_NGENRES) {
+			free(genre);
+			return (strdup(id3v1_genres[n]));
+		}
+	}
+	return (genre);
+}
+
+/* Set a tag unless it is set already. Takes ownership of value. */
+static void
+mfs_tags_set(char **tag, char *value)
+{
+	if (value == NULL)
+		return;
+	if (*tag != NULL || value[0] == '\0') {
+		free(value);
+		return;
+	}
+	*tag = value;
+}
+
+/* Fill in what dst lacks from src, and free src. */
+static void
+mfs_tags_merge(struct mfs_tags *dst, struct mfs_tags *src)
+{
+	mfs_tags_set(&dst->artist, src->artist);
+	mfs_tags_set(&dst->album, src->album);
+	mfs_tags_set(&dst->title, src->title);
+	mfs_tags_set(&dst->genre, src->genre);
+	if (dst->track == 0)
+		dst->track = src->track;
+	if (dst->year == 0)
+		dst->year = src->year;
+	memset(src, 0, sizeof(*src));
+}
+
+static int
+mfs_tags_complete(struct mfs_tags *tags)
+{
+	return (tags->artist != NULL && tags->album != NULL &&
+	    tags->title != NULL && tags->genre != NULL && tags->track != 0 &&
+	    tags->year != 0);
+}
+
+/*
+ * Remove ID3v2 unsynchronisation (0xff 0x00 -> 0xff) in place. Returns the
+ * new length.
+ */
+static size_t
+id3v2_unsync(unsigned char *buf, size_t len)
+{
+	size_t i, j;
+
+	for (i = 0, j = 0; i < len; i++) {
+		buf[j++] = buf[i];
+		if (buf[i] == 0xff && i + 1 < len && buf[i + 1] == 0x00)
+			i++;
+	}
+	return (j);
+}
+
+/*
+ * Decode an ID3v2 text frame: an encoding byte followed by the text.
+ */
+static char *
+id3v2_text(const unsigned char *data, size_t len)
+{
+	if (len < 1)
+		return (NULL);
+	switch (data[0]) {
+	case 0:
+		return (latin1_to_utf8(data + 1, len - 1));
+	case 1:
+		return (utf16_to_utf8(data + 1, len - 1, 0));
+	case 2:
+		return (utf16_to_utf8(data + 1, len - 1, 1));
+	case 3:
+		return (utf8_dup(data + 1, len - 1));
+	}
+	return (NULL);
+}
+
+/*
+ * Store the contents of an ID3v2 frame if it is one we want.
+ */
+static void
+id3v2_frame(struct mfs_tags *tags, const char *id, const unsigned char *data,
+    size_t len)
+{
+	char *text;
+
+	text = id3v2_text(data, len);
+	if (text == NULL)
+		return;
+	if (!strcmp(id, "TIT2") || !strcmp(id, "TT2")) {
+		mfs_tags_set(&tags->title, text);
+	} else if (!strcmp(id, "TPE1") || !strcmp(id, "TP1")) {
+		mfs_tags_set(&tags->artist, text);
+	} else if (!strcmp(id, "TALB") || !strcmp(id, "TAL")) {
+		mfs_tags_set(&tags->album, text);
+	} else if (!strcmp(id, "TCON") || !strcmp(id, "TCO")) {
+		mfs_tags_set(&tags->genre, id3_genre(text));
+	} else if (!strcmp(id, "TRCK") || !strcmp(id, "TRK")) {
+		if (tags->track == 0)
+			tags->track = strtoul(text, NULL, 10);
+		free(text);
+	} else if (!strcmp(id, "TYER") || !strcmp(id, "TDRC") ||
+	    !strcmp(id, "TYE")) {
+		if (tags->year == 0)
+			tags->year = strtoul(text, NULL, 10);
+		free(text);
+	} else {
+		free(text);
+	}
+}
+
+/* Is this a frame id we want? */
+static int
+id3v2_wanted(const char *id)
+{
+	static const char *wanted[] = {
+		"TIT2", "TPE1", "TALB", "TCON", "TRCK", "TYER", "TDRC",
+		"TT2", "TP1", "TAL", "TCO", "TRK", "TYE", NULL
+	};
+	int i;
+
+	for (i = 0; wanted[i] != NULL; i++)
+		if (!strcmp(id, wanted[i]))
+			return (1);
+	return (0);
+}
+
+/*
+ * Walk the frames of an ID3v2 tag. The frames are either read one by one
+ * from the file, or from buf if the whole tag had to be read.
+ */
+static void
+id3v2_frames(struct mfs_tagfile *tf, const unsigned char *buf, off_t start,
+    off_t end, int version, int tagunsync, struct mfs_tags *tags)
+{
+	unsigned char hdr[10], *data;
+	char id[5];
+	off_t off;
+	size_t hdrlen, size;
+	int fflags;
+
+	hdrlen = (version == 2) ? 6 : 10;
+	for (off = start; off + (off_t)hdrlen <= end; off += hdrlen + size) {
+		if (buf != NULL)
+			memcpy(hdr, buf + off, hdrlen);
+		else if (mfs_tagfile_read(tf, off, hdr, hdrlen) !=
+		    (ssize_t)hdrlen)
+			return;
+		/* Padding. */
+		if (hdr[0] == '\0')
+			return;
+
+		fflags = 0;
+		if (version == 2) {
+			memcpy(id, hdr, 3);
+			id[3] = '\0';
+			size = (hdr[3] << 16) | (hdr[4] << 8) | hdr[5];
+		} else {
+			memcpy(id, hdr, 4);
+			id[4] = '\0';
+			size = (version == 4) ? syncsafe32(hdr + 4) :
+			    be32(hdr + 4);
+			fflags = hdr[9];
+		}
+		if (off + (off_t)hdrlen + (off_t)size > end)
+			return;
+		if (!id3v2_wanted(id))
+			continue;
+		if (version == 3 && (fflags & 0xc0))
+			/* Compressed or encrypted. */
+			continue;
+		if (version == 4 && (fflags & 0x0c))
+			continue;
+
+		if (buf != NULL) {
+			data = malloc(size + 1);
+			if (data == NULL)
+				return;
+			memcpy(data, buf + off + hdrlen, size);
+		} else {
+			data = mfs_tagfile_block(tf, off + hdrlen, size);
+			if (data == NULL)
+				continue;
+		}
+		{
+			unsigned char *p = data;
+			size_t len = size;
+
+			if (version == 4 && (fflags & 0x02 || tagunsync))
+				len = id3v2_unsync(p, len);
+			if (version == 4 && (fflags & 0x01) && len >= 4) {
+				/* Data length indicator. */
+				p += 4;
+				len -= 4;
+			}
+			id3v2_frame(tags, id, p, len);
+		}
+		free(data);
+	}
+}
+
+/*
+ * Read an ID3v2 tag at the start of the file. Returns the size of the tag,
+ * or 0 if there is none.
+ */
+static off_t
+id3v2_read(struct mfs_tagfile *tf, struct mfs_tags *tags)
+{
+	unsigned char hdr[10], ext[4], *buf;
+	off_t start, end, size;
+	size_t len;
+	int version, flags;
+
+	if (mfs_tagfile_read(tf, 0, hdr, sizeof(hdr)) != sizeof(hdr))
+		return (0);
+	if (memcmp(hdr, "ID3", 3) != 0)
+		return (0);
+	version = hdr[3];
+	flags = hdr[5];
+	size = syncsafe32(hdr + 6);
+	end = 10 + size;
+	if (flags & 0x10)
+		/* Footer. */
+		size += 10;
+	if (version < 2 || version > 4)
+		return (10 + size);
+
+	start = 10;
+	if (version > 2 && (flags & 0x40)) {
+		/* Skip the extended header. */
+		if (mfs_tagfile_read(tf, start, ext, 4) != 4)
+			return (10 + size);
+		if (version == 3)
+			start += 4 + be32(ext);
+		else
+			start += syncsafe32(ext);
+	}
+
+	if (version < 4 && (flags & 0x80)) {
+		/*
+		 * The whole tag is unsynchronised, so frame boundaries are
+		 * only known after undoing it. Read it all.
+		 */
+		buf = mfs_tagfile_block(tf, 0, end);
+		if (buf != NULL) {
+			len = 10 + id3v2_unsync(buf + 10, end - 10);
+			id3v2_frames(tf, buf, start, len, version, 0, tags);
+			free(buf);
+		}
+	} else {
+		id3v2_frames(tf, NULL, start, end, version, flags & 0x80,
+		    tags);
+	}
+	return (10 + size);
+}
+
+/* Pick a fixed size ID3v1 field. */
+static char *
+id3v1_field(const unsigned char *p, size_t len)
+{
+	char *s;
+
+	s = latin1_to_utf8(p, len);
+	if (s != NULL)
+		rtrim(s);
+	return (s);
+}
+
+/*
+ * Read an ID3v1 tag at the end of the file. Returns 1 if there is one.
+ */
+static int
+id3v1_read(struct mfs_tagfile *tf, struct mfs_tags *tags)
+{
+	unsigned char tag[128];
+	char *year;
+
+	if (tf->tf_size < 128 ||
+	    mfs_tagfile_read(tf, tf->tf_size - 128, tag, 128) != 128)
+		return (0);
+	if (memcmp(tag, "TAG", 3) != 0)
+		return (0);
+
+	mfs_tags_set(&tags->title, id3v1_field(tag + 3, 30));
+	mfs_tags_set(&tags->artist, id3v1_field(tag + 33, 30));
+	mfs_tags_set(&tags->album, id3v1_field(tag + 63, 30));
+	year = id3v1_field(tag + 93, 4);
+	if (year != NULL) {
+		if (tags->year == 0)
+			tags->year = strtoul(year, NULL, 10);
+		free(year);
+	}
+	/* ID3v1.1 keeps the track number at the end of the comment. */
+	if (tag[125] == '\0' && tag[126] != '\0' && tags->track == 0)
+		tags->track = tag[126];
+	if (tag[127] < ID3V1_NGENRES)
+		mfs_tags_set(&tags->genre, strdup(id3v1_genres[tag[127]]));
+	return (1);
+}
+
+/*
+ * Parse a Vorbis comment block, as found in FLAC, Ogg Vorbis and Opus.
+ */
+static void
+vorbis_comments(const unsigned char *buf, size_t len, struct mfs_tags *tags)
+{
+	const unsigned char *p, *end, *eq;
+	unsigned int n, count, clen;
+	char *value;
+	size_t keylen;
+
+	p = buf;
+	end = buf + len;
+	if (end - p < 4)
+		return;
+	/* Skip the vendor string. */
+	clen = le32(p);
+	p += 4;
+	if ((size_t)(end - p) < clen)
+		return;
+	p += clen;
+	if (end - p < 4)
+		return;
+	count = le32(p);
+	p += 4;
+
+	for (n = 0; n < count; n++) {
+		if (end - p < 4)
+			return;
+		clen = le32(p);
+		p += 4;
+		if ((size_t)(end - p) < clen)
+			return;
+		eq = memchr(p, '=', clen);
+		if (eq == NULL) {
+			p += clen;
+			continue;
+		}
+		keylen = eq - p;
+		value = utf8_dup(eq + 1, clen - keylen - 1);
+		if (value == NULL)
+			return;
+
+		if (keylen == 5 && !strncasecmp((const char *)p, "TITLE", 5)) {
+			mfs_tags_set(&tags->title, value);
+		} else if (keylen == 6 &&
+		    !strncasecmp((const char *)p, "ARTIST", 6)) {
+			mfs_tags_set(&tags->artist, value);
+		} else if (keylen == 5 &&
+		    !strncasecmp((const char *)p, "ALBUM", 5)) {
+			mfs_tags_set(&tags->album, value);
+		} else if (keylen == 5 &&
+		    !strncasecmp((const char *)p, "GENRE", 5)) {
+			mfs_tags_set(&tags->genre, value);
+		} else if (keylen == 11 &&
+		    !strncasecmp((const char *)p, "TRACKNUMBER", 11)) {
+			if (tags->track == 0)
+				tags->track = strtoul(value, NULL, 10);
+			free(value);
+		} else if (keylen == 4 &&
+		    !strncasecmp((const char *)p, "DATE", 4)) {
+			if (tags->year == 0)
+				tags->year = strtoul(value, NULL, 10);
+			free(value);
+		} else {
+			free(value);
+		}
+		p += clen;
+	}
+}
+
+/*
+ * Read the metadata blocks of a FLAC stream starting at off, looking for
+ * the VORBIS_COMMENT block.
+ */
+static int
+flac_read(struct mfs_tagfile *tf, off_t off, struct mfs_tags *tags)
+{
+	unsigned char hdr[4], *block;
+	size_t len;
+	int last, type;
+
+	if (mfs_tagfile_read(tf, off, hdr, 4) != 4 ||
+	    memcmp(hdr, "fLaC", 4) != 0)
+		return (MFS_TAGS_UNSUPPORTED);
+	off += 4;
+	do {
+		if (mfs_tagfile_read(tf, off, hdr, 4) != 4)
+			return (MFS_TAGS_ERROR);
+		last = hdr[0] & 0x80;
+		type = hdr[0] & 0x7f;
+		len = (hdr[1] << 16) | (hdr[2] << 8) | hdr[3];
+		off += 4;
+		if (type == 4) {
+			block = mfs_tagfile_block(tf, off, len);
+			if (block == NULL)
+				return (MFS_TAGS_ERROR);
+			vorbis_comments(block, len, tags);
+			free(block);
+			return (MFS_TAGS_OK);
+		}
+		off += len;
+	} while (!last);
+	/* A FLAC file without comments. */
+	return (MFS_TAGS_OK);
+}
+
+/*
+ * Read the second packet of the first logical Ogg stream, which is where
+ * Vorbis and Opus keep their comments.
+ */
+static int
+ogg_read(struct mfs_tagfile *tf, struct mfs_tags *tags)
+{
+	unsigned char hdr[27], segs[255], *packet, *p;
+	unsigned int serial, nsegs, i;
+	size_t pktlen, pktsize, seglen, off_data;
+	off_t off;
+	int npacket, have_serial, done;
+
+	packet = NULL;
+	pktlen = pktsize = 0;
+	npacket = 0;
+	have_serial = 0;
+	serial = 0;
+	done = 0;
+	off = 0;
+
+	while (!done) {
+		if (mfs_tagfile_read(tf, off, hdr, 27) != 27 ||
+		    memcmp(hdr, "OggS", 4) != 0)
+			break;
+		nsegs = hdr[26];
+		if (mfs_tagfile_read(tf, off + 27, segs, nsegs) !=
+		    (ssize_t)nsegs)
+			break;
+		off_data = 27 + nsegs;
+		seglen = 0;
+		for (i = 0; i < nsegs; i++)
+			seglen += segs[i];
+
+		if (!have_serial) {
+			serial = le32(hdr + 14);
+			have_serial = 1;
+		} else if (le32(hdr + 14) != serial) {
+			/* Another multiplexed stream. */
+			off += off_data + seglen;
+			continue;
+		}
+
+		/* Walk the lacing values, collecting packet 1. */
+		{
+			off_t segoff = off + off_data;
+
+			for (i = 0; i < nsegs && !done; i++) {
+				if (npacket == 1 && segs[i] > 0) {
+					if (pktlen + segs[i] > pktsize) {
+						if (pktlen + segs[i] >
+						    MFS_TAGS_MAXBLOCK)
+							goto out;
+						pktsize = (pktsize + segs[i])
+						    * 2;
+						p = realloc(packet, pktsize);
+						if (p == NULL)
+							goto out;
+						packet = p;
+					}
+					if (mfs_tagfile_read(tf, segoff,
+					    packet + pktlen, segs[i]) !=
+					    segs[i])
+						goto out;
+					pktlen += segs[i];
+				}
+				segoff += segs[i];
+				/* A lacing value below 255 ends a packet. */
+				if (segs[i] < 255) {
+					if (npacket == 1)
+						done = 1;
+					npacket++;
+				}
+			}
+		}
+		off += off_data + seglen;
+	}
+
+	if (!done)
+		goto out;
+	if (pktlen >= 7 && memcmp(packet, "\003vorbis", 7) == 0) {
+		vorbis_comments(packet + 7, pktlen - 7, tags);
+	} else if (pktlen >= 8 && memcmp(packet, "OpusTags", 8) == 0) {
+		vorbis_comments(packet + 8, pktlen - 8, tags);
+	} else {
+		/* Speex, FLAC in Ogg and friends. */
+		free(packet);
+		return (MFS_TAGS_UNSUPPORTED);
+	}
+	free(packet);
+	return (MFS_TAGS_OK);
+out:
+	free(packet);
+	return (MFS_TAGS_ERROR);
+}
+
+/*
+ * Read tags from a file using the native readers. Returns MFS_TAGS_OK if
+ * the format is known, MFS_TAGS_UNSUPPORTED if someone else should try.
+ */
+int
+mfs_tags_read(struct mfs_tagfile *tf, const char *filepath,
+    struct mfs_tags *tags)
+{
+	unsigned char magic[4];
+	const char *extension;
+	off_t off;
+	int ret, id3v1;
+
+	memset(tags, 0, sizeof(*tags));
+	if (mfs_tagfile_read(tf, 0, magic, 4) != 4)
+		return (MFS_TAGS_UNSUPPORTED);
+
+	if (memcmp(magic, "OggS", 4) == 0)
+		return (ogg_read(tf, tags));
+	if (memcmp(magic, "fLaC", 4) == 0)
+		return (flac_read(tf, 0, tags));
+
+	extension = strrchr(filepath, '.');
+	if (memcmp(magic, "ID3", 3) != 0 &&
+	    (extension == NULL || (strcasecmp(extension, ".mp3") != 0 &&
+	    strcasecmp(extension, ".mp2") != 0)))
+		return (MFS_TAGS_UNSUPPORTED);
+
+	off = id3v2_read(tf, tags);
+	if (off > 0) {
+		/*
+		 * FLAC files sometimes have an ID3v2 tag in front. Like
+		 * taglib, prefer the Vorbis comments in that case.
+		 */
+		struct mfs_tags flac;
+
+		memset(&flac, 0, sizeof(flac));
+		ret = flac_read(tf, off, &flac);
+		if (ret != MFS_TAGS_UNSUPPORTED) {
+			mfs_tags_merge(&flac, tags);
+			*tags = flac;
+			return (ret);
+		}
+		mfs_tags_free(&flac);
+	}
+	/* Like taglib, fill in what the ID3v2 tag lacks from ID3v1. */
+	id3v1 = 0;
+	if (!mfs_tags_complete(tags))
+		id3v1 = id3v1_read(tf, tags);
+	if (off == 0 && !id3v1 && memcmp(magic, "ID3", 3) != 0) {
+		/* No tags we know; maybe APE. */
+		return (MFS_TAGS_UNSUPPORTED);
+	}
+	return (MFS_TAGS_OK);
+}
+
+/* Take over a string from taglib. */
+static char *
+taglib_string(char *s)
+{
+	if (s != NULL && s[0] == '\0') {
+		free(s);
+		return (NULL);
+	}
+	return (s);
+}
+
+/*
+ * Read tags with taglib.
+ */
+int
+mfs_tags_taglib(const char *filepath, struct mfs_tags *tags)
+{
+	TagLib_File *file;
+	TagLib_Tag *tag;
+
+	memset(tags, 0, sizeof(*tags));
+	file = taglib_file_new(filepath);
+	/* XXX: errmsg. */
+	if (file == NULL) {
+		DEBUG("Unable to open file %s\n", filepath);
+		return (MFS_TAGS_ERROR);
+	}
+	tag = taglib_file_tag(file);
+	if (tag == NULL) {
+		DEBUG("Error getting tag from %s\n", filepath);
+		taglib_file_free(file);
+		return (MFS_TAGS_ERROR);
+	}
+	/* String management is disabled, so these are ours to free. */
+	tags->artist = taglib_string(taglib_tag_artist(tag));
+	tags->album = taglib_string(taglib_tag_album(tag));
+	tags->title = taglib_string(taglib_tag_title(tag));
+	tags->genre = taglib_string(taglib_tag_genre(tag));
+	tags->track = taglib_tag_track(tag);
+	tags->year = taglib_tag_year(tag);
+	taglib_file_free(file);
+	return (MFS_TAGS_OK);
+}
+
+/*
+ * Read the tags of a file of the given size, with the native reader when
+ * it knows the format and taglib otherwise.
+ */
+int
+mfs_tags_get(const char *filepath, off_t size, struct mfs_tags *tags)
+{
+	struct mfs_tagfile tf;
+	int ret;
+
+	if (!mfs_opts.taglib_only) {
+		memset(&tf, 0, sizeof(tf));
+		tf.tf_fd = open(filepath, O_RDONLY);
+		if (tf.tf_fd < 0) {
+			DEBUG("Unable to open file %s: %s\n", filepath,
+			    strerror(errno));
+			return (MFS_TAGS_ERROR);
+		}
+		tf.tf_size = size;
+		ret = mfs_tags_read(&tf, filepath, tags);
+		close(tf.tf_fd);
+		if (ret == MFS_TAGS_OK)
+			return (ret);
+		mfs_tags_free(tags);
+		if (ret == MFS_TAGS_ERROR)
+			DEBUG("Error reading tags from %s, trying taglib\n",
+			    filepath);
+	}
+	return (mfs_tags_taglib(filepath, tags));
+}
+
+void
+mfs_tags_free(struct mfs_tags *tags)
+{
+	free(tags->artist);
+	free(tags->album);
+	free(tags->title);
+	free(tags->genre);
+	memset(tags, 0, sizeof(*tags));
+}
@@ -0,0 +1,351 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+/*
+ * io_uring support, talking to the kernel directly rather than through
+ * liburing, since we only need opens and reads. Everything is compiled
+ * away on systems that don't have it.
+ */
+
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <debug.h>
+#include <mfs_uring.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define MFS_HAVE_URING
+#endif
+#endif
+
+#ifdef MFS_HAVE_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+struct mfs_uring {
+	int ur_fd;
+	unsigned int ur_entries;
+	unsigned int ur_queued;		/* Requests not submitted yet. */
+	unsigned int ur_inflight;	/* Submitted but not completed. */
+
+	void *ur_sqmap;
+	size_t ur_sqmaplen;
+	unsigned int *ur_sqhead;
+	unsigned int *ur_sqtail;
+	unsigned int *ur_sqmask;
+	unsigned int *ur_sqarray;
+	struct io_uring_sqe *ur_sqes;
+	size_t ur_sqeslen;
+
+	void *ur_cqmap;
+	size_t ur_cqmaplen;
+	unsigned int *ur_cqhead;
+	unsigned int *ur_cqtail;
+	unsigned int *ur_cqmask;
+	struct io_uring_cqe *ur_cqes;
+};
+
+static int
+mfs_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+
+	return ((int)syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int
+mfs_uring_enter(int fd, unsigned int submit, unsigned int wait,
+    unsigned int flags)
+{
+
+	return ((int)syscall(__NR_io_uring_enter, fd, submit, wait, flags,
+	    NULL, 0));
+}
+
+/*
+ * Check that the kernel knows the operations we use. They came in 5.6,
+ * and so did probing, so a failing probe means no.
+ */
+static int
+mfs_uring_probe(int fd)
+{
+	struct io_uring_probe *probe;
+	size_t len;
+	int ok;
+
+	len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	probe = calloc(1, len);
+	if (probe == NULL)
+		return (0);
+	ok = 0;
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+	    256) == 0 &&
+	    probe->last_op >= IORING_OP_READ &&
+	    (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) &&
+	    (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED))
+		ok = 1;
+	free(probe);
+	return (ok);
+}
+
+/*
+ * Set up a ring with room for the given number of requests. Returns NULL
+ * if io_uring is not available.
+ */
+struct mfs_uring *
+mfs_uring_new(unsigned int entries)
+{
+	struct io_uring_params p;
+	struct mfs_uring *ur;
+	char *sq, *cq;
+
+	ur = calloc(1, sizeof(*ur));
+	if (ur == NULL)
+		return (NULL);
+	memset(&p, 0, sizeof(p));
+	ur->ur_fd = mfs_uring_setup(entries, &p);
+	if (ur->ur_fd < 0) {
+		DEBUG("io_uring not available: %s\n", strerror(errno));
+		free(ur);
+		return (NULL);
+	}
+	if (!mfs_uring_probe(ur->ur_fd)) {
+		DEBUG("io_uring does not support open and read\n");
+		close(ur->ur_fd);
+		free(ur);
+		return (NULL);
+	}
+	ur->ur_entries = p.sq_entries;
+
+	ur->ur_sqmaplen = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ur->ur_cqmaplen = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	/* Newer kernels map both rings at once. */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->ur_cqmaplen > ur->ur_sqmaplen)
+			ur->ur_sqmaplen = ur->ur_cqmaplen;
+		ur->ur_cqmaplen = 0;
+	}
+	ur->ur_sqmap = mmap(NULL, ur->ur_sqmaplen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ur->ur_fd, IORING_OFF_SQ_RING);
+	if (ur->ur_sqmap == MAP_FAILED)
+		goto fail;
+	if (ur->ur_cqmaplen == 0) {
+		ur->ur_cqmap = ur->ur_sqmap;
+	} else {
+		ur->ur_cqmap = mmap(NULL, ur->ur_cqmaplen,
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    ur->ur_fd, IORING_OFF_CQ_RING);
+		if (ur->ur_cqmap == MAP_FAILED)
+			goto fail;
+	}
+	ur->ur_sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->ur_sqes = mmap(NULL, ur->ur_sqeslen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ur->ur_fd, IORING_OFF_SQES);
+	if (ur->ur_sqes == MAP_FAILED)
+		goto fail;
+
+	sq = ur->ur_sqmap;
+	ur->ur_sqhead = (unsigned int *)(sq + p.sq_off.head);
+	ur->ur_sqtail = (unsigned int *)(sq + p.sq_off.tail);
+	ur->ur_sqmask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	ur->ur_sqarray = (unsigned int *)(sq + p.sq_off.array);
+	cq = ur->ur_cqmap;
+	ur->ur_cqhead = (unsigned int *)(cq + p.cq_off.head);
+	ur->ur_cqtail = (unsigned int *)(cq + p.cq_off.tail);
+	ur->ur_cqmask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	ur->ur_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return (ur);
+fail:
+	DEBUG("Unable to map io_uring: %s\n", strerror(errno));
+	if (ur->ur_sqes != NULL && ur->ur_sqes != MAP_FAILED)
+		munmap(ur->ur_sqes, ur->ur_sqeslen);
+	if (ur->ur_cqmaplen != 0 && ur->ur_cqmap != NULL &&
+	    ur->ur_cqmap != MAP_FAILED)
+		munmap(ur->ur_cqmap, ur->ur_cqmaplen);
+	if (ur->ur_sqmap != NULL && ur->ur_sqmap != MAP_FAILED)
+		munmap(ur->ur_sqmap, ur->ur_sqmaplen);
+	close(ur->ur_fd);
+	free(ur);
+	return (NULL);
+}
+
+void
+mfs_uring_free(struct mfs_uring *ur)
+{
+
+	munmap(ur->ur_sqes, ur->ur_sqeslen);
+	if (ur->ur_cqmaplen != 0)
+		munmap(ur->ur_cqmap, ur->ur_cqmaplen);
+	munmap(ur->ur_sqmap, ur->ur_sqmaplen);
+	close(ur->ur_fd);
+	free(ur);
+}
+
+/* Get a free submission entry, or NULL if the ring is full. */
+static struct io_uring_sqe *
+mfs_uring_sqe(struct mfs_uring *ur, void *data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail, idx;
+
+	if (ur->ur_queued + ur->ur_inflight >= ur->ur_entries)
+		return (NULL);
+	tail = *ur->ur_sqtail + ur->ur_queued;
+	idx = tail & *ur->ur_sqmask;
+	sqe = &ur->ur_sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (unsigned long)data;
+	ur->ur_sqarray[idx] = idx;
+	ur->ur_queued++;
+	return (sqe);
+}
+
+/*
+ * Queue an open of path, relative to the current directory.
+ */
+int
+mfs_uring_openat(struct mfs_uring *ur, const char *path, int flags,
+    void *data)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = mfs_uring_sqe(ur, data);
+	if (sqe == NULL)
+		return (-1);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long)path;
+	sqe->open_flags = flags;
+	return (0);
+}
+
+/*
+ * Queue a read of len bytes at off.
+ */
+int
+mfs_uring_read(struct mfs_uring *ur, int fd, void *buf, size_t len,
+    off_t off, void *data)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = mfs_uring_sqe(ur, data);
+	if (sqe == NULL)
+		return (-1);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = off;
+	return (0);
+}
+
+/*
+ * Submit the queued requests and wait until all of them are done, calling
+ * fn with the data given when queueing and the result, which is a negative
+ * errno on failure. If this fails, requests may still be in flight, and
+ * their buffers must be left alone.
+ */
+int
+mfs_uring_run(struct mfs_uring *ur, mfs_uring_fn_t *fn)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head, tail, submit;
+	int n;
+
+	/* Make the entries visible to the kernel before the new tail. */
+	__atomic_store_n(ur->ur_sqtail, *ur->ur_sqtail + ur->ur_queued,
+	    __ATOMIC_RELEASE);
+	submit = ur->ur_queued;
+	ur->ur_inflight += ur->ur_queued;
+	ur->ur_queued = 0;
+
+	while (ur->ur_inflight > 0) {
+		n = mfs_uring_enter(ur->ur_fd, submit, 1,
+		    IORING_ENTER_GETEVENTS);
+		if (n < 0 && errno != EINTR && errno != EAGAIN &&
+		    errno != EBUSY) {
+			/* Requests may still be running. */
+			DEBUG("io_uring_enter failed: %s\n", strerror(errno));
+			return (-1);
+		}
+		if (n > 0)
+			submit -= ((unsigned int)n < submit) ? n : submit;
+		head = *ur->ur_cqhead;
+		tail = __atomic_load_n(ur->ur_cqtail, __ATOMIC_ACQUIRE);
+		while (head != tail) {
+			cqe = &ur->ur_cqes[head & *ur->ur_cqmask];
+			fn((void *)(unsigned long)cqe->user_data, cqe->res);
+			head++;
+			ur->ur_inflight--;
+		}
+		__atomic_store_n(ur->ur_cqhead, head, __ATOMIC_RELEASE);
+	}
+	return (0);
+}
+
+#else /* !MFS_HAVE_URING */
+
+struct mfs_uring *
+mfs_uring_new(unsigned int entries)
+{
+
+	return (NULL);
+}
+
+void
+mfs_uring_free(struct mfs_uring *ur)
+{
+}
+
+int
+mfs_uring_openat(struct mfs_uring *ur, const char *path, int flags,
+    void *data)
+{
+
+	return (-1);
+}
+
+int
+mfs_uring_read(struct mfs_uring *ur, int fd, void *buf, size_t len,
+    off_t off, void *data)
+{
+
+	return (-1);
+}
+
+int
+mfs_uring_run(struct mfs_uring *ur, mfs_uring_fn_t *fn)
+{
+
+	return (-1);
+}
+
+#endif /* MFS_HAVE_URING */
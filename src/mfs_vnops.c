@@ -22,9 +22,11 @@
 
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
 #include <dirent.h>
 #include <sys/param.h>
 #include <sys/uio.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <pthread.h>
 
@@ -36,17 +38,76 @@
 
 #include <fusever.h>
 #include <fuse.h>
+#include <fuse_opt.h>
 #include <tag_c.h>
 #include <musicfs.h>
+#include <mfs_db.h>
+#include <mfs_catalog.h>
+#include <mfs_lowlevel.h>
+#include <mfs_scanctl.h>
+#include <mfs_qos.h>
+#include <mfs_watch.h>
 #include <debug.h>
 
+#define MFS_VIRTFILE_SIZE 4096
+
+/*
+ * Produce the contents of the /.stats file. Returns its length.
+ */
+static int
+mfs_stats(char *buf, size_t size)
+{
+	unsigned long hits, misses;
+	int len;
+
+	mfs_db_stmtcache_stats(&hits, &misses);
+	len = snprintf(buf, size,
+	    "stmtcache_hits: %lu\n"
+	    "stmtcache_misses: %lu\n"
+	    "db_connections: %d\n",
+	    hits, misses, mfs_db_pool_size());
+	if (len < 0)
+		return (0);
+	if ((size_t)len >= size)
+		return ((int)size - 1);
+	len += mfs_qos_stats(buf + len, size - len);
+	len += mfs_catalog_stats(buf + len, size - len);
+	return (len);
+}
+
+/*
+ * Read-only files in the root whose contents are generated when read.
+ */
+struct mfs_virtfile {
+	const char *vf_path;
+	int (*vf_fill)(char *, size_t);
+};
+
+static const struct mfs_virtfile mfs_virtfiles[] = {
+	{ "/.stats", mfs_stats },
+	{ "/.scan_status", mfs_scanctl_status },
+	{ NULL, NULL }
+};
+
+static const struct mfs_virtfile *
+mfs_virtfile_lookup(const char *path)
+{
+	const struct mfs_virtfile *vf;
+
+	for (vf = mfs_virtfiles; vf->vf_path != NULL; vf++)
+		if (strcmp(path, vf->vf_path) == 0)
+			return (vf);
+	return (NULL);
+}
+
 static int mfs_getattr (const char *path, struct stat *stbuf)
 {
 	
-	char *realpath;
+	const struct mfs_virtfile *vf;
+	struct mfs_catalog *cat;
+	uint32_t node;
 	int res;
 
-	int status = 0;
 	memset (stbuf, 0, sizeof (struct stat));
 
 	if (strcmp(path, "/") == 0) {
@@ -65,37 +126,36 @@ static int mfs_getattr (const char *path, struct stat *stbuf)
 		return (res);
 	}
 
-	enum mfs_filetype type = mfs_get_filetype(path);
-	switch (type) {
-	case MFS_DIRECTORY:
-		stbuf->st_mode = S_IFDIR | 0555;
+	if ((vf = mfs_virtfile_lookup(path)) != NULL) {
+		char contents[MFS_VIRTFILE_SIZE];
+
+		stbuf->st_mode = S_IFREG | 0444;
 		stbuf->st_nlink = 1;
-		stbuf->st_size = 12;
-		return 0;
+		stbuf->st_size = vf->vf_fill(contents, sizeof(contents));
+		return (0);
+	}
 
-	case MFS_FILE:
-		realpath = NULL;
-		status = mfs_realpath(path, &realpath);
-		if (status != 0)
-			return status;
-		res = stat(realpath, stbuf);
-		free(realpath);
-		return (res);
+	cat = mfs_catalog_get();
+	node = mfs_catalog_resolve(cat, path);
+	if (node == MFS_CATALOG_NONE) {
+		mfs_catalog_put(cat);
+		return (-ENOENT);
 	}
-	return (-ENOENT);
+	mfs_catalog_stat(cat, node, stbuf);
+	mfs_catalog_put(cat);
+	return (0);
 }
 
 
 static int mfs_readdir (const char *path, void *buf, fuse_fill_dir_t filler,
 						off_t offset, struct fuse_file_info *fi)
 {
-	struct filler_data fd;
-	struct lookuphandle *lh;
+	const struct mfs_virtfile *vf;
+	struct mfs_catalog *cat;
+	uint32_t node, count;
 
 	filler (buf, ".", NULL, 0);
 	filler (buf, "..", NULL, 0);
-	fd.buf = buf;
-	fd.filler = filler;
 
 	if (!strcmp(path, "/")) {
 		filler(buf, "Artists", NULL, 0);
@@ -103,32 +163,23 @@ static int mfs_readdir (const char *path, void *buf, fuse_fill_dir_t filler,
 		filler(buf, "Tracks", NULL, 0);
 		filler(buf, "Albums", NULL, 0);
 		filler(buf, ".config", NULL, 0);
+		for (vf = mfs_virtfiles; vf->vf_path != NULL; vf++)
+			filler(buf, vf->vf_path + 1, NULL, 0);
 		return (0);
 	}
 
-	/*
-	 * 1. Parse the path.
-	 * 2. Find the mp3s that matches the tags given from the path.
-	 * 3. Return the list of those mp3s.
-	 */
-	if (strncmp(path, "/Artists", 8) == 0) {
-		mfs_lookup_artist(path, &fd);
-		return (0);
-	} else if (strncmp(path, "/Genres", 7) == 0) {
-		mfs_lookup_genre(path, &fd);
-		return (0);
-	} else if (strcmp(path, "/Tracks") == 0) {
-		lh = mfs_lookup_start(0, &fd, mfs_lookup_list,
-		    "SELECT DISTINCT artistname||' - '||title||'.'||extension "
-		    "FROM song");
-		mfs_lookup_finish(lh);
-		return (0);
-	} else if (strncmp(path, "/Albums", 7) == 0) {
-		mfs_lookup_album(path, &fd);
-		return (0);
+	cat = mfs_catalog_get();
+	node = mfs_catalog_resolve(cat, path);
+	if (node == MFS_CATALOG_NONE || !mfs_catalog_isdir(cat, node)) {
+		mfs_catalog_put(cat);
+		return (-ENOENT);
 	}
-
-	return (-ENOENT);
+	for (node = mfs_catalog_children(cat, node, &count); count > 0;
+	    node++, count--)
+		if (filler(buf, mfs_catalog_name(cat, node), NULL, 0) != 0)
+			break;
+	mfs_catalog_put(cat);
+	return (0);
 }
 
 static int mfs_open (const char *path, struct fuse_file_info *fi)
@@ -139,6 +190,14 @@ static int mfs_open (const char *path, struct fuse_file_info *fi)
 	if (strcmp(path, "/.config") == 0)
 		return (0);
 
+	if (mfs_virtfile_lookup(path) != NULL) {
+		if ((fi->flags & O_ACCMODE) != O_RDONLY)
+			return (-EACCES);
+		/* The size changes between getattr and read. */
+		fi->direct_io = 1;
+		return (0);
+	}
+
 	status = mfs_realpath(path, &realpath);
 	if (status != 0)
 		return status;
@@ -153,8 +212,10 @@ static int mfs_open (const char *path, struct fuse_file_info *fi)
 static int mfs_read (const char *path, char *buf, size_t size, off_t offset,
 					 struct fuse_file_info *fi)
 {
+	const struct mfs_virtfile *vf;
+	struct timespec start, end;
 	int fd;
-	size_t bytes;
+	ssize_t bytes;
 
 	DEBUG("read: path(%s) offset(%d) size(%d)\n", path, (int)offset,
 		  (int)size);
@@ -164,17 +225,41 @@ static int mfs_read (const char *path, char *buf, size_t size, off_t offset,
 			return (-ENOMEM);
 		int fd = open(mfsrc, O_RDONLY);
 		free(mfsrc);
-		lseek(fd, offset, SEEK_SET);
-		bytes = read(fd, buf, size);
+		if (fd < 0)
+			return (-errno);
+		bytes = pread(fd, buf, size, offset);
 		close(fd);
 		return (bytes);
 	}
 
+	if ((vf = mfs_virtfile_lookup(path)) != NULL) {
+		char contents[MFS_VIRTFILE_SIZE];
+		int len;
+
+		len = vf->vf_fill(contents, sizeof(contents));
+		if (offset >= len)
+			return (0);
+		if (size > (size_t)(len - offset))
+			size = len - offset;
+		memcpy(buf, contents + offset, size);
+		return (size);
+	}
+
 	fd = (int)fi->fh;
 	if (fd < 0)
 		return (-EIO);
-	lseek(fd, offset, SEEK_SET);
-	bytes = read(fd, buf, size);
+	/*
+	 * Reads of the same file may run at the same time, so they must
+	 * not share a file offset. The scanner backs off when reads get
+	 * slow.
+	 */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	bytes = pread(fd, buf, size, offset);
+	if (bytes < 0)
+		return (-errno);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	mfs_qos_fgread((end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1e9);
 	return (bytes);
 
 	/*
@@ -198,8 +283,9 @@ static int mfs_write(const char *path, const char *buf, size_t size,
 			return (-ENOMEM);
 		int fd = open(mfsrc, O_WRONLY);
 		free(mfsrc);
-		lseek(fd, offset, SEEK_SET);
-		bytes = write(fd, buf, size);
+		if (fd < 0)
+			return (-errno);
+		bytes = pwrite(fd, buf, size, offset);
 		close(fd);
 		return (bytes);
 	}
@@ -278,8 +364,8 @@ static int mfs_release(const char *path, struct fuse_file_info *fi)
 	DEBUG("release %s\n", path);
 
 	if (strcmp(path, "/.config") == 0) {
-		/* Reload configuration file */
-		mfs_reload_config();
+		/* Rescan with the new configuration, in the background. */
+		mfs_scanctl_request();
 	}
 
 	fd = (int)fi->fh;
@@ -339,7 +425,33 @@ static int mfs_setxattr(const char *path, const char *name,
 	return (0);
 }
 
-static struct fuse_operations mfs_ops = {
+static void *mfs_fsinit(struct fuse_conn_info *conn)
+{
+
+	/* Show what the last scan found until this one is done. */
+	if (mfs_catalog_map() != 0)
+		mfs_catalog_load();
+	/* Threads started before fuse_main() would not survive daemonizing. */
+	mfs_scanctl_start();
+	/* Directories are watched as the scan finds them. */
+	if (!mfs_opts.nowatch)
+		mfs_watch_start();
+	if (!mfs_opts.noscan)
+		mfs_scanctl_request();
+	return (NULL);
+}
+
+static void mfs_fsdestroy(void *data)
+{
+
+	mfs_watch_stop();
+	mfs_scanctl_stop();
+	mfs_catalog_unload();
+}
+
+struct fuse_operations mfs_ops = {
+	.init       = mfs_fsinit,
+	.destroy    = mfs_fsdestroy,
 	.getattr    = mfs_getattr,
 	.readdir    = mfs_readdir,
 	.open       = mfs_open,
@@ -356,6 +468,28 @@ static struct fuse_operations mfs_ops = {
 	.setxattr   = mfs_setxattr,
 };
 
+#define MFS_OPT(t, p, v) { t, offsetof(struct mfs_options, p), v }
+
+/* Options we understand. The rest is passed on to FUSE. */
+static struct fuse_opt mfs_opt_spec[] = {
+	MFS_OPT("scan_threads=%d", scan_threads, 0),
+	MFS_OPT("scan_io_threads=%d", scan_io_threads, 0),
+	MFS_OPT("scan_parse_threads=%d", scan_parse_threads, 0),
+	MFS_OPT("full_rescan", full_rescan, 1),
+	MFS_OPT("scan_batch=%d", scan_batch, 0),
+	MFS_OPT("taglib", taglib_only, 1),
+	MFS_OPT("io_uring", io_uring, 1),
+	MFS_OPT("noscan", noscan, 1),
+	MFS_OPT("nowatch", nowatch, 1),
+	MFS_OPT("watch_delay=%d", watch_delay, 0),
+	MFS_OPT("scan_ioprio=%s", scan_ioprio, 0),
+	MFS_OPT("scan_files_per_sec=%d", scan_files_per_sec, 0),
+	MFS_OPT("scan_mb_per_sec=%d", scan_mb_per_sec, 0),
+	MFS_OPT("scan_read_latency=%d", scan_read_latency, 0),
+	MFS_OPT("lowlevel", lowlevel, 1),
+	FUSE_OPT_END
+};
+
 static int musicfs_opt_proc (void *data, const char *arg, int key,
 						   struct fuse_args *outargs)
 {
@@ -389,16 +523,15 @@ mfs_run(int argc, char **argv)
 
 	struct fuse_args args = { argc, argv_, 1 };
 
-	/* Until we fix some bugs, these are mandatory */
-	fuse_opt_add_arg(&args, "-s");
-	fuse_opt_add_arg(&args, "-d");
-
-	if (fuse_opt_parse(&args, NULL, NULL, musicfs_opt_proc) != 0)
+	if (fuse_opt_parse(&args, &mfs_opts, mfs_opt_spec,
+	    musicfs_opt_proc) != 0)
 		exit (1);
 
 	mfs_init();
 
-	ret = 0;
-	ret = fuse_main(args.argc, args.argv, &mfs_ops, NULL);
+	if (mfs_opts.lowlevel)
+		ret = mfs_lowlevel_main(&args);
+	else
+		ret = fuse_main(args.argc, args.argv, &mfs_ops, NULL);
 	return (ret);
 }
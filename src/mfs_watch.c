@@ -0,0 +1,135 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * Musicfs is a FUSE module implementing a media filesystem in userland.
+ * Copyright (C) 2008  Ulf Lilleengen, Kjetil Ørbekk
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2, as published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A copy of the license can typically be found in COPYING
+ */
+
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <pthread.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <debug.h>
+#include <mfs_notify.h>
+#include <mfs_scanctl.h>
+#include <mfs_watch.h>
+
+static int watching;		/* Events are being delivered. */
+static int watch_full;		/* We ran out of watches. */
+
+/*
+ * Called from the notification thread for every event in a watched
+ * directory.
+ */
+static void
+mfs_watch_event(struct mfs_notify_event *ev)
+{
+	char path[MAXPATHLEN];
+	const char *dir;
+	int len;
+
+	/* Events were lost, so we don't know what changed. */
+	if (ev->ev_data == NULL) {
+		mfs_scanctl_update(NULL);
+		return;
+	}
+	dir = mfs_notify_path(ev->ev_data);
+	if (ev->ev_name != NULL)
+		len = snprintf(path, sizeof(path), "%s/%s", dir, ev->ev_name);
+	else
+		len = snprintf(path, sizeof(path), "%s", dir);
+	if (len < 0 || (size_t)len >= sizeof(path))
+		return;
+	/*
+	 * Writes to a file that is being copied keep its burst of changes
+	 * open, and it is only looked at once it has settled.
+	 */
+	mfs_scanctl_update(path);
+}
+
+/*
+ * Start watching for changes.
+ */
+int
+mfs_watch_start()
+{
+
+	if (mfs_notify_init(mfs_watch_event) != 0) {
+		DEBUG("Unable to watch the music paths for changes\n");
+		return (-1);
+	}
+	__atomic_store_n(&watching, 1, __ATOMIC_RELAXED);
+	return (0);
+}
+
+void
+mfs_watch_stop()
+{
+
+	__atomic_store_n(&watching, 0, __ATOMIC_RELAXED);
+	mfs_notify_stop();
+}
+
+/*
+ * Watch a music path as a whole, before it is scanned. This works with
+ * fanotify, when we are allowed to mark its filesystem; otherwise its
+ * directories are watched one by one.
+ */
+void
+mfs_watch_root(const char *root)
+{
+
+	if (!__atomic_load_n(&watching, __ATOMIC_RELAXED))
+		return;
+	if (mfs_notify_register_root(root) == 0)
+		DEBUG("watching all of %s with one mark\n", root);
+}
+
+/*
+ * Watch a directory in a music path. The scanner calls this before it
+ * reads the directory, so that no file added after that is missed.
+ */
+void
+mfs_watch_dir(const char *dirpath)
+{
+
+	if (!__atomic_load_n(&watching, __ATOMIC_RELAXED))
+		return;
+	if (mfs_notify_covered(dirpath))
+		return;
+	if (mfs_notify_register(dirpath) != 0 &&
+	    !__atomic_exchange_n(&watch_full, 1, __ATOMIC_RELAXED))
+		DEBUG("Unable to watch %s, changes below it will only be "
+		    "seen by the next scan\n", dirpath);
+}
+
+/*
+ * Stop watching a directory and everything below it.
+ */
+void
+mfs_watch_forget(const char *path)
+{
+
+	if (!__atomic_load_n(&watching, __ATOMIC_RELAXED))
+		return;
+	mfs_notify_unregister_tree(path);
+}